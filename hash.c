@@ -2,22 +2,179 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
 
 #include "hash.h"
 
+#if HT_USDT == 1
+#   include <sys/sdt.h>
+#endif
+
+// SIMD linear scan for tiny tables with 64-bit hashes
+#if INTPTR_MAX == INT64_MAX && (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64))
+#   include <emmintrin.h>
+#   define HT_TINY_SSE2 1
+#elif INTPTR_MAX == INT64_MAX && (defined(__aarch64__) || defined(_M_ARM64))
+#   include <arm_neon.h>
+#   define HT_TINY_NEON 1
+#endif
+
+// large page storage is only available on Linux
+#if HT_LARGE_PAGES == 1 && defined(__linux__)
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   include <unistd.h>
+#   define HT_USE_MMAP 1
+#else
+#   define HT_USE_MMAP 0
+#endif
+
+// one-time setup of the hash secret, and yielding a contended lock
+#if defined(_WIN32)
+#   include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#   include <pthread.h>
+#   include <sched.h>
+#endif
+
+// shared memory tables need POSIX shared memory and process-shared locks
+#if HT_SHM == 1 && (defined(__unix__) || defined(__APPLE__))
+#   include <errno.h>
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#   define HT_USE_SHM 1
+#   if defined(__linux__)
+#       include <sys/syscall.h>
+#       define HT_SHM_ROBUST 1 // a lock holder's death is reported to the next locker
+#   else
+        // a process dying while it holds the lock leaves it held, see ht_shm_create
+#       define HT_SHM_ROBUST 0
+#   endif
+#else
+#   define HT_USE_SHM 0
+#endif
+
 #define HT_ADD_ONLY 0
 #define HT_REPLACE  1
 
+#if defined(__GNUC__) || defined(__clang__)
+#   define HT_PREFETCH(addr)   __builtin_prefetch(addr)
+#else
+#   define HT_PREFETCH(addr)
+#endif
+
+// atomics for snapshots and counter maps used from other threads
+#if defined(_MSC_VER) && !defined(__clang__)
+#   include <intrin.h>
+    static volatile long ht_fence_word;
+#   define HT_LOAD_PAGE(pp)        ((HashTable_Entry*)_InterlockedCompareExchangePointer((void* volatile*)(pp), NULL, NULL))
+#   define HT_LOAD_FIELD(type, p)  (*(volatile type*)(p))
+#   define HT_STORE_PAGE(pp, page) _InterlockedExchangePointer((void* volatile*)(pp), page)
+#   define HT_REFS_LOAD(p)         _InterlockedCompareExchange(p, 0, 0)
+#   define HT_REFS_STORE(p, v)     _InterlockedExchange(p, v)
+#   define HT_REFS_INC(p)          _InterlockedIncrement(p)
+#   define HT_REFS_DEC(p)          _InterlockedDecrement(p)
+#   define HT_FENCE()              _InterlockedOr(&ht_fence_word, 0)
+#   define HT_FENCE_ACQUIRE()      HT_FENCE()
+#   define HT_LOAD_PTR(pp)         _InterlockedCompareExchangePointer((void* volatile*)(pp), NULL, NULL)
+#   define HT_STORE_PTR(pp, ptr)   _InterlockedExchangePointer((void* volatile*)(pp), (void*)(ptr))
+#   define HT_LOAD64(p)            _InterlockedCompareExchange64(p, 0, 0)
+#   define HT_ADD64(p, v)          _InterlockedExchangeAdd64(p, v)
+#   define HT_XCHG64(p, v)         _InterlockedExchange64(p, v)
+#   define HT_TRY_LOCK(p)          (_InterlockedCompareExchange(p, 1, 0) == 0)
+#   define HT_UNLOCK(p)            _InterlockedExchange(p, 0)
+#else
+#   define HT_LOAD_PAGE(pp)        __atomic_load_n(pp, __ATOMIC_ACQUIRE)
+#   define HT_LOAD_FIELD(type, p)  ((type)__atomic_load_n(p, __ATOMIC_RELAXED))
+#   define HT_STORE_PAGE(pp, page) __atomic_store_n(pp, page, __ATOMIC_RELEASE)
+#   define HT_REFS_LOAD(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#   define HT_REFS_STORE(p, v)     __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#   define HT_REFS_INC(p)          __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+#   define HT_REFS_DEC(p)          __atomic_sub_fetch(p, 1, __ATOMIC_ACQ_REL)
+#   define HT_FENCE()              __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#   define HT_FENCE_ACQUIRE()      __atomic_thread_fence(__ATOMIC_ACQUIRE)
+#   define HT_LOAD_PTR(pp)         __atomic_load_n(pp, __ATOMIC_ACQUIRE)
+#   define HT_STORE_PTR(pp, ptr)   __atomic_store_n(pp, ptr, __ATOMIC_RELEASE)
+#   define HT_LOAD64(p)            __atomic_load_n(p, __ATOMIC_RELAXED)
+#   define HT_ADD64(p, v)          __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#   define HT_XCHG64(p, v)         __atomic_exchange_n(p, v, __ATOMIC_RELAXED)
+#   define HT_TRY_LOCK(p)          (__atomic_exchange_n(p, 1, __ATOMIC_ACQUIRE) == 0)
+#   define HT_UNLOCK(p)            __atomic_store_n(p, 0, __ATOMIC_RELEASE)
+#endif
+
+// spin wait hint, and giving up the CPU to a lock holder
+#if defined(_MSC_VER) && !defined(__clang__) && (defined(_M_IX86) || defined(_M_X64))
+#   define HT_PAUSE()              _mm_pause()
+#elif defined(_MSC_VER) && !defined(__clang__) && defined(_M_ARM64)
+#   define HT_PAUSE()              __yield()
+#elif defined(__i386__) || defined(__x86_64__)
+#   define HT_PAUSE()              __builtin_ia32_pause()
+#elif defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+#   define HT_PAUSE()              __asm__ __volatile__("yield")
+#else
+#   define HT_PAUSE()
+#endif
+
+#if defined(_WIN32)
+#   define HT_YIELD()              SwitchToThread()
+#elif defined(__unix__) || defined(__APPLE__)
+#   define HT_YIELD()              sched_yield()
+#else
+#   define HT_YIELD()
+#endif
+
 // configuration defines
 #define HT_AUTO_GROW    1   // automatically grow table
 #define HT_DEBUG_STATS  1   // track alloc/free stats
 #define HT_MAX_FREE     16  // size of free list
+#define HT_TRACE_BUFFER 1024 // trace records buffered before writing
+#define HT_LOCK_SPINS   64  // paused spins on a held lock before yielding
 #define HT_LINEAR       0   // use linear probing
 #define HT_PERTURB      0   // randomize probes
 
 // helper macros
-#define HASH_MATCH(hte, hash, key)  (!(hte)->tombstone && (hte)->hash == hash && ht->compare_fn((hte)->key, key))
-#define HASH_EMPTY(hte)             ((hte)->tombstone || ((hte)->hash == 0 && (hte)->key == 0 && (hte)->value == 0))
+#define HASH_STALE(hte)             ((hte)->generation != ht->generation)
+#define HASH_MATCH(hte, hash, key)  (!(hte)->tombstone && !HASH_STALE(hte) && (hte)->hash == hash && ht->compare_fn((hte)->key, key))
+#define HASH_EMPTY(hte)             (HASH_STALE(hte) || (hte)->tombstone || ((hte)->hash == 0 && (hte)->key == 0 && (hte)->value == 0))
+#define HASH_UNUSED(hte)            (HASH_STALE(hte) || (!(hte)->tombstone && (hte)->key == 0))
+
+// a field of the table's optional state, or its value when there is none
+#define HT_EXT(ht, field, none)     ((ht)->ext ? (ht)->ext->field : (none))
+
+// hash a key with the table's seeded hasher, if it uses a built-in one. The
+// built-in hash_fn is that hasher keyed by the process secret.
+#define HT_HASH_KEY(ht, key)        ((ht)->ext && (ht)->ext->keyed_fn ? (ht)->ext->keyed_fn(key, (ht)->ext->seed) : (ht)->hash_fn(key))
+#define HT_SEED(ht)                 HT_EXT(ht, seed, ht_secret)
+
+// tables using a built-in string hasher
+#define HT_STRING_KEYS(ht)          ((ht)->hash_fn == string_hash_fn || (ht)->hash_fn == siphash_fn)
+
+// stored hashes carry over between tables hashing alike
+#define HT_SAME_HASH(a, b)          ((a)->hash_fn == (b)->hash_fn && (!ht_keyed_hash((a)->hash_fn) || (HT_SEED(a)[0] == HT_SEED(b)[0] && HT_SEED(a)[1] == HT_SEED(b)[1])))
+
+// grow check for the table's layout
+#define HT_NEEDS_GROW(ht)           ((ht)->mode == HT_MODE_CUCKOO ? 100 * (ht)->entries >= HT_CUCKOO_LOAD * (ht)->size : HT_INV_LOAD_FACTOR * (ht)->entries >= (ht)->size)
+
+// slot arrays start on a cache line, so a cuckoo bucket is one line
+#define TABLE_LINE                  64
+
+// hashed buckets of a cuckoo table, the stash takes the slots after them
+#define CUCKOO_BUCKETS(size)        (((size) - HT_CUCKOO_STASH) / HT_CUCKOO_SLOTS)
+#define CUCKOO_STASH(size)          ((size) - HT_CUCKOO_STASH)
+
+// bloom filter blocks are one cache line of 64-bit words
+#define BLOOM_LINE                  64
+#define BLOOM_WORDS                 (BLOOM_LINE / sizeof(uint64_t))
+#define BLOOM_BYTES(blocks)         ((blocks) * BLOOM_LINE)
+#define BLOOM_PROBES                6   // bits set per key, 9 bits of hash each
+
+// packed tiny table arrays
+#define TINY_KEYS(ht)               ((ht_key_t*)((ht)->tiny + (ht)->tiny_capacity))
+#define TINY_VALUES(ht)             ((ht_value_t*)((ht)->tiny + 2 * (ht)->tiny_capacity))
+#define TINY_BYTES(cap)             (3 * sizeof(ht_hash_t) * (cap))
 
 #ifdef _DEBUG
 #   define CHECK_THAT(cond)            assert(cond); if (!(cond)) return 0;
@@ -25,17 +182,91 @@
 #   define CHECK_THAT(cond)            if (!(cond)) return 0;
 #endif
 
+static HashTable* ht_resize(HashTable* ht, size_t new_size);
+static int ht_rehash(HashTable* ht);
+#if HT_RESEED_PROBES > 0
+static int ht_reseed(HashTable* ht, size_t probes);
+#endif
+static int ht_entry_remove(HashTable* ht, HashTable_Entry* hte);
+static int ht_snapshot_cow(HashTable *ht, size_t index);
+static void ht_snapshot_reap(HashTable *ht);
+static void ht_table_drop(HashTable *ht);
+static ht_value_t ht_snapshot_lookup(HashTable *ht, ht_hash_t hash, ht_key_t key);
+static int ht_snapshot_next(HashTable *ht, size_t *ipos, ht_key_t *pkey, ht_value_t *pvalue);
+
+// slot array shared by the live table and its views
+typedef struct ht_shared_table
+{
+    long refs;                  // live table while it owns the array, plus each view
+    HashTable_Entry *table;
+    size_t size;
+    size_t bytes;
+    const ht_allocator *allocator;
+} ht_shared_table;
+
+struct ht_snapshot
+{
+    HashTable view;             // what readers are handed
+    HashTable_Ext view_ext;
+    long refs;                  // reader, plus the live table while attached
+    struct ht_snapshot *next;   // live table's attached views
+    ht_shared_table *shared;
+    HashTable_Entry **pages;    // private page copies, NULL where unchanged
+    size_t page_count;
+    const ht_allocator *allocator;  // the table's, for the view and its pages
+};
+
+#define SNAPSHOT_PAGES(size)        (((size) + HT_SNAPSHOT_PAGE - 1) / HT_SNAPSHOT_PAGE)
+#define SNAPSHOT_WORDS(size)        ((SNAPSHOT_PAGES(size) + 63) / 64)
+
+// slots in a page, the last one may be short
+#define SNAPSHOT_PAGE_SLOTS(size, page) ((size) - (page) * HT_SNAPSHOT_PAGE < HT_SNAPSHOT_PAGE ? (size) - (page) * HT_SNAPSHOT_PAGE : HT_SNAPSHOT_PAGE)
+
+// copy a slot's page to attached snapshots before changing the slot
+#define HT_COW(ht, hte)             (!HT_EXT(ht, snapshots, NULL) || ht_snapshot_cow(ht, (size_t)((hte) - (ht)->table)))
+
+// the snapshot a view reads, NULL for live tables
+#define HT_SNAPSHOT(ht)             HT_EXT(ht, snapshot, NULL)
+
+// snapshot views of hashed tables read through their pages
+#define HT_IS_VIEW(ht)              (HT_SNAPSHOT(ht) && HT_SNAPSHOT(ht)->shared)
+
+// bloom filter blocks, NULL if the table has no filter
+#define HT_BLOOM(ht)                HT_EXT(ht, bloom, NULL)
+
+// fixed capacity of a cache table, 0 for others
+#define HT_CACHE(ht)                HT_EXT(ht, cache_capacity, 0)
+
+#if HT_TRACE == 1
+    #define HT_TRACING(ht)                                  (HT_EXT(ht, tracer, NULL) != NULL)
+    #define HT_TRACE_HASH(ht, op, hash, key, result)        if ((ht) && HT_TRACING(ht)) ht_trace_hash(ht, op, hash, key, result);
+#else
+    #define HT_TRACING(ht)                                  0
+    #define HT_TRACE_HASH(ht, op, hash, key, result)
+#endif
+
+#if HT_EVENTS == 1
+    #define HT_EVENTS_ON(ht)                (HT_USDT || HT_EXT(ht, event_fn, NULL))
+    #define HT_EVENT(ht, type, old_size, new_size)   if (HT_EVENTS_ON(ht)) ht_event_emit(ht, type, old_size, new_size, 0, 0);
+    #define HT_CHECK_PROBES(ht, probes)     if (HT_EVENTS_ON(ht) && (probes) >= HT_EXT(ht, long_probe, HT_LONG_PROBE)) ht_event_emit(ht, HT_EVENT_LONG_PROBE, (ht)->size, (ht)->size, probes, 0);
+#else
+    #define HT_EVENTS_ON(ht)                0
+    #define HT_EVENT(ht, type, old_size, new_size)
+    #define HT_CHECK_PROBES(ht, probes)
+#endif
+
 // maintain a free list of already alloc'd tables
 static HashTable *ht_free_list[HT_MAX_FREE];
 static int ht_free_count = 0;
 
 #if HT_DEBUG_STATS == 1
-    static size_t allocs = 0;
-    static size_t frees = 0;
-    static size_t resuse = 0;
-    #define HT_ALLOC_INC allocs++
-    #define HT_FREE_INC frees++
-    #define HT_RESUSE resuse++
+    // atomic, counter maps and their buffers allocate from any thread
+    static int64_t allocs = 0;
+    static int64_t frees = 0;
+    static int64_t resuse = 0;
+    #define HT_ALLOC_INC HT_ADD64(&allocs, 1)
+    #define HT_FREE_INC HT_ADD64(&frees, 1)
+    #define HT_RESUSE HT_ADD64(&resuse, 1)
 #else
     #define HT_ALLOC_INC
     #define HT_FREE_INC
@@ -64,587 +295,5715 @@ static int default_compare_fn(ht_key_t a, ht_key_t b)
 }
 
 //--------------------------------------
-// default hash is the key
+// mix the full hash so weak hash functions
+// (e.g. pointer keys) still spread over
+// cuckoo buckets and bloom blocks
 //--------------------------------------
-static ht_hash_t default_hash_fn(ht_key_t key)
+static uint64_t ht_mix_hash(ht_hash_t hash)
 {
-    CHECK_THAT(key);
-    // hash is the key pointer value
-    // this is a bad hash function for most uses, but it is fast
-    return (ht_hash_t)key;
+    uint64_t h = (uint64_t)hash;
+
+    // murmur3 finalizer
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+
+    return h;
+}
+
+//--------------------------------------
+// process secret all table seeds are
+// drawn from
+//--------------------------------------
+static uint64_t ht_secret[2];
+static int64_t ht_seed_count = 0;
+
+static uint64_t ht_siphash13(const void *data, size_t len, const uint64_t seed[2]);
+
+static void ht_secret_once()
+{
+#if HT_HASH_SEED == 1
+    FILE *fp = fopen("/dev/urandom", "rb");
+    if (fp)
+    {
+        size_t read = fread(ht_secret, sizeof(ht_secret), 1, fp);
+        fclose(fp);
+
+        if (read == 1)
+            return;
+    }
+
+    // no random device, fall back to the clock and (randomized) addresses
+    uint64_t now = (uint64_t)time(NULL);
+    ht_secret[0] = ht_mix_hash((ht_hash_t)(now ^ (uintptr_t)&now ^ (uint64_t)clock() << 32));
+    ht_secret[1] = ht_mix_hash((ht_hash_t)(ht_secret[0] ^ (uintptr_t)&ht_secret_once ^ (uintptr_t)ht_secret));
+#endif
+}
+
+#if defined(_WIN32)
+static BOOL CALLBACK ht_secret_once_win(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+    (void)once;
+    (void)param;
+    (void)context;
+    ht_secret_once();
+    return TRUE;
+}
+#endif
+
+//--------------------------------------
+// set up the secret once, whichever
+// thread first creates a table
+//--------------------------------------
+static void ht_secret_init()
+{
+#if defined(_WIN32)
+    static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+    InitOnceExecuteOnce(&once, ht_secret_once_win, NULL, NULL);
+#elif defined(__unix__) || defined(__APPLE__)
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, ht_secret_once);
+#else
+    static int ready = 0;
+    if (!ready)
+    {
+        ht_secret_once();
+        ready = 1;
+    }
+#endif
+}
+
+//--------------------------------------
+// draw a new table seed
+//--------------------------------------
+static void ht_new_seed(uint64_t seed[2])
+{
+    ht_secret_init();
+
+    // a distinct count for each table, even when created at once
+    uint64_t count = (uint64_t)HT_ADD64(&ht_seed_count, 1) + 1;
+    seed[0] = ht_siphash13(&count, sizeof(count), ht_secret);
+    count = ~count;
+    seed[1] = ht_siphash13(&count, sizeof(count), ht_secret);
 }
 
 //--------------------------------------
-// default string hash function
-// MurmurOAAT32
+// built-in hashers, keyed by the table's
+// seed. Tables call them with their own
+// seed, sets and ht_hash_analyze with the
+// process secret.
+//--------------------------------------
+
+// pointer keys (or integers cast to pointers)
+static ht_hash_t pointer_hash_keyed(ht_key_t key, const uint64_t seed[2])
+{
+    return (ht_hash_t)ht_mix_hash((ht_hash_t)((uint64_t)(uintptr_t)key ^ seed[0]));
+}
+
+//--------------------------------------
+// fast string hash, MurmurOAAT32 started
+// from the seed
 // Note: the string hasher expects the key to be a pointer to a NUL-terminated
 // C string (ht_key_t which is typedef'd to const void* in the header). It reads
 // the bytes as unsigned characters.
 //--------------------------------------
-static ht_hash_t string_hash_fn(ht_key_t key)
+static ht_hash_t string_hash_keyed(ht_key_t key, const uint64_t seed[2])
 {
     const unsigned char *s = (const unsigned char*)key;
-    ht_hash_t h = 3323198485ul;
+    uintptr_t h = (uintptr_t)(3323198485ul ^ seed[0]);
 
+    // unsigned, as signed multiplies would overflow
     for (; *s; ++s)
     {
         h ^= *s;
         h *= 0x5bd1e995;
         h ^= h >> 15;
     }
-    return h;
+    return (ht_hash_t)h;
 }
 
+#define SIP_ROTL(x, b)      (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) \
+    v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+    v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32);
+
 //--------------------------------------
-// attempt to set hash function
+// SipHash-1-3, one compression and three
+// finalization rounds
 //--------------------------------------
-int ht_set_hash_func(HashTable* ht, ht_hash_func hash_fn)
+static uint64_t ht_siphash13(const void *data, size_t len, const uint64_t seed[2])
 {
-	CHECK_THAT(ht);
+    const unsigned char *p = data;
+    uint64_t v0 = 0x736f6d6570736575ull ^ seed[0];
+    uint64_t v1 = 0x646f72616e646f6dull ^ seed[1];
+    uint64_t v2 = 0x6c7967656e657261ull ^ seed[0];
+    uint64_t v3 = 0x7465646279746573ull ^ seed[1];
+    uint64_t m;
 
-    if (hash_fn == HT_HASH_NULL)
-        ht->hash_fn = default_hash_fn;
-    else if (hash_fn == HT_HASH_STRING)
-        ht->hash_fn = string_hash_fn;
-    else
-        ht->hash_fn = hash_fn;
+    for (size_t n = len / 8; n > 0; n--, p += 8)
+    {
+        memcpy(&m, p, 8);
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
 
-    return HT_OK;
+    // last 0-7 bytes, with the length in the top byte
+    m = (uint64_t)len << 56;
+    for (size_t i = 0; i < (len & 7); i++)
+    {
+        m |= (uint64_t)p[i] << (8 * i);
+    }
+
+    v3 ^= m;
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// NUL-terminated string keys
+static ht_hash_t siphash_keyed(ht_key_t key, const uint64_t seed[2])
+{
+    return (ht_hash_t)ht_siphash13(key, strlen(key), seed);
 }
 
 //--------------------------------------
-// attempt to set compare function
+// built-in hashers keyed by the process
+// secret
 //--------------------------------------
-int ht_set_compare_func(HashTable* ht, ht_compare_func compare_fn)
+static ht_hash_t default_hash_fn(ht_key_t key)
 {
-	CHECK_THAT(ht);
+    CHECK_THAT(key);
+    return pointer_hash_keyed(key, ht_secret);
+}
 
-    if (compare_fn == NULL)
-        ht->compare_fn = default_compare_fn;
-    else
-        ht->compare_fn = compare_fn;
-    
-    return HT_OK;
+static ht_hash_t string_hash_fn(ht_key_t key)
+{
+    return string_hash_keyed(key, ht_secret);
+}
+
+static ht_hash_t siphash_fn(ht_key_t key)
+{
+    return siphash_keyed(key, ht_secret);
 }
 
 //--------------------------------------
-// initialize hash table
+// map the HT_HASH_xxx sentinels to the
+// built-in hash functions
 //--------------------------------------
-HashTable *ht_create()
+static ht_hash_func ht_resolve_hash(ht_hash_func hash_fn)
 {
-    HashTable* ht;
-    
-    // grab table from freelist if available
-    if (ht_free_count > 0)
-	{
-		ht = ht_free_list[--ht_free_count];
-        HT_RESUSE;
-	}
-	else
-	{
-		ht = HT_ALLOC(sizeof(HashTable));
-        HT_ALLOC_INC;
-    }
-    
-    if (!ht)
-    {
-        return NULL;
-    }
+    ht_secret_init();
 
-#if HT_TRACK_STATS == 1
-    ht->insert_collisions = 0;
-    ht->search_collisions = 0;
-    ht->recent_insert_collisions = 0;
-#endif
+    if (hash_fn == HT_HASH_NULL)
+        return default_hash_fn;
+    else if (hash_fn == HT_HASH_STRING)
+        return string_hash_fn;
+    else if (hash_fn == HT_HASH_SIPHASH)
+        return siphash_fn;
 
-    ht->entries = 0;
-    ht->size = HT_DEFAULT_TABLE_SIZE;
-    ht->mask = ht->size - 1;
-    ht->table = ht->small_table;
-    ht->compare_fn = default_compare_fn;
-    ht->hash_fn = default_hash_fn;
+    return hash_fn;
+}
 
-    // zero table mem
-    size_t table_size = sizeof(HashTable_Entry) * ht->size;
-    memset(ht->table, 0, table_size);
+//--------------------------------------
+// the seeded form of a built-in hasher,
+// NULL for caller supplied ones
+//--------------------------------------
+static ht_keyed_hash_func ht_keyed_hash(ht_hash_func hash_fn)
+{
+    if (hash_fn == default_hash_fn)
+        return pointer_hash_keyed;
+    else if (hash_fn == string_hash_fn)
+        return string_hash_keyed;
+    else if (hash_fn == siphash_fn)
+        return siphash_keyed;
 
-    return ht;
+    return NULL;
 }
 
 //--------------------------------------
-// free hash table
-//
-// NB: assumes entries have been free'd
+// set up a table's optional state, as
+// the table hashes now
 //--------------------------------------
-int ht_free(HashTable *ht)
+static void ht_ext_init(HashTable *ht, HashTable_Ext *ext)
 {
-    CHECK_THAT(ht && ht->table);
+    memset(ext, 0, sizeof(HashTable_Ext));
 
-    // TODO - warn if table is not empty?
-
-    // set table to default table
-    // free table
-    if (ht->table != ht->small_table)
-	{
-		HT_FREE(ht->table);
-		HT_FREE_INC;
-        ht->table = ht->small_table;
-	}
+    ext->keyed_fn = ht_keyed_hash(ht->hash_fn);
+    ext->seed[0] = ht_secret[0];
+    ext->seed[1] = ht_secret[1];
+    ext->numa_policy = HT_NUMA_DEFAULT;
 
-    // clear struct contents
-#if HT_TRACK_STATS == 1
-    ht->insert_collisions = 0;
-    ht->search_collisions = 0;
-    ht->recent_insert_collisions = 0;
+#if HT_EVENTS == 1
+    ext->long_probe = HT_LONG_PROBE;
 #endif
+}
 
-    ht->entries = 0;
-    ht->size = 0;
+//--------------------------------------
+// get a table's optional state, made on
+// first use
+//--------------------------------------
+static HashTable_Ext *ht_ext(HashTable *ht)
+{
+    if (ht->ext)
+        return ht->ext;
 
-    // add to free list
-    if (ht_free_count < HT_MAX_FREE)
-	{
-		ht_free_list[ht_free_count++] = ht;
-	}
-    else
-    {
-        HT_FREE(ht);
-        HT_FREE_INC;
-    }
+    HashTable_Ext *ext = ht->allocator->alloc(ht->allocator->ctx, sizeof(HashTable_Ext));
+    if (!ext)
+        return NULL;
 
-    return HT_OK;
+    HT_ALLOC_INC;
+    ht_ext_init(ht, ext);
+    ht->ext = ext;
+    return ext;
 }
 
 //--------------------------------------
-// cleanup the free list
+// attempt to set hash function
 //--------------------------------------
-void ht_finished()
+int ht_set_hash_func(HashTable* ht, ht_hash_func hash_fn)
 {
-    while(ht_free_count > 0)
-    {
-        HT_FREE(ht_free_list[--ht_free_count]);
-        HT_FREE_INC;
-    }
+	CHECK_THAT(ht && !HT_SNAPSHOT(ht));
+
+    ht->hash_fn = ht_resolve_hash(hash_fn);
+    if (ht->ext)
+        ht->ext->keyed_fn = ht_keyed_hash(ht->hash_fn);
+
+    return HT_OK;
 }
 
 //--------------------------------------
-// iterate over a table
+// set the seed of the table's built-in
+// hasher, rehashing any entries
 //--------------------------------------
-int ht_next(HashTable* ht, size_t *ipos, ht_key_t*pkey, ht_value_t *pvalue)
+int ht_set_seed(HashTable* ht, uint64_t seed0, uint64_t seed1)
 {
-    ht_key_t key = NULL;
-    ht_value_t value = NULL;
+    CHECK_THAT(ht && !HT_SNAPSHOT(ht));
 
-    CHECK_THAT(ht && ht->table);
-
-    // get index and check bounds
-    size_t index = *ipos;
-    if (index < 0 || index > ht->size)
+    HashTable_Ext *ext = ht_ext(ht);
+    if (!ext)
         return HT_FAIL;
 
-    // find next table entry
-    while (index < ht->size && HASH_EMPTY(&ht->table[index]))
-    {
-        index++;
-    }
+    uint64_t old_seed[2] = { ext->seed[0], ext->seed[1] };
 
-    // see if we hit the end of the table
-    if (index >= ht->size)
-        return HT_FAIL;
+    ext->seed[0] = seed0;
+    ext->seed[1] = seed1;
 
-    key = ht->table[index].key;
-    value = ht->table[index].value;
+    if (!ht_rehash(ht))
+    {
+        ext->seed[0] = old_seed[0];
+        ext->seed[1] = old_seed[1];
+        return HT_FAIL;
+    }
 
-    // point to next entry
-    *ipos = index + 1;
+    return HT_OK;
+}
 
-    // return key/value if 
-    if (pkey)
-        *pkey = key;
+//--------------------------------------
+// hash a key the way the table does
+//--------------------------------------
+ht_hash_t ht_hash(HashTable *ht, ht_key_t key)
+{
+    CHECK_THAT(ht && key);
+    return HT_HASH_KEY(ht, key);
+}
 
-    if (pvalue)
-        *pvalue = value;
+//--------------------------------------
+// attempt to set compare function
+//--------------------------------------
+int ht_set_compare_func(HashTable* ht, ht_compare_func compare_fn)
+{
+	CHECK_THAT(ht && !HT_SNAPSHOT(ht));
 
+    if (compare_fn == NULL)
+        ht->compare_fn = default_compare_fn;
+    else
+        ht->compare_fn = compare_fn;
+    
     return HT_OK;
 }
 
 //--------------------------------------
-// try to find an entry in the table
+// attempt to set table layout
 //--------------------------------------
-ht_value_t ht_find(HashTable *ht, ht_key_t key)
+int ht_set_mode(HashTable* ht, int mode)
 {
-    CHECK_THAT(ht && ht->table);
-    CHECK_THAT(key);
+    CHECK_THAT(ht && !HT_SNAPSHOT(ht));
+    CHECK_THAT(mode == HT_MODE_PROBE || mode == HT_MODE_CUCKOO);
 
-    // check for empty table
-    if (ht->entries == 0)
-        return NULL;
+    // the layout can only change while the table is empty
+    CHECK_THAT(ht->entries == 0);
 
-    ht_hash_t hash = ht->hash_fn(key);
+    // caches evict from the probed layout only
+    CHECK_THAT(!HT_CACHE(ht) || mode == HT_MODE_PROBE);
 
+    ht->mode = (uint8_t)mode;
+    return HT_OK;
+}
+
+//--------------------------------------
+// default allocator uses the HT_ALLOC family
+//--------------------------------------
+static void *default_alloc_fn(void *ctx, size_t size)
+{
+    (void)ctx;
+    return HT_ALLOC(size);
+}
+
+static void *default_realloc_fn(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    (void)ctx;
+    (void)old_size;
+    return HT_REALLOC(ptr, new_size);
+}
+
+static void default_free_fn(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    (void)size;
+    HT_FREE(ptr);
+}
+
+static const ht_allocator ht_default_allocator = { default_alloc_fn, default_realloc_fn, default_free_fn, NULL };
+
+//--------------------------------------
+// arena blocks are chained, newest first
+//--------------------------------------
+struct ht_arena_block
+{
+    ht_arena_block *next;
+    size_t size;
+};
+
+#define HT_ARENA_ALIGN          16
+#define HT_ARENA_ROUND(n)       (((n) + HT_ARENA_ALIGN - 1) & ~(size_t)(HT_ARENA_ALIGN - 1))
+#define HT_ARENA_HEADER         HT_ARENA_ROUND(sizeof(ht_arena_block))
+#define HT_ARENA_DATA(block)    ((char*)(block) + HT_ARENA_HEADER)
+
+//--------------------------------------
+// bump allocate from the arena
+//--------------------------------------
+static void *arena_alloc_fn(void *ctx, size_t size)
+{
+    ht_arena *arena = ctx;
+    ht_arena_block *block = arena->blocks;
+
+    size = HT_ARENA_ROUND(size);
+
+    // start a new block if the current one is full
+    if (!block || arena->used + size > block->size)
+    {
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+
+        block = HT_ALLOC(HT_ARENA_HEADER + block_size);
+        if (!block)
+            return NULL;
+
+        HT_ALLOC_INC;
+        block->size = block_size;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->used = 0;
+    }
+
+    arena->last = HT_ARENA_DATA(block) + arena->used;
+    arena->used += size;
+    return arena->last;
+}
+
+//--------------------------------------
+// grow in place if this was the last allocation
+//--------------------------------------
+static void *arena_realloc_fn(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    ht_arena *arena = ctx;
+
+    if (!ptr)
+        return arena_alloc_fn(ctx, new_size);
+
+    if (ptr == arena->last)
+    {
+        size_t offset = (char*)ptr - HT_ARENA_DATA(arena->blocks);
+        if (offset + HT_ARENA_ROUND(new_size) <= arena->blocks->size)
+        {
+            arena->used = offset + HT_ARENA_ROUND(new_size);
+            return ptr;
+        }
+    }
+
+    void *p = arena_alloc_fn(ctx, new_size);
+    if (p)
+        memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+
+    return p;
+}
+
+//--------------------------------------
+// individual frees are no-ops
+//--------------------------------------
+static void arena_free_fn(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    (void)ptr;
+    (void)size;
+}
+
+//--------------------------------------
+// initialize an empty arena
+//--------------------------------------
+void ht_arena_init(ht_arena *arena, size_t block_size)
+{
+    if (!arena)
+        return;
+
+    arena->allocator.alloc = arena_alloc_fn;
+    arena->allocator.realloc = arena_realloc_fn;
+    arena->allocator.free = arena_free_fn;
+    arena->allocator.ctx = arena;
+    arena->blocks = NULL;
+    arena->block_size = block_size ? block_size : HT_ARENA_BLOCK_SIZE;
+    arena->used = 0;
+    arena->last = NULL;
+}
+
+//--------------------------------------
+// get the allocator for an arena
+//--------------------------------------
+const ht_allocator *ht_arena_allocator(ht_arena *arena)
+{
+    CHECK_THAT(arena);
+    return &arena->allocator;
+}
+
+//--------------------------------------
+// release everything allocated from the arena
+//
+// NB: all tables created with the arena become invalid
+//--------------------------------------
+void ht_arena_reset(ht_arena *arena)
+{
+    if (!arena || !arena->blocks)
+        return;
+
+    // keep the most recent block around for reuse
+    ht_arena_block *block = arena->blocks->next;
+    while (block)
+    {
+        ht_arena_block *next = block->next;
+        HT_FREE(block);
+        HT_FREE_INC;
+        block = next;
+    }
+
+    arena->blocks->next = NULL;
+    arena->used = 0;
+    arena->last = NULL;
+}
+
+//--------------------------------------
+// release the arena and all of its blocks
+//--------------------------------------
+void ht_arena_destroy(ht_arena *arena)
+{
+    if (!arena)
+        return;
+
+    ht_arena_reset(arena);
+
+    if (arena->blocks)
+    {
+        HT_FREE(arena->blocks);
+        HT_FREE_INC;
+        arena->blocks = NULL;
+    }
+}
+
+//--------------------------------------
+// current time for event durations and
+// hash timing
+//--------------------------------------
+static uint64_t ht_now_ns()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#if HT_EVENTS == 1
+
+//--------------------------------------
+// report an event to tracepoints and
+// the table's event callback
+//--------------------------------------
+static void ht_event_emit(HashTable *ht, int type, size_t old_size, size_t new_size, size_t probes, uint64_t duration_ns)
+{
+#if HT_USDT == 1
+    switch (type)
+    {
+    case HT_EVENT_RESIZE_START: DTRACE_PROBE3(hashtable, resize__start, ht, old_size, new_size); break;
+    case HT_EVENT_RESIZE_END:   DTRACE_PROBE4(hashtable, resize__end, ht, old_size, new_size, duration_ns); break;
+    case HT_EVENT_LONG_PROBE:   DTRACE_PROBE2(hashtable, long__probe, ht, probes); break;
+    case HT_EVENT_ALLOC_FAIL:   DTRACE_PROBE2(hashtable, alloc__fail, ht, new_size); break;
+    case HT_EVENT_SHRINK:       DTRACE_PROBE3(hashtable, shrink, ht, old_size, new_size); break;
+    case HT_EVENT_TABLE_FULL:   DTRACE_PROBE2(hashtable, table__full, ht, old_size); break;
+    case HT_EVENT_RESEED:       DTRACE_PROBE2(hashtable, reseed, ht, probes); break;
+    }
+#endif
+
+    if (ht->ext && ht->ext->event_fn)
+    {
+        ht_event event = { type, old_size, new_size, probes, duration_ns };
+        ht->ext->event_fn(ht, &event, ht->ext->event_ctx);
+    }
+}
+
+#endif // HT_EVENTS
+
+//--------------------------------------
+// set event callback, and the probe
+// length counted as a long probe
+//--------------------------------------
+int ht_set_event_func(HashTable* ht, ht_event_func event_fn, void *ctx, size_t long_probe)
+{
+#if HT_EVENTS == 1
+    CHECK_THAT(ht);
+
+    // nothing to store for a table left at the defaults
+    if (!event_fn && !long_probe && !ht->ext)
+        return HT_OK;
+
+    HashTable_Ext *ext = ht_ext(ht);
+    if (!ext)
+        return HT_FAIL;
+
+    ext->event_fn = event_fn;
+    ext->event_ctx = ctx;
+    ext->long_probe = long_probe ? long_probe : HT_LONG_PROBE;
+    return HT_OK;
+#else
+    return HT_FAIL;
+#endif
+}
+
+//--------------------------------------
+// set NUMA placement for large tables
+//--------------------------------------
+int ht_set_numa_policy(HashTable* ht, int policy)
+{
+    CHECK_THAT(ht);
+    CHECK_THAT(policy == HT_NUMA_DEFAULT || policy == HT_NUMA_LOCAL || policy == HT_NUMA_INTERLEAVE);
+
+    if (policy == HT_NUMA_DEFAULT && !ht->ext)
+        return HT_OK;
+
+    HashTable_Ext *ext = ht_ext(ht);
+    if (!ext)
+        return HT_FAIL;
+
+    // only affects backing tables allocated from now on
+    ext->numa_policy = policy;
+    return HT_OK;
+}
+
+#if HT_USE_MMAP == 1
+
+#define HT_HUGE_2MB ((size_t)2 << 20)
+#define HT_HUGE_1GB ((size_t)1 << 30)
+
+#ifndef MAP_HUGE_SHIFT
+#   define MAP_HUGE_SHIFT 26
+#endif
+
+#ifndef MAP_HUGE_1GB
+#   define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+// mbind(2) policies, defined here to avoid a libnuma dependency
+#define HT_MPOL_INTERLEAVE  3
+#define HT_MPOL_LOCAL       4
+
+//--------------------------------------
+// apply NUMA policy to a fresh mapping
+//--------------------------------------
+static void ht_numa_bind(void *addr, size_t len, int policy)
+{
+#ifdef SYS_mbind
+    unsigned long nodes = ~0ul;
+
+    // best effort, the kernel clamps the mask to the allowed nodes
+    if (policy == HT_NUMA_INTERLEAVE)
+        syscall(SYS_mbind, addr, len, HT_MPOL_INTERLEAVE, &nodes, sizeof(nodes) * 8, 0);
+    else if (policy == HT_NUMA_LOCAL)
+        syscall(SYS_mbind, addr, len, HT_MPOL_LOCAL, NULL, 0, 0);
+#endif
+}
+
+//--------------------------------------
+// map zeroed, huge page aligned memory
+//--------------------------------------
+static void *ht_map_large(size_t bytes, size_t *pmapped)
+{
+    void *mem;
+
+    // explicit 1GB pages only succeed if the admin reserved some
+    if (bytes >= HT_HUGE_1GB)
+    {
+        size_t len = (bytes + HT_HUGE_1GB - 1) & ~(HT_HUGE_1GB - 1);
+        mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+        if (mem != MAP_FAILED)
+        {
+            *pmapped = len;
+            return mem;
+        }
+    }
+
+    // otherwise over-map so we can trim to a 2MB boundary for THP
+    size_t len = (bytes + HT_HUGE_2MB - 1) & ~(HT_HUGE_2MB - 1);
+    char *raw = mmap(NULL, len + HT_HUGE_2MB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        return NULL;
+
+    char *aligned = (char*)(((uintptr_t)raw + HT_HUGE_2MB - 1) & ~(uintptr_t)(HT_HUGE_2MB - 1));
+    size_t head = aligned - raw;
+    size_t tail = HT_HUGE_2MB - head;
+
+    if (head)
+        munmap(raw, head);
+    if (tail)
+        munmap(aligned + len, tail);
+
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, len, MADV_HUGEPAGE);
+#endif
+
+    *pmapped = len;
+    return aligned;
+}
+
+#endif // HT_USE_MMAP
+
+//--------------------------------------
+// allocate a zeroed backing table
+//--------------------------------------
+static HashTable_Entry *ht_table_alloc(HashTable *ht, size_t size, size_t *pbytes, int zero)
+{
+    size_t table_size = sizeof(HashTable_Entry) * size;
+    HashTable_Entry *table;
+
+    *pbytes = 0;
+
+#if HT_USE_MMAP == 1
+    // large tables get lazily zeroed pages straight from the kernel, their mapped length is kept with the table
+    if (ht->allocator == &ht_default_allocator && table_size >= HT_LARGE_TABLE_BYTES && ht_ext(ht))
+    {
+        table = ht_map_large(table_size, pbytes);
+        if (table)
+        {
+            ht_numa_bind(table, *pbytes, ht->ext->numa_policy);
+            return table;
+        }
+    }
+#endif
+
+    // over-allocate to align slots to cache lines, the byte before the first slot holds the offset
+    unsigned char *mem = ht->allocator->alloc(ht->allocator->ctx, table_size + TABLE_LINE);
+    if (!mem)
+        return NULL;
+
+    size_t offset = TABLE_LINE - ((uintptr_t)mem & (TABLE_LINE - 1));
+    table = (HashTable_Entry*)(mem + offset);
+    mem[offset - 1] = (unsigned char)offset;
+
+    // clones overwrite every slot, so they skip zeroing
+    if (zero)
+        memset(table, 0, table_size);
+
+    return table;
+}
+
+//--------------------------------------
+// release a backing table
+//--------------------------------------
+static void ht_table_release(const ht_allocator *allocator, HashTable_Entry *table, size_t size, size_t bytes)
+{
+#if HT_USE_MMAP == 1
+    if (bytes)
+    {
+        munmap(table, bytes);
+        return;
+    }
+#endif
+
+    unsigned char *first = (unsigned char*)table;
+    allocator->free(allocator->ctx, first - first[-1], sizeof(HashTable_Entry) * size + TABLE_LINE);
+}
+
+static void ht_table_free(HashTable *ht, HashTable_Entry *table, size_t size, size_t bytes)
+{
+    ht_table_release(ht->allocator, table, size, bytes);
+}
+
+// written at the start of every trace
+static const char ht_trace_magic[8] = { 'H', 'T', 'T', 'R', 'A', 'C', 'E', '2' };
+
+#if HT_TRACE == 1
+
+struct ht_tracer
+{
+    FILE *fp;
+    size_t count;
+    uint16_t next_id;
+    uint64_t seed[2];       // key id secret, never written
+    ht_trace_record records[HT_TRACE_BUFFER];
+};
+
+//--------------------------------------
+// write out buffered trace records
+//--------------------------------------
+static int ht_trace_flush(ht_tracer *tracer)
+{
+    size_t count = tracer->count;
+
+    tracer->count = 0;
+    return fwrite(tracer->records, sizeof(ht_trace_record), count, tracer->fp) == count;
+}
+
+//--------------------------------------
+// append a trace record
+//--------------------------------------
+static void ht_trace_hash(HashTable *ht, int op, ht_hash_t hash, ht_key_t key, int result)
+{
+    ht_tracer *tracer = ht->ext->tracer;
+    ht_trace_record *rec = &tracer->records[tracer->count];
+
+    rec->hash = (uint64_t)hash;
+    rec->key_len = 0;
+    rec->key_id = 0;
+    if (key && HT_STRING_KEYS(ht))
+    {
+        rec->key_len = (uint32_t)strlen(key);
+        rec->key_id = ht_siphash13(key, rec->key_len, tracer->seed);
+    }
+    else if (key)
+    {
+        rec->key_len = (uint32_t)sizeof(ht_key_t);
+        rec->key_id = ht_siphash13(&key, sizeof(key), tracer->seed);
+    }
+    rec->table_id = ht->ext->trace_id;
+    rec->op = (uint8_t)op;
+    rec->result = (uint8_t)result;
+
+    if (++tracer->count == HT_TRACE_BUFFER)
+        ht_trace_flush(tracer);
+}
+
+#endif // HT_TRACE
+
+//--------------------------------------
+// start a trace written to fp
+//--------------------------------------
+ht_tracer *ht_trace_open(FILE *fp)
+{
+#if HT_TRACE == 1
+    CHECK_THAT(fp);
+
+    ht_tracer *tracer = HT_ALLOC(sizeof(ht_tracer));
+    if (!tracer)
+        return NULL;
+
+    HT_ALLOC_INC;
+    tracer->fp = fp;
+    tracer->count = 0;
+    tracer->next_id = 0;
+    ht_new_seed(tracer->seed);
+
+    if (fwrite(ht_trace_magic, sizeof(ht_trace_magic), 1, fp) != 1)
+    {
+        HT_FREE(tracer);
+        HT_FREE_INC;
+        return NULL;
+    }
+
+    return tracer;
+#else
+    return NULL;
+#endif
+}
+
+//--------------------------------------
+// record a table's operations to tracer,
+// NULL stops recording
+//--------------------------------------
+int ht_trace_attach(HashTable *ht, ht_tracer *tracer)
+{
+#if HT_TRACE == 1
+    CHECK_THAT(ht);
+
+    if (!tracer && !ht->ext)
+        return HT_OK;
+
+    HashTable_Ext *ext = ht_ext(ht);
+    if (!ext)
+        return HT_FAIL;
+
+    ext->tracer = tracer;
+    if (tracer)
+        ext->trace_id = tracer->next_id++;
+
+    return HT_OK;
+#else
+    return HT_FAIL;
+#endif
+}
+
+//--------------------------------------
+// flush and release a tracer
+//
+// NB: detach tables first, fp is not closed
+//--------------------------------------
+int ht_trace_close(ht_tracer *tracer)
+{
+#if HT_TRACE == 1
+    CHECK_THAT(tracer);
+
+    int result = ht_trace_flush(tracer) && fflush(tracer->fp) == 0;
+
+    HT_FREE(tracer);
+    HT_FREE_INC;
+    return result ? HT_OK : HT_FAIL;
+#else
+    return HT_FAIL;
+#endif
+}
+
+//--------------------------------------
+// check for a valid trace header
+//--------------------------------------
+int ht_trace_read_header(FILE *fp)
+{
+    char magic[sizeof(ht_trace_magic)];
+
+    CHECK_THAT(fp);
+
+    if (fread(magic, sizeof(magic), 1, fp) != 1)
+        return HT_FAIL;
+
+    return memcmp(magic, ht_trace_magic, sizeof(magic)) == 0 ? HT_OK : HT_FAIL;
+}
+
+//--------------------------------------
+// read the next trace record
+//--------------------------------------
+int ht_trace_read(FILE *fp, ht_trace_record *record)
+{
+    CHECK_THAT(fp && record);
+    return fread(record, sizeof(ht_trace_record), 1, fp) == 1 ? HT_OK : HT_FAIL;
+}
+
+//--------------------------------------
+// free a table's bloom filter
+//--------------------------------------
+static void ht_bloom_release(HashTable *ht)
+{
+    HashTable_Ext *ext = ht->ext;
+    if (!ext)
+        return;
+
+    if (ext->bloom_mem)
+    {
+        ht->allocator->free(ht->allocator->ctx, ext->bloom_mem, BLOOM_BYTES(ext->bloom_mask + 1) + BLOOM_LINE);
+        HT_FREE_INC;
+    }
+
+    ext->bloom_mem = NULL;
+    ext->bloom = NULL;
+    ext->bloom_mask = 0;
+}
+
+//--------------------------------------
+// the bits for a hash all lie in one
+// cache line sized block
+//--------------------------------------
+static uint64_t *ht_bloom_block(HashTable *ht, ht_hash_t hash, uint64_t *pbits)
+{
+    uint64_t mixed = ht_mix_hash(hash);
+
+    // high bits of the product depend on every bit of the mixed hash
+    *pbits = (mixed * 0x9e3779b97f4a7c15ull) >> 10;
+    return &ht->ext->bloom[(mixed & ht->ext->bloom_mask) * BLOOM_WORDS];
+}
+
+//--------------------------------------
+// add a hash to the bloom filter
+//--------------------------------------
+static void ht_bloom_add(HashTable *ht, ht_hash_t hash)
+{
+    uint64_t bits;
+    uint64_t *block = ht_bloom_block(ht, hash, &bits);
+
+    for (int i = 0; i < BLOOM_PROBES; i++, bits >>= 9)
+    {
+        block[(bits >> 6) & (BLOOM_WORDS - 1)] |= 1ull << (bits & 63);
+    }
+}
+
+//--------------------------------------
+// test if a hash may be in the table
+//--------------------------------------
+static int ht_bloom_test(HashTable *ht, ht_hash_t hash)
+{
+    uint64_t bits;
+    uint64_t *block = ht_bloom_block(ht, hash, &bits);
+
+    for (int i = 0; i < BLOOM_PROBES; i++, bits >>= 9)
+    {
+        if (!(block[(bits >> 6) & (BLOOM_WORDS - 1)] & (1ull << (bits & 63))))
+            return 0;
+    }
+
+    return 1;
+}
+
+//--------------------------------------
+// size the bloom filter for the current
+// table and add every entry. Stale bits
+// left by removals are dropped here.
+//--------------------------------------
+static void ht_bloom_build(HashTable *ht)
+{
+    ht_bloom_release(ht);
+
+    // tiny tables scan a few packed hashes, no filter needed
+    HashTable_Ext *ext = ht->ext;
+    if (!ext || !ext->use_bloom || !ht->table)
+        return;
+
+    size_t blocks = 1;
+    while (BLOOM_BYTES(blocks) * 8 < ht->size * HT_BLOOM_BITS)
+    {
+        blocks <<= 1;
+    }
+
+    // over-allocate to align blocks to cache lines
+    ext->bloom_mem = ht->allocator->alloc(ht->allocator->ctx, BLOOM_BYTES(blocks) + BLOOM_LINE);
+    if (!ext->bloom_mem)
+    {
+        // lookups go straight to the table without a filter
+        return;
+    }
+
+    HT_ALLOC_INC;
+
+    ext->bloom = (uint64_t*)(((uintptr_t)ext->bloom_mem + BLOOM_LINE - 1) & ~(uintptr_t)(BLOOM_LINE - 1));
+    ext->bloom_mask = blocks - 1;
+    memset(ext->bloom, 0, BLOOM_BYTES(blocks));
+
+    for (size_t i = 0; i < ht->size; i++)
+    {
+        if (!HASH_EMPTY(&ht->table[i]))
+            ht_bloom_add(ht, ht->table[i].hash);
+    }
+}
+
+//--------------------------------------
+// enable or disable the bloom filter
+//--------------------------------------
+int ht_set_bloom(HashTable* ht, int enable)
+{
+    CHECK_THAT(ht && !HT_SNAPSHOT(ht));
+
+    if (!enable && !ht->ext)
+        return HT_OK;
+
+    HashTable_Ext *ext = ht_ext(ht);
+    if (!ext)
+        return HT_FAIL;
+
+    ext->use_bloom = enable != 0;
+    ht_bloom_build(ht);
+    return HT_OK;
+}
+
+//--------------------------------------
+// initialize hash table
+//--------------------------------------
+HashTable *ht_create()
+{
+    return ht_create_with_allocator(NULL);
+}
+
+//--------------------------------------
+// initialize hash table using allocator
+//--------------------------------------
+HashTable *ht_create_with_allocator(const ht_allocator *allocator)
+{
+    HashTable* ht;
+
+    if (!allocator)
+        allocator = &ht_default_allocator;
+
+    // grab table from freelist if available
+    if (allocator == &ht_default_allocator && ht_free_count > 0)
+	{
+		ht = ht_free_list[--ht_free_count];
+        HT_RESUSE;
+	}
+	else
+	{
+		ht = allocator->alloc(allocator->ctx, sizeof(HashTable));
+        HT_ALLOC_INC;
+    }
+    
+    if (!ht)
+    {
+        return NULL;
+    }
+
+    ht->allocator = allocator;
+    ht->mode = HT_MODE_PROBE;
+    ht->stashed = 0;
+
+#if HT_TRACK_STATS == 1
+    ht->insert_collisions = 0;
+    ht->search_collisions = 0;
+    ht->recent_insert_collisions = 0;
+#endif
+
+    ht->entries = 0;
+    ht->size = HT_DEFAULT_TABLE_SIZE;
+    ht->mask = ht->size - 1;
+    ht->table = NULL;
+    ht->compare_fn = default_compare_fn;
+    ht->hash_fn = ht_resolve_hash(HT_HASH_NULL);
+
+    // tiny storage is allocated on first insert
+    ht->tiny = NULL;
+    ht->tiny_capacity = 0;
+
+    ht->generation = 0;
+    ht->deleted = 0;
+    ht->ext = NULL;
+
+    return ht;
+}
+
+//--------------------------------------
+// free hash table
+//
+// NB: assumes entries have been free'd
+//--------------------------------------
+int ht_free(HashTable *ht)
+{
+    CHECK_THAT(ht);
+
+    if (HT_SNAPSHOT(ht))
+        return ht_snapshot_free(ht);
+
+    // TODO - warn if table is not empty?
+
+    // free table, snapshots still reading it keep it until released
+    if (ht->table)
+	{
+		ht_table_drop(ht);
+        ht->table = NULL;
+	}
+
+    if (ht->tiny)
+    {
+        ht->allocator->free(ht->allocator->ctx, ht->tiny, TINY_BYTES(ht->tiny_capacity));
+        HT_FREE_INC;
+        ht->tiny = NULL;
+        ht->tiny_capacity = 0;
+    }
+
+    ht_bloom_release(ht);
+
+    if (ht->ext)
+    {
+        ht->allocator->free(ht->allocator->ctx, ht->ext, sizeof(HashTable_Ext));
+        HT_FREE_INC;
+        ht->ext = NULL;
+    }
+
+    // clear struct contents
+#if HT_TRACK_STATS == 1
+    ht->insert_collisions = 0;
+    ht->search_collisions = 0;
+    ht->recent_insert_collisions = 0;
+#endif
+
+    ht->entries = 0;
+    ht->size = 0;
+
+    // add to free list
+    if (ht->allocator == &ht_default_allocator && ht_free_count < HT_MAX_FREE)
+	{
+		ht_free_list[ht_free_count++] = ht;
+	}
+    else
+    {
+        ht->allocator->free(ht->allocator->ctx, ht, sizeof(HashTable));
+        HT_FREE_INC;
+    }
+
+    return HT_OK;
+}
+
+//--------------------------------------
+// cleanup the free list
+//--------------------------------------
+void ht_finished()
+{
+    while(ht_free_count > 0)
+    {
+        HT_FREE(ht_free_list[--ht_free_count]);
+        HT_FREE_INC;
+    }
+}
+
+//--------------------------------------
+// advance iterator to the next entry
+//--------------------------------------
+static int ht_next_entry(HashTable* ht, size_t *ipos, ht_key_t*pkey, ht_value_t *pvalue)
+{
+    ht_key_t key = NULL;
+    ht_value_t value = NULL;
+
+    CHECK_THAT(ht);
+
+    // get index and check bounds
+    size_t index = *ipos;
+    if (index < 0 || index > ht->size)
+        return HT_FAIL;
+
+    // tiny tables are packed, so every index below entries is in use
+    if (!ht->table)
+    {
+        if (HT_IS_VIEW(ht))
+            return ht_snapshot_next(ht, ipos, pkey, pvalue);
+
+        if (index >= ht->entries)
+            return HT_FAIL;
+
+        *ipos = index + 1;
+
+        if (pkey)
+            *pkey = TINY_KEYS(ht)[index];
+
+        if (pvalue)
+            *pvalue = TINY_VALUES(ht)[index];
+
+        return HT_OK;
+    }
+
+    // find next table entry
+    while (index < ht->size && HASH_EMPTY(&ht->table[index]))
+    {
+        index++;
+    }
+
+    // see if we hit the end of the table
+    if (index >= ht->size)
+        return HT_FAIL;
+
+    key = ht->table[index].key;
+    value = ht->table[index].value;
+
+    // point to next entry
+    *ipos = index + 1;
+
+    // return key/value if 
+    if (pkey)
+        *pkey = key;
+
+    if (pvalue)
+        *pvalue = value;
+
+    return HT_OK;
+}
+
+//--------------------------------------
+// iterate over a table
+//--------------------------------------
+int ht_next(HashTable* ht, size_t *ipos, ht_key_t*pkey, ht_value_t *pvalue)
+{
+    int result = ht_next_entry(ht, ipos, pkey, pvalue);
+
+    HT_TRACE_HASH(ht, HT_OP_NEXT, 0, NULL, result);
+    return result;
+}
+
+//--------------------------------------
+// copy out up to n entries
+//--------------------------------------
+static size_t ht_next_entries(HashTable* ht, size_t *ipos, ht_key_t *keys, ht_value_t *values, size_t n)
+{
+    CHECK_THAT(ht && ipos);
+
+    size_t index = *ipos;
+    size_t count = 0;
+
+    if (!ht->table)
+    {
+        // views read slot by slot
+        if (HT_IS_VIEW(ht))
+        {
+            while (count < n && ht_snapshot_next(ht, ipos, keys ? &keys[count] : NULL, values ? &values[count] : NULL))
+                count++;
+
+            return count;
+        }
+
+        if (index >= ht->entries)
+            return 0;
+
+        count = ht->entries - index;
+        if (count > n)
+            count = n;
+
+        if (keys)
+            memcpy(keys, TINY_KEYS(ht) + index, count * sizeof(ht_key_t));
+
+        if (values)
+            memcpy(values, TINY_VALUES(ht) + index, count * sizeof(ht_value_t));
+
+        *ipos = index + count;
+        return count;
+    }
+
+    HashTable_Entry *hte = ht->table + index;
+    for (; index < ht->size && count < n; index++, hte++)
+    {
+        if (HASH_EMPTY(hte))
+            continue;
+
+        if (keys)
+            keys[count] = hte->key;
+
+        if (values)
+            values[count] = hte->value;
+
+        count++;
+    }
+
+    *ipos = index;
+    return count;
+}
+
+//--------------------------------------
+// iterate over a table, up to n entries
+// at a time
+//--------------------------------------
+size_t ht_next_batch(HashTable* ht, size_t *ipos, ht_key_t *keys, ht_value_t *values, size_t n)
+{
+    size_t count = ht_next_entries(ht, ipos, keys, values, n);
+
+#if HT_TRACE == 1
+    // recorded as the equivalent run of ht_next calls
+    for (size_t i = 0; ht && HT_TRACING(ht) && i < count; i++)
+    {
+        ht_trace_hash(ht, HT_OP_NEXT, 0, NULL, HT_OK);
+    }
+#endif
+
+    return count;
+}
+
+// match masks are one unsigned bit per tiny slot
+#if HT_TINY_SIZE >= 32
+#   error HT_TINY_SIZE must be less than 32
+#endif
+
+//--------------------------------------
+// bitmask of tiny slots whose hash matches
+//--------------------------------------
+static unsigned ht_tiny_match(const ht_hash_t *hashes, size_t count, ht_hash_t hash)
+{
+    unsigned matches = 0;
+    size_t i = 0;
+
+    // capacity is even, so reading hashes in pairs stays in bounds
+#if defined(HT_TINY_SSE2)
+    __m128i needle = _mm_set1_epi64x((long long)hash);
+    for (; i < count; i += 2)
+    {
+        __m128i cmp = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i*)(hashes + i)), needle);
+        int m = _mm_movemask_ps(_mm_castsi128_ps(cmp));
+
+        // both 32-bit halves must match
+        matches |= (unsigned)(((m & 3) == 3) | (((m & 12) == 12) << 1)) << i;
+    }
+#elif defined(HT_TINY_NEON)
+    uint64x2_t needle = vdupq_n_u64((uint64_t)hash);
+    for (; i < count; i += 2)
+    {
+        uint64x2_t cmp = vceqq_u64(vld1q_u64((const uint64_t*)(hashes + i)), needle);
+        matches |= (unsigned)((vgetq_lane_u64(cmp, 0) & 1) | ((vgetq_lane_u64(cmp, 1) & 1) << 1)) << i;
+    }
+#else
+    for (; i < count; i++)
+    {
+        matches |= (unsigned)(hashes[i] == hash) << i;
+    }
+#endif
+
+    // drop the lane past the end when count is odd
+    return matches & ((1u << count) - 1);
+}
+
+//--------------------------------------
+// find index of key in a tiny table, or -1
+//--------------------------------------
+static int ht_tiny_find(HashTable *ht, ht_hash_t hash, ht_key_t key)
+{
+    unsigned matches = ht_tiny_match(ht->tiny, ht->entries, hash);
+    ht_key_t *keys = TINY_KEYS(ht);
+
+    for (int i = 0; matches; i++, matches >>= 1)
+    {
+        if ((matches & 1) && ht->compare_fn(keys[i], key))
+            return i;
+    }
+
+    return -1;
+}
+
+//--------------------------------------
+// make room for one more tiny entry
+//--------------------------------------
+static int ht_tiny_reserve(HashTable *ht)
+{
+    if (ht->entries < ht->tiny_capacity)
+        return HT_OK;
+
+    size_t old_cap = ht->tiny_capacity;
+    size_t new_cap = old_cap ? old_cap << 1 : 2;
+
+    ht_hash_t *tiny = ht->allocator->realloc(ht->allocator->ctx, ht->tiny, TINY_BYTES(old_cap), TINY_BYTES(new_cap));
+    if (!tiny)
+    {
+        HT_EVENT(ht, HT_EVENT_ALLOC_FAIL, TINY_BYTES(old_cap), TINY_BYTES(new_cap));
+        return HT_FAIL;
+    }
+
+    if (!ht->tiny)
+        HT_ALLOC_INC;
+
+    // spread keys and values out to their new offsets, values first
+    memmove(tiny + 2 * new_cap, tiny + 2 * old_cap, old_cap * sizeof(ht_hash_t));
+    memmove(tiny + new_cap, tiny + old_cap, old_cap * sizeof(ht_hash_t));
+
+    ht->tiny = tiny;
+    ht->tiny_capacity = (uint16_t)new_cap;
+    return HT_OK;
+}
+
+//--------------------------------------
+// an entry's two cuckoo buckets, each
+// half of the mixed hash picks one. The
+// bucket count needn't be a power of 2.
+//--------------------------------------
+static size_t ht_cuckoo_first(uint64_t mixed, size_t buckets)
+{
+    return (size_t)(((mixed & 0xffffffffull) * buckets) >> 32);
+}
+
+static size_t ht_cuckoo_second(uint64_t mixed, size_t buckets)
+{
+    size_t first = ht_cuckoo_first(mixed, buckets);
+    size_t second = (size_t)(((mixed >> 32) * buckets) >> 32);
+
+    if (second != first)
+        return second;
+
+    return first + 1 < buckets ? first + 1 : 0;
+}
+
+//--------------------------------------
+// either bucket of an entry leads to
+// the other
+//--------------------------------------
+static size_t ht_cuckoo_alt(uint64_t mixed, size_t bucket, size_t buckets)
+{
+    size_t first = ht_cuckoo_first(mixed, buckets);
+    return bucket == first ? ht_cuckoo_second(mixed, buckets) : first;
+}
+
+//--------------------------------------
+// find a key in its two cuckoo buckets,
+// then the stash if it holds anything
+//--------------------------------------
+static HashTable_Entry *ht_cuckoo_find(HashTable *ht, ht_hash_t hash, ht_key_t key)
+{
+    size_t buckets = CUCKOO_BUCKETS(ht->size);
+    uint64_t mixed = ht_mix_hash(hash);
+    HashTable_Entry *hte = &ht->table[ht_cuckoo_first(mixed, buckets) * HT_CUCKOO_SLOTS];
+
+    for (int i = 0; i < HT_CUCKOO_SLOTS; i++, hte++)
+    {
+        if (HASH_MATCH(hte, hash, key))
+            return hte;
+    }
+
+    HT_SEARCH_COLLIDE(ht);
+
+    hte = &ht->table[ht_cuckoo_second(mixed, buckets) * HT_CUCKOO_SLOTS];
+
+    for (int i = 0; i < HT_CUCKOO_SLOTS; i++, hte++)
+    {
+        if (HASH_MATCH(hte, hash, key))
+            return hte;
+    }
+
+    if (!ht->stashed)
+        return NULL;
+
+    hte = &ht->table[CUCKOO_STASH(ht->size)];
+
+    for (int i = 0; i < HT_CUCKOO_STASH; i++, hte++)
+    {
+        if (HASH_MATCH(hte, hash, key))
+            return hte;
+    }
+
+    return NULL;
+}
+
+//--------------------------------------
+// place an entry in the stash, NULL if
+// it is full and the table must grow
+//--------------------------------------
+static HashTable_Entry *ht_cuckoo_stash(HashTable *ht, HashTable_Entry *table, size_t size, ht_hash_t hash, ht_key_t key, ht_value_t value)
+{
+    HashTable_Entry *hte = &table[CUCKOO_STASH(size)];
+
+    for (int i = 0; i < HT_CUCKOO_STASH; i++, hte++)
+    {
+        if (!HASH_EMPTY(hte))
+            continue;
+
+        // a resize counts the new array's stash once it is filled
+        if (table == ht->table)
+        {
+            if (!HT_COW(ht, hte))
+                return NULL;
+
+            if (hte->tombstone && !HASH_STALE(hte))
+                ht->deleted--;
+
+            ht->stashed++;
+        }
+
+        hte->hash = hash;
+        hte->key = key;
+        hte->value = value;
+        hte->tombstone = 0;
+        hte->referenced = 0;
+        hte->generation = ht->generation;
+        return hte;
+    }
+
+    return NULL;
+}
+
+//--------------------------------------
+// breadth-first search for a chain of
+// displacements ending in a free slot
+//--------------------------------------
+typedef struct ht_cuckoo_node
+{
+    size_t bucket;
+    int parent;             // node index, or -1 for the key's own buckets
+    int slot;               // slot in the parent bucket that moves here
+} ht_cuckoo_node;
+
+//--------------------------------------
+// a path through the same slot twice
+// can't be applied
+//--------------------------------------
+static int ht_cuckoo_path_repeats(const ht_cuckoo_node *nodes, int found)
+{
+    for (int a = found; nodes[a].parent >= 0; a = nodes[a].parent)
+    {
+        for (int b = nodes[a].parent; nodes[b].parent >= 0; b = nodes[b].parent)
+        {
+            if (nodes[nodes[a].parent].bucket == nodes[nodes[b].parent].bucket && nodes[a].slot == nodes[b].slot)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
+//--------------------------------------
+// place a new entry, moving others along
+// a displacement path, or in the stash
+// if there is none. Returns NULL if both
+// failed and the table must grow, nothing
+// has moved in that case.
+//--------------------------------------
+static HashTable_Entry *ht_cuckoo_place(HashTable *ht, HashTable_Entry *table, size_t size, ht_hash_t hash, ht_key_t key, ht_value_t value)
+{
+    ht_cuckoo_node nodes[HT_CUCKOO_SEARCH];
+    size_t buckets = CUCKOO_BUCKETS(size);
+    uint64_t mixed = ht_mix_hash(hash);
+    int count = 2, found = -1, found_slot = 0;
+
+    nodes[0].bucket = ht_cuckoo_first(mixed, buckets);
+    nodes[0].parent = -1;
+    nodes[1].bucket = ht_cuckoo_second(mixed, buckets);
+    nodes[1].parent = -1;
+
+    for (int n = 0; n < count && found < 0; n++)
+    {
+        HashTable_Entry *bucket = &table[nodes[n].bucket * HT_CUCKOO_SLOTS];
+
+        for (int i = 0; i < HT_CUCKOO_SLOTS; i++)
+        {
+            if (HASH_EMPTY(&bucket[i]))
+            {
+                found = n;
+                found_slot = i;
+                break;
+            }
+
+            // each resident could move to its other bucket
+            if (count < HT_CUCKOO_SEARCH)
+            {
+                nodes[count].bucket = ht_cuckoo_alt(ht_mix_hash(bucket[i].hash), nodes[n].bucket, buckets);
+                nodes[count].parent = n;
+                nodes[count].slot = i;
+                count++;
+            }
+        }
+
+        if (n >= 2)
+        {
+            HT_INSERT_COLLIDE(ht);
+        }
+    }
+
+    // keys with no usable path wait in the stash rather than growing the table
+    if (found < 0 || ht_cuckoo_path_repeats(nodes, found))
+        return ht_cuckoo_stash(ht, table, size, hash, key, value);
+
+    // shift entries back along the path, freeing a slot in the key's bucket
+    HashTable_Entry *dest = &table[nodes[found].bucket * HT_CUCKOO_SLOTS + found_slot];
+
+    // snapshots keep the pages the path rewrites, failing that the table grows
+    if (table == ht->table && HT_EXT(ht, snapshots, NULL))
+    {
+        if (!HT_COW(ht, dest))
+            return NULL;
+
+        for (int n = found; nodes[n].parent >= 0; n = nodes[n].parent)
+        {
+            if (!HT_COW(ht, &table[nodes[nodes[n].parent].bucket * HT_CUCKOO_SLOTS + nodes[n].slot]))
+                return NULL;
+        }
+    }
+
+    if (table == ht->table && dest->tombstone && !HASH_STALE(dest))
+        ht->deleted--;
+
+    for (int n = found; nodes[n].parent >= 0; n = nodes[n].parent)
+    {
+        HashTable_Entry *src = &table[nodes[nodes[n].parent].bucket * HT_CUCKOO_SLOTS + nodes[n].slot];
+        *dest = *src;
+        dest = src;
+    }
+
+    dest->hash = hash;
+    dest->key = key;
+    dest->value = value;
+    dest->tombstone = 0;
+    dest->referenced = 0;
+    dest->generation = ht->generation;
+    return dest;
+}
+
+//--------------------------------------
+// find a key's entry in the slot array
+//--------------------------------------
+static HashTable_Entry *ht_find_entry(HashTable *ht, ht_hash_t hash, ht_key_t key)
+{
+    // most misses are answered from a single filter block
+    if (HT_BLOOM(ht) && !ht_bloom_test(ht, hash))
+        return NULL;
+
+    if (ht->mode == HT_MODE_CUCKOO)
+        return ht_cuckoo_find(ht, hash, key);
+
+#if HT_PERTURB == 1
+    size_t perturb = hash;
+#else
+    size_t perturb = 0;
+#endif
+
+    int done = 0;
+    size_t probes = 0;
+
+    // look at entry based on hash
+    size_t start_bin = (size_t)hash & ht->mask;
+    size_t bin = start_bin;
+    HashTable_Entry* hte = &ht->table[start_bin];
+
+    do
+    {
+        if (HASH_MATCH(hte, hash, key))
+        {
+            HT_CHECK_PROBES(ht, probes);
+            return hte;
+        }
+
+        // inserts stop at the first never-used slot, so the key isn't further on
+        if (HASH_UNUSED(hte))
+            break;
+
+        HT_SEARCH_COLLIDE(ht);
+        probes++;
+
+        perturb >>= HT_PERTURB_VALUE;
+
+#if HT_LINEAR == 1
+        bin = (bin + perturb + 1) & ht->mask;
+#else
+        bin = (5 * bin + perturb + 1) & ht->mask;
+#endif
+        hte = &ht->table[bin];
+
+//#if HT_PERTURB != 1
+        done = bin == start_bin;
+//#endif
+    } while (!done);
+
+    HT_CHECK_PROBES(ht, probes);
+
+    // if not found, fail
+    return NULL;
+}
+
+//--------------------------------------
+// look up a key's value
+//--------------------------------------
+static ht_value_t ht_lookup_hash(HashTable *ht, ht_hash_t hash, ht_key_t key)
+{
+    CHECK_THAT(ht);
+    CHECK_THAT(key);
+
+    // check for empty table
+    if (ht->entries == 0)
+        return NULL;
+
+    if (!ht->table)
+    {
+        if (HT_IS_VIEW(ht))
+            return ht_snapshot_lookup(ht, hash, key);
+
+        int i = ht_tiny_find(ht, hash, key);
+        return i < 0 ? NULL : TINY_VALUES(ht)[i];
+    }
+
+    HashTable_Entry *hte = ht_find_entry(ht, hash, key);
+    return hte ? hte->value : NULL;
+}
+
+//--------------------------------------
+// try to find an entry in the table
+//--------------------------------------
+ht_value_t ht_find(HashTable *ht, ht_key_t key)
+{
+    CHECK_THAT(ht);
+    CHECK_THAT(key);
+
+    // check for empty table
+    if (ht->entries == 0 && !HT_TRACING(ht))
+        return NULL;
+
+    ht_hash_t hash = HT_HASH_KEY(ht, key);
+    ht_value_t value = ht_lookup_hash(ht, hash, key);
+
+    HT_TRACE_HASH(ht, HT_OP_FIND, hash, key, value != NULL);
+    return value;
+}
+
+//--------------------------------------
+// find several keys, overlapping their
+// cache misses. Values of missing keys
+// are set to NULL.
+//--------------------------------------
+size_t ht_find_many(HashTable *ht, const ht_key_t *keys, ht_value_t *values, size_t count)
+{
+    CHECK_THAT(ht);
+    CHECK_THAT(keys && values);
+
+    ht_hash_t hashes[HT_FIND_BATCH];
+    size_t found = 0;
+
+    for (size_t base = 0; base < count; base += HT_FIND_BATCH)
+    {
+        size_t n = count - base < HT_FIND_BATCH ? count - base : HT_FIND_BATCH;
+
+        // hash the batch and prefetch the first line each lookup reads
+        for (size_t i = 0; i < n; i++)
+        {
+            hashes[i] = HT_HASH_KEY(ht, keys[base + i]);
+
+            if (!ht->table)
+                continue;
+
+            if (HT_BLOOM(ht))
+            {
+                HT_PREFETCH(&ht->ext->bloom[(ht_mix_hash(hashes[i]) & ht->ext->bloom_mask) * BLOOM_WORDS]);
+            }
+            else if (ht->mode == HT_MODE_CUCKOO)
+            {
+                HT_PREFETCH(&ht->table[ht_cuckoo_first(ht_mix_hash(hashes[i]), CUCKOO_BUCKETS(ht->size)) * HT_CUCKOO_SLOTS]);
+            }
+            else
+            {
+                HT_PREFETCH(&ht->table[(size_t)hashes[i] & ht->mask]);
+            }
+        }
+
+        for (size_t i = 0; i < n; i++)
+        {
+            values[base + i] = ht_lookup_hash(ht, hashes[i], keys[base + i]);
+            found += values[base + i] != NULL;
+
+            HT_TRACE_HASH(ht, HT_OP_FIND, hashes[i], keys[base + i], values[base + i] != NULL);
+        }
+    }
+
+    return found;
+}
+
+//--------------------------------------
+// internal insert, returns the entry or
+// NULL on failure
+//--------------------------------------
+static HashTable_Entry *ht_insert_nocheck(HashTable *ht, HashTable_Entry* table, ht_hash_t hash, ht_key_t key, ht_value_t value, size_t size, int replace)
+{
+    CHECK_THAT(ht && table);
+    CHECK_THAT(key);
+
+    // check that size is power of 2
+    CHECK_THAT(size && !(size & (size - 1)));
+
+    if (ht->mode == HT_MODE_CUCKOO)
+    {
+        HashTable_Entry *placed = ht_cuckoo_place(ht, table, size, hash, key, value);
+        if (!placed)
+            return NULL;
+
+        // if we are not re-hashing increment entries
+        if (ht->table == table)
+            ht->entries++;
+
+        return placed;
+    }
+
+#if HT_PERTURB == 1
+    size_t perturb = hash;
+#else
+    size_t perturb = 0;
+#endif
+
+    size_t mask = size - 1;
+    int done = 0;
+
+    // check for free entry based on hash
+    size_t start_bin = (size_t)hash & mask;
+    size_t bin = start_bin;
+    HashTable_Entry* hte = &table[start_bin];
+
+    do
+    {
+        // if entry unused, fill it and return success
+        if (HASH_EMPTY(hte))
+        {
+            hte->hash = hash;
+            hte->key = key;
+            hte->value = value;
+			hte->tombstone = 0;
+            hte->referenced = 0;
+            hte->generation = ht->generation;
+
+            // if we are not re-hashing increment entries
+            if(ht->table == table)
+                ht->entries++;
+
+            return hte;
+        }
+
+        // if entry is a match, update the value
+        if (HASH_MATCH(hte, hash, key))
+        {
+			// if replace is not set, then fail
+            if (!replace)
+            {
+                // puts("ht_insert_nocheck: key already exists");
+                return NULL;
+            }
+
+            hte->value = value;
+            return hte;
+        }
+
+        // mark collisions
+        HT_INSERT_COLLIDE(ht);
+        HT_RECENT_INSERT_COLLIDE(ht);
+
+        perturb >>= HT_PERTURB_VALUE;
+
+#if HT_LINEAR == 1
+        bin = (bin + perturb + 1) & mask;
+#else
+        bin = (5 * bin + perturb + 1) & mask;
+#endif
+
+        hte = &table[bin];
+//#if HT_PERTURB != 1
+        done = bin == start_bin;
+//#endif
+    } while (!done);
+
+    // if no free slot found, then fail
+    HT_EVENT(ht, HT_EVENT_TABLE_FULL, size, size);
+    return NULL;
+}
+
+//--------------------------------------
+// single probe for a key, returning its
+// slot or the slot it should be added in
+//--------------------------------------
+static HashTable_Entry *ht_probe(HashTable *ht, ht_hash_t hash, ht_key_t key, int *found, size_t *pprobes)
+{
+#if HT_PERTURB == 1
+    size_t perturb = hash;
+#else
+    size_t perturb = 0;
+#endif
+
+    int done = 0;
+    size_t probes = 0;
+    HashTable_Entry *free_slot = NULL;
+
+    size_t start_bin = (size_t)hash & ht->mask;
+    size_t bin = start_bin;
+    HashTable_Entry* hte = &ht->table[start_bin];
+
+    *found = 0;
+
+    do
+    {
+        if (HASH_MATCH(hte, hash, key))
+        {
+            HT_CHECK_PROBES(ht, probes);
+            *found = 1;
+            *pprobes = probes;
+            return hte;
+        }
+
+        // inserts fill the first free slot, so the key can't be past an unused one
+        if (HASH_UNUSED(hte))
+        {
+            HT_CHECK_PROBES(ht, probes);
+            *pprobes = probes;
+            return free_slot ? free_slot : hte;
+        }
+
+        // remember the first tombstone for reuse
+        if (!free_slot && hte->tombstone)
+        {
+            free_slot = hte;
+        }
+
+        HT_INSERT_COLLIDE(ht);
+        HT_RECENT_INSERT_COLLIDE(ht);
+        probes++;
+
+        perturb >>= HT_PERTURB_VALUE;
+
+#if HT_LINEAR == 1
+        bin = (bin + perturb + 1) & ht->mask;
+#else
+        bin = (5 * bin + perturb + 1) & ht->mask;
+#endif
+        hte = &ht->table[bin];
+
+        done = bin == start_bin;
+    } while (!done);
+
+    HT_CHECK_PROBES(ht, probes);
+    *pprobes = probes;
+
+    // full cycle without a match, reuse a tombstone if we saw one
+    if (!free_slot)
+    {
+        HT_EVENT(ht, HT_EVENT_TABLE_FULL, ht->size, ht->size);
+    }
+
+    return free_slot;
+}
+
+//--------------------------------------
+// evict the next unreferenced entry after
+// the clock hand, clearing reference bits
+// on the way
+//--------------------------------------
+static int ht_cache_evict(HashTable *ht)
+{
+    HashTable_Ext *ext = ht->ext;
+
+    // the first sweep may only clear bits, the second must find a victim
+    for (size_t n = 0; n < 2 * ht->size; n++)
+    {
+        HashTable_Entry *hte = &ht->table[ext->cache_hand];
+        ext->cache_hand = (ext->cache_hand + 1) & ht->mask;
+
+        if (HASH_EMPTY(hte))
+            continue;
+
+        if (hte->referenced)
+        {
+            if (!HT_COW(ht, hte))
+                return HT_FAIL;
+
+            hte->referenced = 0;
+            continue;
+        }
+
+        if (!HT_COW(ht, hte))
+            return HT_FAIL;
+
+        if (ext->evict_fn)
+            ext->evict_fn(hte->key, hte->value, ext->evict_ctx);
+
+        return ht_entry_remove(ht, hte);
+    }
+
+    return HT_FAIL;
+}
+
+//--------------------------------------
+// rehash a cache in place, dropping its
+// tombstones without a second array
+//--------------------------------------
+#define PURGE_PENDING 2
+
+static int ht_cache_purge(HashTable *ht)
+{
+    // attached views keep every page as it was
+    if (HT_EXT(ht, snapshots, NULL))
+    {
+        for (size_t i = 0; i < ht->size; i += HT_SNAPSHOT_PAGE)
+        {
+            if (!HT_COW(ht, &ht->table[i]))
+                return HT_FAIL;
+        }
+    }
+
+    // empty the free slots and flag every live entry for placement
+    for (size_t i = 0; i < ht->size; i++)
+    {
+        HashTable_Entry *hte = &ht->table[i];
+
+        if (HASH_EMPTY(hte))
+        {
+            memset(hte, 0, sizeof(*hte));
+            hte->generation = ht->generation;
+        }
+        else
+        {
+            hte->tombstone = PURGE_PENDING;
+        }
+    }
+
+    // move each flagged entry to the first slot on its probe sequence not
+    // yet holding a placed entry, swapping when that slot is itself flagged
+    for (size_t i = 0; i < ht->size; i++)
+    {
+        HashTable_Entry *hte = &ht->table[i];
+
+        while (hte->tombstone == PURGE_PENDING)
+        {
+#if HT_PERTURB == 1
+            size_t perturb = hte->hash;
+#else
+            size_t perturb = 0;
+#endif
+            size_t bin = (size_t)hte->hash & ht->mask;
+            HashTable_Entry *dest = &ht->table[bin];
+
+            // ends at hte at the latest, once perturb is spent every slot is visited
+            while (!dest->tombstone && dest->key)
+            {
+                perturb >>= HT_PERTURB_VALUE;
+
+#if HT_LINEAR == 1
+                bin = (bin + perturb + 1) & ht->mask;
+#else
+                bin = (5 * bin + perturb + 1) & ht->mask;
+#endif
+                dest = &ht->table[bin];
+            }
+
+            if (dest == hte)
+            {
+                hte->tombstone = 0;
+                break;
+            }
+
+            HashTable_Entry displaced = *dest;
+            *dest = *hte;
+            dest->tombstone = 0;
+            *hte = displaced;
+        }
+    }
+
+    ht->deleted = 0;
+    return HT_OK;
+}
+
+//--------------------------------------
+// find the value slot for a key with a
+// known hash, adding the key with a NULL
+// value if missing
+//--------------------------------------
+static ht_value_t *ht_value_slot_hash(HashTable* ht, ht_hash_t hash, ht_key_t key, int *inserted)
+{
+    CHECK_THAT(ht);
+    CHECK_THAT(key);
+
+    *inserted = 0;
+
+    if (!ht->table)
+    {
+        CHECK_THAT(!HT_SNAPSHOT(ht));
+
+        int i = ht_tiny_find(ht, hash, key);
+        if (i >= 0)
+        {
+            return &TINY_VALUES(ht)[i];
+        }
+
+        // append while there is room in the packed layout
+        if (ht->entries < HT_TINY_SIZE)
+        {
+            if (!ht_tiny_reserve(ht))
+                return NULL;
+
+            i = (int)ht->entries++;
+            ht->tiny[i] = hash;
+            TINY_KEYS(ht)[i] = key;
+            TINY_VALUES(ht)[i] = NULL;
+
+            *inserted = 1;
+            return &TINY_VALUES(ht)[i];
+        }
+
+        // promote to a hashed table sized for the load factor
+        size_t new_size = HT_TINY_SIZE;
+        while (HT_INV_LOAD_FACTOR * (ht->entries + 1) >= new_size)
+            new_size <<= 1;
+
+        if (!ht_resize(ht, new_size))
+            return NULL;
+    }
+    else if (HT_CACHE(ht))
+    {
+        // caches never grow, they rehash in place once tombstones pile up
+        if (4 * ht->deleted >= ht->size && !ht_cache_purge(ht))
+            return NULL;
+    }
+#if HT_AUTO_GROW
+    // load factor of 0.5 to 0.67 is good time to grow
+    else if (HT_NEEDS_GROW(ht))
+    {
+        if (!ht_grow(ht))
+        {
+            return NULL;
+        }
+    }
+#endif
+
+    HashTable_Entry *hte;
+
+    if (ht->mode == HT_MODE_CUCKOO)
+    {
+        hte = ht_cuckoo_find(ht, hash, key);
+        if (hte)
+        {
+            // the caller writes the value
+            return HT_COW(ht, hte) ? &hte->value : NULL;
+        }
+
+        // no displacement path means the table is too full
+        while (!(hte = ht_cuckoo_place(ht, ht->table, ht->size, hash, key, NULL)))
+        {
+            if (!ht_grow(ht))
+                return NULL;
+        }
+
+        if (HT_BLOOM(ht))
+            ht_bloom_add(ht, hash);
+
+        ht->entries++;
+        if (ht->ext)
+            ht->ext->reseed_credit++;
+        *inserted = 1;
+        return &hte->value;
+    }
+
+    int found;
+    size_t probes;
+    hte = ht_probe(ht, hash, key, &found, &probes);
+    if (!hte)
+    {
+        return NULL;
+    }
+
+#if HT_RESEED_PROBES > 0
+    // a long run for a new key may be a collision attack, move to a new seed
+    if (!found && probes >= HT_RESEED_PROBES && ht_reseed(ht, probes))
+    {
+        hash = HT_HASH_KEY(ht, key);
+        hte = ht_probe(ht, hash, key, &found, &probes);
+        if (!hte)
+            return NULL;
+    }
+#endif
+
+    // the caller writes the value
+    if (!HT_COW(ht, hte))
+        return NULL;
+
+    if (!found)
+    {
+        // a full cache makes room first, hte stays free as only live entries are evicted
+        if (HT_CACHE(ht) && ht->entries >= HT_CACHE(ht) && !ht_cache_evict(ht))
+            return NULL;
+
+        if (hte->tombstone && !HASH_STALE(hte))
+            ht->deleted--;
+
+        hte->hash = hash;
+        hte->key = key;
+        hte->value = NULL;
+        hte->tombstone = 0;
+        hte->referenced = 0;
+        hte->generation = ht->generation;
+        ht->entries++;
+        if (ht->ext)
+            ht->ext->reseed_credit++;
+
+        if (HT_BLOOM(ht))
+            ht_bloom_add(ht, hash);
+
+        *inserted = 1;
+    }
+
+    return &hte->value;
+}
+
+//--------------------------------------
+// attempt to add or update an entry
+//--------------------------------------
+static int ht_add_or_update(HashTable* ht, ht_hash_t hash, ht_key_t key, ht_value_t value, int replace)
+{
+    int inserted;
+    ht_value_t *slot = ht_value_slot_hash(ht, hash, key, &inserted);
+
+    if (!slot)
+        return HT_FAIL;
+
+    // if replace is not set, then fail
+    if (!inserted && !replace)
+        return HT_FAIL;
+
+    *slot = value;
+    return HT_OK;
+}
+
+//--------------------------------------
+// find a key's value slot, adding the
+// key with a NULL value if missing
+//--------------------------------------
+ht_value_t *ht_find_or_insert(HashTable* ht, ht_key_t key, int *inserted)
+{
+    CHECK_THAT(ht);
+    CHECK_THAT(key);
+
+    int added = 0;
+    ht_hash_t hash = HT_HASH_KEY(ht, key);
+    ht_value_t *slot = ht_value_slot_hash(ht, hash, key, &added);
+
+    HT_TRACE_HASH(ht, HT_OP_UPSERT, hash, key, added);
+
+    if (inserted)
+        *inserted = added;
+
+    return slot;
+}
+
+//--------------------------------------
+// add or update an entry from its old value
+//--------------------------------------
+int ht_upsert(HashTable* ht, ht_key_t key, ht_upsert_func upsert_fn, void *ctx)
+{
+    CHECK_THAT(ht);
+    CHECK_THAT(key);
+    CHECK_THAT(upsert_fn);
+
+    int inserted;
+    ht_hash_t hash = HT_HASH_KEY(ht, key);
+    ht_value_t *slot = ht_value_slot_hash(ht, hash, key, &inserted);
+
+    if (!slot)
+        return HT_FAIL;
+
+    HT_TRACE_HASH(ht, HT_OP_UPSERT, hash, key, inserted);
+
+    *slot = upsert_fn(key, *slot, !inserted, ctx);
+    return HT_OK;
+}
+
+//----------------------------------------
+// insert an entry, fail if already exists
+//----------------------------------------
+int ht_insert(HashTable *ht, ht_key_t key, ht_value_t value)
+{
+    CHECK_THAT(ht);
+    CHECK_THAT(key);
+
+    ht_hash_t hash = HT_HASH_KEY(ht, key);
+    int result = ht_add_or_update(ht, hash, key, value, HT_ADD_ONLY);
+
+    HT_TRACE_HASH(ht, HT_OP_INSERT, hash, key, result);
+    return result;
+}
+
+//--------------------------------------------------
+// attempt to add an entry, update if already exists
+//--------------------------------------------------
+int ht_add(HashTable* ht, ht_key_t key, ht_value_t value)
+{
+    CHECK_THAT(ht);
+    CHECK_THAT(key);
+
+    ht_hash_t hash = HT_HASH_KEY(ht, key);
+    int result = ht_add_or_update(ht, hash, key, value, HT_REPLACE);
+
+    HT_TRACE_HASH(ht, HT_OP_ADD, hash, key, result);
+    return result;
+}
+
+//--------------------------------------
+// remove a tiny entry, moving the last
+// entry into the hole to stay packed
+//--------------------------------------
+static void ht_tiny_remove_at(HashTable* ht, size_t i)
+{
+    size_t last = --ht->entries;
+
+    ht->tiny[i] = ht->tiny[last];
+    TINY_KEYS(ht)[i] = TINY_KEYS(ht)[last];
+    TINY_VALUES(ht)[i] = TINY_VALUES(ht)[last];
+}
+
+//--------------------------------------
+// replace an entry with a tombstone
+//--------------------------------------
+static int ht_entry_remove(HashTable* ht, HashTable_Entry* hte)
+{
+    if (!HT_COW(ht, hte))
+        return HT_FAIL;
+
+    if (ht->mode == HT_MODE_CUCKOO && (size_t)(hte - ht->table) >= CUCKOO_STASH(ht->size))
+        ht->stashed--;
+
+    hte->hash = 0;
+    hte->tombstone = 1;
+    hte->key = 0;
+    hte->value = 0;
+    ht->entries--;
+    ht->deleted++;
+    return HT_OK;
+}
+
+//--------------------------------------
+// remove a key's entry
+//--------------------------------------
+static int ht_remove_hash(HashTable* ht, ht_hash_t hash, ht_key_t key)
+{
+    CHECK_THAT(ht);
+
+    // check for empty table
+    if (ht->entries == 0)
+        return HT_FAIL;
+
+    // tiny tables stay packed by moving the last entry into the hole
+    if (!ht->table)
+    {
+        CHECK_THAT(!HT_SNAPSHOT(ht));
+
+        int i = ht_tiny_find(ht, hash, key);
+        if (i < 0)
+            return HT_FAIL;
+
+        ht_tiny_remove_at(ht, i);
+        return HT_OK;
+    }
+
+    if (ht->mode == HT_MODE_CUCKOO)
+    {
+        HashTable_Entry *hte = (HT_BLOOM(ht) && !ht_bloom_test(ht, hash)) ? NULL : ht_cuckoo_find(ht, hash, key);
+        if (!hte)
+            return HT_FAIL;
+
+        return ht_entry_remove(ht, hte);
+    }
+
+#if 1
+    if (HT_BLOOM(ht) && !ht_bloom_test(ht, hash))
+        return HT_FAIL;
+
+#if HT_PERTURB == 1
+    size_t perturb = hash;
+#else
+    size_t perturb = 0;
+#endif
+
+    int done = 0;
+    size_t probes = 0;
+
+    size_t start_bin = (size_t)hash & ht->mask;
+    size_t bin = start_bin;
+    HashTable_Entry* hte = &ht->table[start_bin];
+
+    do
+    {
+        if (HASH_MATCH(hte, hash, key))
+        {
+            HT_CHECK_PROBES(ht, probes);
+            return ht_entry_remove(ht, hte);
+        }
+
+        if (HASH_UNUSED(hte))
+            break;
+
+        HT_SEARCH_COLLIDE(ht);
+        probes++;
+
+        perturb >>= HT_PERTURB_VALUE;
+
+#if HT_LINEAR == 1
+        bin = (bin + perturb + 1) & ht->mask;
+#else
+        bin = (5 * bin + perturb + 1) & ht->mask;
+#endif
+        hte = &ht->table[bin];
+
+//#if HT_PERTURB != 1
+        done = bin == start_bin;
+//#endif
+
+    } while (!done);
+
+    HT_CHECK_PROBES(ht, probes);
+
+#else
+    // look for key in table and if found, remove
+    HashTable_Entry *hte = ht->table;
+    for (size_t i = 0; i < ht->size; i++)
+    {
+        // if found, mark entry as empty
+        if (hte->key && ht->compare_fn(hte->key, key))
+        {
+			assert(hte->tombstone == 0);
+
+            hte->hash = 0;
+			hte->tombstone = 1;
+            hte->key = 0;
+            hte->value = 0;
+            ht->entries--;
+            return HT_OK;
+        }
+        hte++;
+    }
+#endif
+
+    // if not found, return failure
+    return HT_FAIL;
+}
+
+//--------------------------------------
+// attempt to remove entry from table
+//--------------------------------------
+int ht_remove(HashTable* ht, ht_key_t key)
+{
+    CHECK_THAT(ht);
+
+    // check for empty table
+    if (ht->entries == 0 && !HT_TRACING(ht))
+        return HT_FAIL;
+
+    ht_hash_t hash = HT_HASH_KEY(ht, key);
+    int result = ht_remove_hash(ht, hash, key);
+
+    HT_TRACE_HASH(ht, HT_OP_REMOVE, hash, key, result);
+    return result;
+}
+
+//--------------------------------------
+// remove the entry last returned by
+// ht_next, iteration may continue
+//--------------------------------------
+int ht_remove_at(HashTable* ht, size_t *ipos)
+{
+    CHECK_THAT(ht && ipos);
+    CHECK_THAT(*ipos > 0);
+
+    size_t index = *ipos - 1;
+
+    if (!ht->table)
+    {
+        CHECK_THAT(!HT_SNAPSHOT(ht) && index < ht->entries);
+        HT_TRACE_HASH(ht, HT_OP_REMOVE, ht->tiny[index], TINY_KEYS(ht)[index], HT_OK);
+        ht_tiny_remove_at(ht, index);
+
+        // the last entry moved into this index, so visit it next
+        *ipos = index;
+        return HT_OK;
+    }
+
+    CHECK_THAT(index < ht->size);
+
+    HashTable_Entry *hte = &ht->table[index];
+    if (HASH_EMPTY(hte))
+        return HT_FAIL;
+
+    // a tombstone keeps probe chains through this slot intact
+    HT_TRACE_HASH(ht, HT_OP_REMOVE, hte->hash, hte->key, HT_OK);
+    return ht_entry_remove(ht, hte);
+}
+
+//--------------------------------------
+// remove all entries matching predicate
+//--------------------------------------
+size_t ht_remove_if(HashTable* ht, ht_predicate_func pred_fn, void *ctx)
+{
+    CHECK_THAT(ht && pred_fn);
+    CHECK_THAT(!HT_SNAPSHOT(ht));
+
+    size_t removed = 0;
+
+    if (!ht->table)
+    {
+        // walk backwards so the moved-in last entry was already visited
+        for (size_t i = ht->entries; i-- > 0; )
+        {
+            if (pred_fn(TINY_KEYS(ht)[i], TINY_VALUES(ht)[i], ctx))
+            {
+                HT_TRACE_HASH(ht, HT_OP_REMOVE, ht->tiny[i], TINY_KEYS(ht)[i], HT_OK);
+                ht_tiny_remove_at(ht, i);
+                removed++;
+            }
+        }
+
+        return removed;
+    }
+
+    HashTable_Entry *hte = ht->table;
+    for (size_t i = 0; i < ht->size && ht->entries; i++, hte++)
+    {
+        if (!HASH_EMPTY(hte) && pred_fn(hte->key, hte->value, ctx))
+        {
+            HT_TRACE_HASH(ht, HT_OP_REMOVE, hte->hash, hte->key, HT_OK);
+            removed += ht_entry_remove(ht, hte);
+        }
+    }
+
+    return removed;
+}
+
+//--------------------------------------
+// return current size
+//--------------------------------------
+size_t ht_size(HashTable *ht)
+{
+    CHECK_THAT(ht);
+    return ht->entries;
+}
+
+//--------------------------------------
+// return table capacity
+//--------------------------------------
+size_t ht_capacity(HashTable *ht)
+{
+    CHECK_THAT(ht);
+    return ht->size;
+}
+
+//--------------------------------------
+// place every entry in a new table,
+// failing if any doesn't fit. The old
+// storage is left untouched.
+//--------------------------------------
+static int ht_resize_fill(HashTable* ht, HashTable_Entry *new_table, size_t new_size, int rehash)
+{
+    // promote a tiny table
+    if (!ht->table)
+    {
+        for (size_t i = 0; i < ht->entries; i++)
+        {
+            ht_key_t key = TINY_KEYS(ht)[i];
+            ht_hash_t hash = rehash ? HT_HASH_KEY(ht, key) : ht->tiny[i];
+
+            if (!ht_insert_nocheck(ht, new_table, hash, key, TINY_VALUES(ht)[i], new_size, HT_ADD_ONLY))
+                return HT_FAIL;
+        }
+
+        return HT_OK;
+    }
+
+    // re-insert existing items into new table
+    HashTable_Entry* hte;
+    for (size_t i = 0; i < ht->size; i++)
+    {
+        hte = &ht->table[i];
+
+        // if entry is not empty, re-hash into new table
+        if (!HASH_EMPTY(hte))
+        {
+            ht_hash_t hash = rehash ? HT_HASH_KEY(ht, hte->key) : hte->hash;
+            HashTable_Entry *moved = ht_insert_nocheck(ht, new_table, hash, hte->key, hte->value, new_size, HT_ADD_ONLY);
+            if (!moved)
+                return HT_FAIL;
+
+            // cache reference bits follow their entries
+            moved->referenced = hte->referenced;
+        }
+    }
+
+    return HT_OK;
+}
+
+//--------------------------------------
+// attempt to resize the table, rehashing
+// keys rather than reusing stored hashes
+// if the seed changed
+//--------------------------------------
+static HashTable* ht_resize_table(HashTable* ht, size_t new_size, int rehash)
+{
+    CHECK_THAT(ht && !HT_SNAPSHOT(ht));
+
+#if HT_EVENTS == 1
+    uint64_t start_ns = HT_EVENTS_ON(ht) ? ht_now_ns() : 0;
+    size_t old_size = ht->size;
+#endif
+
+    // cuckoo tables need at least two buckets and the stash
+    while (ht->mode == HT_MODE_CUCKOO && new_size < 2 * HT_CUCKOO_SLOTS + HT_CUCKOO_STASH)
+        new_size <<= 1;
+
+    size_t new_table_bytes;
+    HashTable_Entry* new_table;
+#if HT_EVENTS == 1
+    int started = 0;
+#endif
+
+    for (;;)
+    {
+        // alloc new (zeroed) table
+        new_table = ht_table_alloc(ht, new_size, &new_table_bytes, 1);
+        if (!new_table)
+        {
+            HT_EVENT(ht, HT_EVENT_ALLOC_FAIL, old_size, sizeof(HashTable_Entry) * new_size);
+            break;
+        }
+
+        HT_ALLOC_INC;
+
+#if HT_EVENTS == 1
+        // announced once there is an array to fill
+        if (!started++)
+            HT_EVENT(ht, HT_EVENT_RESIZE_START, old_size, new_size);
+#endif
+
+        if (ht_resize_fill(ht, new_table, new_size, rehash))
+            break;
+
+        ht_table_free(ht, new_table, new_size, new_table_bytes);
+        HT_FREE_INC;
+        new_table = NULL;
+
+        // a cuckoo table that doesn't fit is retried at twice the size
+        if (ht->mode != HT_MODE_CUCKOO)
+            break;
+
+        new_size <<= 1;
+    }
+
+    if (!new_table)
+    {
+#if HT_EVENTS == 1
+        // a started resize that fails ends at its old size
+        if (started && HT_EVENTS_ON(ht))
+            ht_event_emit(ht, HT_EVENT_RESIZE_END, old_size, old_size, 0, ht_now_ns() - start_ns);
+#endif
+        return NULL;
+    }
+
+    // a promoted tiny table's entries have all moved
+    if (!ht->table && ht->tiny)
+    {
+        ht->allocator->free(ht->allocator->ctx, ht->tiny, TINY_BYTES(ht->tiny_capacity));
+        HT_FREE_INC;
+        ht->tiny = NULL;
+        ht->tiny_capacity = 0;
+    }
+
+    // free old table, snapshots still reading it keep it until released
+    if (ht->table)
+    {
+        ht_table_drop(ht);
+    }
+
+    // update hash table state
+    ht->table = new_table;
+    ht->size = new_size;
+    ht->mask = new_size - 1;
+    ht->deleted = 0;
+
+    // keys the fill had to stash
+    ht->stashed = 0;
+    for (size_t i = CUCKOO_STASH(new_size); ht->mode == HT_MODE_CUCKOO && i < new_size; i++)
+    {
+        ht->stashed += !HASH_EMPTY(&new_table[i]);
+    }
+
+    if (ht->ext)
+    {
+        ht->ext->table_bytes = new_table_bytes;
+        ht->ext->cache_hand = 0;
+
+        // filter is resized with the table
+        if (ht->ext->use_bloom)
+            ht_bloom_build(ht);
+    }
+
+    // clear recent collisions
+#if HT_TRACK_STATS == 1
+    ht->recent_insert_collisions = 0;
+#endif
+
+#if HT_EVENTS == 1
+    if (HT_EVENTS_ON(ht))
+        ht_event_emit(ht, HT_EVENT_RESIZE_END, old_size, new_size, 0, ht_now_ns() - start_ns);
+#endif
+
+    return ht;
+}
+
+//--------------------------------------
+// attempt to resize the table
+//--------------------------------------
+static HashTable* ht_resize(HashTable* ht, size_t new_size)
+{
+    return ht_resize_table(ht, new_size, 0);
+}
+
+//--------------------------------------
+// recompute stored hashes after the seed
+// changed
+//--------------------------------------
+static int ht_rehash(HashTable* ht)
+{
+    // caller supplied hashers don't use the seed
+    if (!ht_keyed_hash(ht->hash_fn))
+        return HT_OK;
+
+    if (!ht->table)
+    {
+        for (size_t i = 0; i < ht->entries; i++)
+        {
+            ht->tiny[i] = HT_HASH_KEY(ht, TINY_KEYS(ht)[i]);
+        }
+
+        return HT_OK;
+    }
+
+    return ht_resize_table(ht, ht->size, 1) ? HT_OK : HT_FAIL;
+}
+
+#if HT_RESEED_PROBES > 0
+//--------------------------------------
+// move to a new seed after a long insert
+// probe, which may be a collision attack
+//--------------------------------------
+static int ht_reseed(HashTable* ht, size_t probes)
+{
+    // each rehash must be paid for by inserts since the last one
+    if (!ht_keyed_hash(ht->hash_fn) || (ht->ext && ht->ext->reseeds && ht->ext->reseed_credit < ht->entries / 2))
+        return HT_FAIL;
+
+    // the new seed is kept with the table
+    HashTable_Ext *ext = ht_ext(ht);
+    if (!ext)
+        return HT_FAIL;
+
+    ht_hash_func old_fn = ht->hash_fn;
+    uint64_t old_seed[2] = { ext->seed[0], ext->seed[1] };
+
+    // the fast string hash may collide for any seed, so a second attack moves to SipHash
+    if (ext->reseeds && ht->hash_fn == string_hash_fn)
+        ht->hash_fn = siphash_fn;
+
+    ext->keyed_fn = ht_keyed_hash(ht->hash_fn);
+    ht_new_seed(ext->seed);
+
+    if (!ht_rehash(ht))
+    {
+        ht->hash_fn = old_fn;
+        ext->keyed_fn = ht_keyed_hash(old_fn);
+        ext->seed[0] = old_seed[0];
+        ext->seed[1] = old_seed[1];
+        return HT_FAIL;
+    }
+
+    ext->reseeds++;
+    ext->reseed_credit = 0;
+
+#if HT_EVENTS == 1
+    if (HT_EVENTS_ON(ht))
+        ht_event_emit(ht, HT_EVENT_RESEED, ht->size, ht->size, probes, 0);
+#endif
+
+    return HT_OK;
+}
+#endif
+
+//--------------------------------------
+// attempt to grow the table
+//--------------------------------------
+HashTable *ht_grow(HashTable *ht)
+{
+    CHECK_THAT(ht);
+
+    // cache capacity is fixed at creation
+    CHECK_THAT(!HT_CACHE(ht));
+
+    // increase (double) table size
+    size_t new_size = ht->size << 1;
+
+    return ht_resize(ht, new_size);
+}
+
+//--------------------------------------
+// try to shrink the table
+//--------------------------------------
+HashTable* ht_shrink(HashTable* ht)
+{
+    CHECK_THAT(ht);
+    CHECK_THAT(!HT_CACHE(ht));
+
+    // tiny tables are already as small as they get
+    if (!ht->table)
+        return NULL;
+
+    // decrease (half) table size
+    size_t new_size = ht->size >> 1;
+
+    // make sure smaller size is large enough
+    if ((ht->entries << 1) > new_size)
+        return NULL;
+
+    HT_EVENT(ht, HT_EVENT_SHRINK, ht->size, new_size);
+    return ht_resize(ht, new_size);
+}
+
+//--------------------------------------
+// empty the table's filter and counts
+//--------------------------------------
+static void ht_clear_state(HashTable *ht)
+{
+    ht->entries = 0;
+    ht->deleted = 0;
+    ht->stashed = 0;
+
+    if (ht->ext)
+        ht->ext->cache_hand = 0;
+
+    if (HT_BLOOM(ht))
+        memset(ht->ext->bloom, 0, BLOOM_BYTES(ht->ext->bloom_mask + 1));
+
+#if HT_TRACK_STATS == 1
+    ht->recent_insert_collisions = 0;
+#endif
+}
+
+//--------------------------------------
+// zero every slot, swapping in a fresh
+// array if snapshots still read this one
+//--------------------------------------
+static int ht_zero_table(HashTable *ht)
+{
+    ht_snapshot_reap(ht);
+
+    if (!HT_EXT(ht, shared, NULL))
+    {
+        memset(ht->table, 0, ht->size * sizeof(HashTable_Entry));
+        return HT_OK;
+    }
+
+    size_t bytes;
+    HashTable_Entry *table = ht_table_alloc(ht, ht->size, &bytes, 1);
+    if (!table)
+        return HT_FAIL;
+
+    HT_ALLOC_INC;
+    ht_table_drop(ht);
+    ht->table = table;
+    ht->ext->table_bytes = bytes;
+    return HT_OK;
+}
+
+//--------------------------------------
+// remove all entries, keeping capacity
+//
+// NB: assumes entries have been free'd
+//--------------------------------------
+int ht_clear(HashTable *ht)
+{
+    CHECK_THAT(ht && !HT_SNAPSHOT(ht));
+
+    if (ht->table)
+    {
+        if (!ht_zero_table(ht))
+            return HT_FAIL;
+
+        ht->generation = 0;
+    }
+
+    ht_clear_state(ht);
+    return HT_OK;
+}
+
+//--------------------------------------
+// remove all entries in O(1) by moving to
+// a new generation, slots stamped with an
+// older one read as unused and are
+// overwritten as inserts reach them
+//
+// NB: assumes entries have been free'd
+//--------------------------------------
+int ht_clear_lazy(HashTable *ht)
+{
+    CHECK_THAT(ht && !HT_SNAPSHOT(ht));
+
+    // a wrapped generation would revive slots stamped long ago
+    if (ht->table && ++ht->generation == 0 && !ht_zero_table(ht))
+    {
+        ht->generation--;
+        return HT_FAIL;
+    }
+
+    ht_clear_state(ht);
+    return HT_OK;
+}
+
+//--------------------------------------
+// create a cache holding at most capacity
+// entries, evicting with CLOCK
+//--------------------------------------
+HashTable *ht_cache_create(size_t capacity, ht_evict_func evict_fn, void *ctx)
+{
+    CHECK_THAT(capacity);
+
+    HashTable *ht = ht_create();
+    if (!ht)
+        return NULL;
+
+    // sized once for the same load a growing table would have
+    size_t size = HT_DEFAULT_TABLE_SIZE;
+    while (HT_INV_LOAD_FACTOR * capacity >= size)
+    {
+        size <<= 1;
+    }
+
+    HashTable_Ext *ext = ht_ext(ht);
+    if (!ext || !ht_resize(ht, size))
+    {
+        ht_free(ht);
+        return NULL;
+    }
+
+    ext->cache_capacity = capacity;
+    ext->evict_fn = evict_fn;
+    ext->evict_ctx = ctx;
+    return ht;
+}
+
+//--------------------------------------
+// look up a cached value, marking it as
+// recently used
+//--------------------------------------
+ht_value_t ht_cache_get(HashTable *ht, ht_key_t key)
+{
+    CHECK_THAT(ht && HT_CACHE(ht));
+    CHECK_THAT(key);
+
+    ht_hash_t hash = HT_HASH_KEY(ht, key);
+    HashTable_Entry *hte = ht->entries ? ht_find_entry(ht, hash, key) : NULL;
+
+    HT_TRACE_HASH(ht, HT_OP_FIND, hash, key, hte != NULL);
+
+    if (!hte)
+        return NULL;
+
+    if (!hte->referenced && HT_COW(ht, hte))
+        hte->referenced = 1;
+
+    return hte->value;
+}
+
+//--------------------------------------
+// add or update a cached value, evicting
+// another entry if the cache is full
+//--------------------------------------
+int ht_cache_put(HashTable *ht, ht_key_t key, ht_value_t value)
+{
+    CHECK_THAT(ht && HT_CACHE(ht));
+    CHECK_THAT(key);
+
+    int inserted;
+    ht_hash_t hash = HT_HASH_KEY(ht, key);
+    ht_value_t *slot = ht_value_slot_hash(ht, hash, key, &inserted);
+
+    HT_TRACE_HASH(ht, HT_OP_ADD, hash, key, slot != NULL);
+
+    if (!slot)
+        return HT_FAIL;
+
+    // an update counts as a use
+    if (!inserted)
+        ((HashTable_Entry*)((char*)slot - offsetof(HashTable_Entry, value)))->referenced = 1;
+
+    *slot = value;
+    return HT_OK;
+}
+
+//--------------------------------------
+// copy a table, slot for slot
+//
+// NB: keys and values are shared, not copied
+//--------------------------------------
+HashTable *ht_clone(HashTable *ht)
+{
+    CHECK_THAT(ht && !HT_SNAPSHOT(ht));
+
+    HashTable *clone = ht_create_with_allocator(ht->allocator);
+    if (!clone)
+        return NULL;
+
+    clone->hash_fn = ht->hash_fn;
+    clone->compare_fn = ht->compare_fn;
+    clone->mode = ht->mode;
+    clone->stashed = ht->stashed;
+
+    // settings carried in the optional state, the filter is rebuilt below
+    if (ht->ext)
+    {
+        HashTable_Ext *ext = ht_ext(clone);
+        if (!ext)
+        {
+            ht_free(clone);
+            return NULL;
+        }
+
+        ext->keyed_fn = ht->ext->keyed_fn;
+        ext->seed[0] = ht->ext->seed[0];
+        ext->seed[1] = ht->ext->seed[1];
+        ext->numa_policy = ht->ext->numa_policy;
+        ext->use_bloom = ht->ext->use_bloom;
+        ext->cache_capacity = ht->ext->cache_capacity;
+        ext->cache_hand = ht->ext->cache_hand;
+        ext->evict_fn = ht->ext->evict_fn;
+        ext->evict_ctx = ht->ext->evict_ctx;
+
+#if HT_EVENTS == 1
+        ext->event_fn = ht->ext->event_fn;
+        ext->event_ctx = ht->ext->event_ctx;
+        ext->long_probe = ht->ext->long_probe;
+#endif
+    }
+
+    if (ht->table)
+    {
+        // slot positions depend only on the stored hashes and the size
+        size_t bytes;
+        HashTable_Entry *table = ht_table_alloc(clone, ht->size, &bytes, 0);
+        if (!table)
+        {
+            ht_free(clone);
+            return NULL;
+        }
+
+        HT_ALLOC_INC;
+        memcpy(table, ht->table, ht->size * sizeof(HashTable_Entry));
+
+        clone->table = table;
+        clone->size = ht->size;
+        clone->mask = ht->mask;
+        if (clone->ext)
+            clone->ext->table_bytes = bytes;
+    }
+    else if (ht->tiny)
+    {
+        clone->tiny = ht->allocator->alloc(ht->allocator->ctx, TINY_BYTES(ht->tiny_capacity));
+        if (!clone->tiny)
+        {
+            ht_free(clone);
+            return NULL;
+        }
+
+        HT_ALLOC_INC;
+        memcpy(clone->tiny, ht->tiny, TINY_BYTES(ht->tiny_capacity));
+        clone->tiny_capacity = ht->tiny_capacity;
+    }
+
+    clone->entries = ht->entries;
+    clone->deleted = ht->deleted;
+    clone->generation = ht->generation;
+
+    if (HT_EXT(clone, use_bloom, 0))
+        ht_bloom_build(clone);
+
+    return clone;
+}
+
+//--------------------------------------
+// add or update one merged entry
+//--------------------------------------
+static int ht_merge_entry(HashTable *dst, ht_hash_t hash, ht_key_t key, ht_value_t value, int policy)
+{
+    int inserted;
+    ht_value_t *slot = ht_value_slot_hash(dst, hash, key, &inserted);
+    if (!slot)
+        return HT_FAIL;
+
+    if (inserted || policy == HT_MERGE_REPLACE)
+        *slot = value;
+
+    return HT_OK;
+}
+
+//--------------------------------------
+// prefetch the first line a merged entry
+// will probe in dst
+//--------------------------------------
+static void ht_merge_prefetch(HashTable *dst, ht_hash_t hash)
+{
+    if (!dst->table)
+        return;
+
+    if (dst->mode == HT_MODE_CUCKOO)
+    {
+        HT_PREFETCH(&dst->table[ht_cuckoo_first(ht_mix_hash(hash), CUCKOO_BUCKETS(dst->size)) * HT_CUCKOO_SLOTS]);
+    }
+    else
+    {
+        HT_PREFETCH(&dst->table[(size_t)hash & dst->mask]);
+    }
+}
+
+//--------------------------------------
+// add all entries of src to dst, keys in
+// both keep dst's value or take src's
+// depending on policy
+//--------------------------------------
+int ht_merge(HashTable *dst, HashTable *src, int policy)
+{
+    CHECK_THAT(dst && src && dst != src);
+    CHECK_THAT(!HT_SNAPSHOT(src));
+    CHECK_THAT(policy == HT_MERGE_KEEP || policy == HT_MERGE_REPLACE);
+
+    // a reseed may have moved one built-in string table to SipHash
+    CHECK_THAT(dst->hash_fn == src->hash_fn || (HT_STRING_KEYS(dst) && HT_STRING_KEYS(src)));
+
+    if (src->entries == 0)
+        return HT_OK;
+
+    // reserve once for the worst case of no common keys
+    size_t total = dst->entries + src->entries;
+    if (dst->table || total > HT_TINY_SIZE)
+    {
+        size_t new_size = dst->table ? dst->size : HT_TINY_SIZE;
+        while (dst->mode == HT_MODE_CUCKOO ? 100 * (total + 1) >= HT_CUCKOO_LOAD * new_size : HT_INV_LOAD_FACTOR * (total + 1) >= new_size)
+        {
+            new_size <<= 1;
+        }
+
+        if ((!dst->table || new_size > dst->size) && !ht_resize(dst, new_size))
+            return HT_FAIL;
+    }
+
+    if (!src->table)
+    {
+        for (size_t i = 0; i < src->entries; i++)
+        {
+            ht_key_t key = TINY_KEYS(src)[i];
+            ht_hash_t hash = HT_SAME_HASH(dst, src) ? src->tiny[i] : HT_HASH_KEY(dst, key);
+
+            if (!ht_merge_entry(dst, hash, key, TINY_VALUES(src)[i], policy))
+                return HT_FAIL;
+        }
+
+        return HT_OK;
+    }
+
+    // gather a batch of entries, prefetching where each lands in dst
+    HashTable_Entry *batch[HT_FIND_BATCH];
+    ht_hash_t hashes[HT_FIND_BATCH];
+    HashTable *ht = src;    // for HASH_EMPTY
+    size_t i = 0;
+
+    while (i < src->size)
+    {
+        int same = HT_SAME_HASH(dst, src);
+        size_t reseeds = HT_EXT(dst, reseeds, 0);
+        size_t n = 0;
+
+        for (; i < src->size && n < HT_FIND_BATCH; i++)
+        {
+            if (HASH_EMPTY(&src->table[i]))
+                continue;
+
+            batch[n] = &src->table[i];
+            hashes[n] = same ? src->table[i].hash : HT_HASH_KEY(dst, src->table[i].key);
+            ht_merge_prefetch(dst, hashes[n++]);
+        }
+
+        for (size_t j = 0; j < n; j++)
+        {
+            // an insert may have reseeded dst
+            ht_hash_t hash = HT_EXT(dst, reseeds, 0) == reseeds ? hashes[j] : HT_HASH_KEY(dst, batch[j]->key);
+
+            if (!ht_merge_entry(dst, hash, batch[j]->key, batch[j]->value, policy))
+                return HT_FAIL;
+        }
+    }
+
+    return HT_OK;
+}
+
+//--------------------------------------
+// snapshots
+//
+// A snapshot is a read-only view sharing the live table's slot array.
+// Before the writer changes a slot it copies the slot's page to every
+// view that doesn't have that page yet, so views read their private copy
+// where one exists and the shared array elsewhere. A view published a
+// page copy before the page changed, so a reader that finds no copy after
+// reading the shared slot knows what it read was unchanged.
+//
+// Once the live table drops the array (resize, clear or free) it never
+// writes it again, and the array is freed with its last view.
+//--------------------------------------
+
+//--------------------------------------
+// release a view's share of an array
+//--------------------------------------
+static void ht_shared_release(ht_shared_table *shared)
+{
+    if (HT_REFS_DEC(&shared->refs))
+        return;
+
+    const ht_allocator *allocator = shared->allocator;
+
+    ht_table_release(allocator, shared->table, shared->size, shared->bytes);
+    HT_FREE_INC;
+    allocator->free(allocator->ctx, shared, sizeof(ht_shared_table));
+}
+
+//--------------------------------------
+// free a view nothing refers to anymore
+//--------------------------------------
+static void ht_snapshot_destroy(struct ht_snapshot *snap)
+{
+    const ht_allocator *allocator = snap->allocator;
+
+    if (snap->pages)
+    {
+        for (size_t i = 0; i < snap->page_count; i++)
+        {
+            if (snap->pages[i])
+                allocator->free(allocator->ctx, snap->pages[i], SNAPSHOT_PAGE_SLOTS(snap->view.size, i) * sizeof(HashTable_Entry));
+        }
+
+        allocator->free(allocator->ctx, snap->pages, snap->page_count * sizeof(HashTable_Entry*));
+    }
+
+    if (snap->view.tiny)
+        allocator->free(allocator->ctx, snap->view.tiny, TINY_BYTES(snap->view.tiny_capacity));
+
+    if (snap->shared)
+        ht_shared_release(snap->shared);
+
+    allocator->free(allocator->ctx, snap, sizeof(struct ht_snapshot));
+}
+
+//--------------------------------------
+// free the live table's sharing state
+//--------------------------------------
+static void ht_snapshot_unshare(HashTable *ht)
+{
+    HashTable_Ext *ext = ht->ext;
+
+    if (ext->shared)
+        ht->allocator->free(ht->allocator->ctx, ext->shared, sizeof(ht_shared_table));
+
+    if (ext->cow_copied)
+        ht->allocator->free(ht->allocator->ctx, ext->cow_copied, SNAPSHOT_WORDS(ht->size) * sizeof(uint64_t));
+
+    ext->shared = NULL;
+    ext->cow_copied = NULL;
+}
+
+//--------------------------------------
+// drop views their readers have released
+//--------------------------------------
+static void ht_snapshot_reap(HashTable *ht)
+{
+    HashTable_Ext *ext = ht->ext;
+    if (!ext)
+        return;
+
+    struct ht_snapshot **link = &ext->snapshots;
+
+    while (*link)
+    {
+        struct ht_snapshot *snap = *link;
+
+        // only this table still holds it
+        if (HT_REFS_LOAD(&snap->refs) == 1)
+        {
+            *link = snap->next;
+            ht_snapshot_destroy(snap);
+            continue;
+        }
+
+        link = &snap->next;
+    }
+
+    // nothing else shares the array
+    if (!ext->snapshots && ext->shared)
+        ht_snapshot_unshare(ht);
+}
+
+//--------------------------------------
+// copy a slot's page to each attached
+// view before the slot changes
+//--------------------------------------
+static int ht_snapshot_cow(HashTable *ht, size_t index)
+{
+    HashTable_Ext *ext = ht->ext;
+    size_t page = index / HT_SNAPSHOT_PAGE;
+    uint64_t bit = (uint64_t)1 << (page & 63);
+
+    if (ext->cow_copied[page >> 6] & bit)
+        return HT_OK;
+
+    ht_snapshot_reap(ht);
+    if (!ext->snapshots)
+        return HT_OK;
+
+    HashTable_Entry *src = &ht->table[page * HT_SNAPSHOT_PAGE];
+    size_t count = SNAPSHOT_PAGE_SLOTS(ht->size, page);
+
+    int copied = 0;
+    for (struct ht_snapshot *snap = ext->snapshots; snap; snap = snap->next)
+    {
+        if (snap->pages[page])
+            continue;
+
+        HashTable_Entry *copy = ht->allocator->alloc(ht->allocator->ctx, count * sizeof(HashTable_Entry));
+        if (!copy)
+            return HT_FAIL;
+
+        memcpy(copy, src, count * sizeof(HashTable_Entry));
+        HT_STORE_PAGE(&snap->pages[page], copy);
+        copied = 1;
+    }
+
+    // readers must see the copies before any change to the page
+    if (copied)
+        HT_FENCE();
+
+    ext->cow_copied[page >> 6] |= bit;
+    return HT_OK;
+}
+
+//--------------------------------------
+// stop sharing the slot array, handing
+// it to the views still reading it
+//--------------------------------------
+static void ht_table_drop(HashTable *ht)
+{
+    HashTable_Ext *ext = ht->ext;
+
+    if (!ext || !ext->shared)
+    {
+        ht_table_free(ht, ht->table, ht->size, HT_EXT(ht, table_bytes, 0));
+        HT_FREE_INC;
+        return;
+    }
+
+    while (ext->snapshots)
+    {
+        struct ht_snapshot *snap = ext->snapshots;
+        ext->snapshots = snap->next;
+
+        if (!HT_REFS_DEC(&snap->refs))
+            ht_snapshot_destroy(snap);
+    }
+
+    // drop the table's reference, the views keep theirs
+    ht_shared_release(ext->shared);
+    ext->shared = NULL;
+    ht_snapshot_unshare(ht);
+}
+
+//--------------------------------------
+// read one slot as it was when the view
+// was taken
+//--------------------------------------
+static void ht_snapshot_slot(struct ht_snapshot *snap, size_t index, HashTable_Entry *out)
+{
+    HashTable_Entry **ppage = &snap->pages[index / HT_SNAPSHOT_PAGE];
+    HashTable_Entry *page = HT_LOAD_PAGE(ppage);
+
+    if (!page)
+    {
+        // the writer may be changing the slot, so read each field once and
+        // only trust them if the writer hadn't started copying the page
+        const HashTable_Entry *hte = &snap->shared->table[index];
+        out->hash = HT_LOAD_FIELD(ht_hash_t, &hte->hash);
+        out->tombstone = HT_LOAD_FIELD(uint16_t, &hte->tombstone);
+        out->referenced = HT_LOAD_FIELD(uint16_t, &hte->referenced);
+        out->generation = HT_LOAD_FIELD(uint32_t, &hte->generation);
+        out->key = HT_LOAD_FIELD(ht_key_t, &hte->key);
+        out->value = HT_LOAD_FIELD(ht_value_t, &hte->value);
+        HT_FENCE_ACQUIRE();
+
+        page = HT_LOAD_PAGE(ppage);
+        if (!page)
+            return;
+    }
+
+    // page copies never change once published
+    *out = page[index % HT_SNAPSHOT_PAGE];
+}
+
+//--------------------------------------
+// look up a key in a view
+//--------------------------------------
+static ht_value_t ht_snapshot_lookup(HashTable *ht, ht_hash_t hash, ht_key_t key)
+{
+    struct ht_snapshot *snap = ht->ext->snapshot;
+    HashTable_Entry hte;
+
+    if (ht->mode == HT_MODE_CUCKOO)
+    {
+        size_t buckets = CUCKOO_BUCKETS(ht->size);
+        uint64_t mixed = ht_mix_hash(hash);
+        size_t first[3] = { ht_cuckoo_first(mixed, buckets) * HT_CUCKOO_SLOTS, ht_cuckoo_second(mixed, buckets) * HT_CUCKOO_SLOTS, CUCKOO_STASH(ht->size) };
+        int count[3] = { HT_CUCKOO_SLOTS, HT_CUCKOO_SLOTS, ht->stashed ? HT_CUCKOO_STASH : 0 };
+
+        for (int b = 0; b < 3; b++)
+        {
+            for (int i = 0; i < count[b]; i++)
+            {
+                ht_snapshot_slot(snap, first[b] + i, &hte);
+                if (HASH_MATCH(&hte, hash, key))
+                    return hte.value;
+            }
+        }
+
+        return NULL;
+    }
+
+#if HT_PERTURB == 1
+    size_t perturb = hash;
+#else
+    size_t perturb = 0;
+#endif
+
+    size_t start_bin = (size_t)hash & ht->mask;
+    size_t bin = start_bin;
+
+    do
+    {
+        ht_snapshot_slot(snap, bin, &hte);
+
+        if (HASH_MATCH(&hte, hash, key))
+            return hte.value;
+
+        if (HASH_UNUSED(&hte))
+            break;
+
+        perturb >>= HT_PERTURB_VALUE;
+
+#if HT_LINEAR == 1
+        bin = (bin + perturb + 1) & ht->mask;
+#else
+        bin = (5 * bin + perturb + 1) & ht->mask;
+#endif
+    } while (bin != start_bin);
+
+    return NULL;
+}
+
+//--------------------------------------
+// advance a view's iterator
+//--------------------------------------
+static int ht_snapshot_next(HashTable *ht, size_t *ipos, ht_key_t *pkey, ht_value_t *pvalue)
+{
+    HashTable_Entry hte;
+
+    for (size_t index = *ipos; index < ht->size; index++)
+    {
+        ht_snapshot_slot(ht->ext->snapshot, index, &hte);
+        if (HASH_EMPTY(&hte))
+            continue;
+
+        *ipos = index + 1;
+
+        if (pkey)
+            *pkey = hte.key;
+
+        if (pvalue)
+            *pvalue = hte.value;
+
+        return HT_OK;
+    }
+
+    *ipos = ht->size;
+    return HT_FAIL;
+}
+
+//--------------------------------------
+// take a read-only view of the table as
+// it is now. No slots are copied, pages
+// are copied as the table later changes
+// them. Views may be read from other
+// threads while this table is written.
+//
+// NB: keys and values are shared, not copied
+//--------------------------------------
+HashTable *ht_snapshot(HashTable *ht)
+{
+    CHECK_THAT(ht && !HT_SNAPSHOT(ht));
+
+    // the live table tracks its views
+    HashTable_Ext *ext = ht->table ? ht_ext(ht) : ht->ext;
+    if (ht->table && !ext)
+        return NULL;
+
+    struct ht_snapshot *snap = ht->allocator->alloc(ht->allocator->ctx, sizeof(struct ht_snapshot));
+    if (!snap)
+        return NULL;
+
+    memset(snap, 0, sizeof(struct ht_snapshot));
+    snap->allocator = ht->allocator;
+
+    HashTable *view = &snap->view;
+    view->allocator = ht->allocator;
+    view->mode = ht->mode;
+    view->stashed = ht->stashed;
+    view->hash_fn = ht->hash_fn;
+    view->compare_fn = ht->compare_fn;
+    view->entries = ht->entries;
+    view->size = ht->size;
+    view->mask = ht->mask;
+    view->generation = ht->generation;
+
+    // views hash as the table does
+    view->ext = &snap->view_ext;
+    ht_ext_init(view, view->ext);
+    view->ext->seed[0] = HT_SEED(ht)[0];
+    view->ext->seed[1] = HT_SEED(ht)[1];
+    view->ext->snapshot = snap;
+
+    snap->refs = 1;
+
+    // tiny tables are small enough to copy outright
+    if (!ht->table)
+    {
+        if (ht->entries)
+        {
+            view->tiny = ht->allocator->alloc(ht->allocator->ctx, TINY_BYTES(ht->entries));
+            if (!view->tiny)
+            {
+                ht_snapshot_destroy(snap);
+                return NULL;
+            }
+
+            view->tiny_capacity = ht->entries;
+            memcpy(view->tiny, ht->tiny, ht->entries * sizeof(ht_hash_t));
+            memcpy(TINY_KEYS(view), TINY_KEYS(ht), ht->entries * sizeof(ht_key_t));
+            memcpy(TINY_VALUES(view), TINY_VALUES(ht), ht->entries * sizeof(ht_value_t));
+        }
+
+        return view;
+    }
+
+    ht_snapshot_reap(ht);
+
+    snap->page_count = SNAPSHOT_PAGES(ht->size);
+    snap->pages = ht->allocator->alloc(ht->allocator->ctx, snap->page_count * sizeof(HashTable_Entry*));
+    if (!snap->pages)
+    {
+        ht_snapshot_destroy(snap);
+        return NULL;
+    }
+
+    memset(snap->pages, 0, snap->page_count * sizeof(HashTable_Entry*));
+
+    if (!ext->shared)
+    {
+        ext->shared = ht->allocator->alloc(ht->allocator->ctx, sizeof(ht_shared_table));
+        ext->cow_copied = ht->allocator->alloc(ht->allocator->ctx, SNAPSHOT_WORDS(ht->size) * sizeof(uint64_t));
+        if (!ext->shared || !ext->cow_copied)
+        {
+            ht_snapshot_unshare(ht);
+            ht_snapshot_destroy(snap);
+            return NULL;
+        }
+
+        ext->shared->refs = 1;
+        ext->shared->table = ht->table;
+        ext->shared->size = ht->size;
+        ext->shared->bytes = ext->table_bytes;
+        ext->shared->allocator = ht->allocator;
+    }
+
+    // every page must now be copied once more before it changes
+    memset(ext->cow_copied, 0, SNAPSHOT_WORDS(ht->size) * sizeof(uint64_t));
+
+    HT_REFS_INC(&ext->shared->refs);
+    snap->shared = ext->shared;
+    snap->refs = 2;
+    snap->next = ext->snapshots;
+    ext->snapshots = snap;
+
+    return view;
+}
+
+//--------------------------------------
+// release a view, may be called from the
+// thread reading it
+//--------------------------------------
+int ht_snapshot_free(HashTable *snapshot)
+{
+    CHECK_THAT(snapshot && HT_SNAPSHOT(snapshot));
+
+    struct ht_snapshot *snap = snapshot->ext->snapshot;
+
+    // an attached view is freed later by its table
+    if (!HT_REFS_DEC(&snap->refs))
+        ht_snapshot_destroy(snap);
+
+    return HT_OK;
+}
+
+//--------------------------------------
+// print some useful debug stats
+//--------------------------------------
+void ht_debug_stats()
+{
+#if HT_DEBUG_STATS == 1
+    printf("All tables -> allocs: %zu, frees: %zu, resuse: %zu, freelist: %d\n", (size_t)HT_LOAD64(&allocs), (size_t)HT_LOAD64(&frees), (size_t)HT_LOAD64(&resuse), ht_free_count);
+#endif
+}
+
+//--------------------------------------
+// print some useful table stats
+//--------------------------------------
+void ht_stats(HashTable* ht)
+{
+    if (!ht)
+        return;
+
+#if HT_TRACK_STATS == 1
+    printf("This table -> entries: %zu, size: %zu, insert collides: %zu, recent insert collides: %zu, search collides: %zu\n", ht->entries, ht->size, ht->insert_collisions, ht->recent_insert_collisions, ht->search_collisions);
+#endif
+}
+
+//--------------------------------------
+// hash sets store keys only, slots are
+// half the size of table entries
+//--------------------------------------
+
+// removed keys point here
+static const char ht_set_deleted;
+
+#define SET_TOMBSTONE               ((ht_key_t)&ht_set_deleted)
+#define SET_UNUSED(hse)             ((hse)->key == NULL)
+#define SET_EMPTY(hse)              ((hse)->key == NULL || (hse)->key == SET_TOMBSTONE)
+#define SET_MATCH(set, hse, h, k)   ((hse)->hash == (h) && (hse)->key != SET_TOMBSTONE && (hse)->key && (set)->compare_fn((hse)->key, k))
+
+//--------------------------------------
+// create a hash set
+//--------------------------------------
+HashSet *ht_set_create(ht_hash_func hash_fn, ht_compare_func compare_fn)
+{
+    return ht_set_create_with_allocator(hash_fn, compare_fn, NULL);
+}
+
+//--------------------------------------
+// create a hash set using allocator
+//--------------------------------------
+HashSet *ht_set_create_with_allocator(ht_hash_func hash_fn, ht_compare_func compare_fn, const ht_allocator *allocator)
+{
+    if (!allocator)
+        allocator = &ht_default_allocator;
+
+    HashSet *set = allocator->alloc(allocator->ctx, sizeof(HashSet));
+    if (!set)
+        return NULL;
+
+    HT_ALLOC_INC;
+
+    set->allocator = allocator;
+    set->hash_fn = ht_resolve_hash(hash_fn);
+    set->compare_fn = compare_fn ? compare_fn : default_compare_fn;
+
+    // slots are allocated on first add
+    set->table = NULL;
+    set->size = 0;
+    set->mask = 0;
+    set->entries = 0;
+    set->deleted = 0;
+
+    return set;
+}
+
+//--------------------------------------
+// free a hash set
+//
+// NB: keys are not free'd
+//--------------------------------------
+int ht_set_free(HashSet *set)
+{
+    CHECK_THAT(set);
+
+    const ht_allocator *allocator = set->allocator;
+
+    if (set->table)
+    {
+        allocator->free(allocator->ctx, set->table, set->size * sizeof(HashSet_Entry));
+        HT_FREE_INC;
+    }
+
+    allocator->free(allocator->ctx, set, sizeof(HashSet));
+    HT_FREE_INC;
+    return HT_OK;
+}
+
+//--------------------------------------
+// probe for a key, returning its slot or
+// the slot it should be added in
+//--------------------------------------
+static HashSet_Entry *ht_set_probe(HashSet *set, ht_hash_t hash, ht_key_t key, int *found)
+{
+#if HT_PERTURB == 1
+    size_t perturb = hash;
+#else
+    size_t perturb = 0;
+#endif
+
+    HashSet_Entry *free_slot = NULL;
+    size_t start_bin = (size_t)hash & set->mask;
+    size_t bin = start_bin;
+    HashSet_Entry *hse = &set->table[start_bin];
+
+    *found = 0;
+
+    do
+    {
+        if (SET_MATCH(set, hse, hash, key))
+        {
+            *found = 1;
+            return hse;
+        }
+
+        if (SET_UNUSED(hse))
+            return free_slot ? free_slot : hse;
+
+        // remember the first tombstone for reuse
+        if (!free_slot && hse->key == SET_TOMBSTONE)
+            free_slot = hse;
+
+        perturb >>= HT_PERTURB_VALUE;
+
+#if HT_LINEAR == 1
+        bin = (bin + perturb + 1) & set->mask;
+#else
+        bin = (5 * bin + perturb + 1) & set->mask;
+#endif
+        hse = &set->table[bin];
+    } while (bin != start_bin);
+
+    return free_slot;
+}
+
+//--------------------------------------
+// rehash into a new slot array, dropping
+// tombstones
+//--------------------------------------
+static int ht_set_resize(HashSet *set, size_t new_size)
+{
+    HashSet_Entry *new_table = set->allocator->alloc(set->allocator->ctx, new_size * sizeof(HashSet_Entry));
+    if (!new_table)
+        return HT_FAIL;
+
+    HT_ALLOC_INC;
+    memset(new_table, 0, new_size * sizeof(HashSet_Entry));
+
+    for (size_t i = 0; i < set->size; i++)
+    {
+        HashSet_Entry *hse = &set->table[i];
+        if (SET_EMPTY(hse))
+            continue;
+
+        // stored hashes are reused, keys are known to be distinct
+        size_t bin = (size_t)hse->hash & (new_size - 1);
+#if HT_PERTURB == 1
+        size_t perturb = hse->hash;
+#else
+        size_t perturb = 0;
+#endif
+        while (new_table[bin].key)
+        {
+            perturb >>= HT_PERTURB_VALUE;
+#if HT_LINEAR == 1
+            bin = (bin + perturb + 1) & (new_size - 1);
+#else
+            bin = (5 * bin + perturb + 1) & (new_size - 1);
+#endif
+        }
+
+        new_table[bin] = *hse;
+    }
+
+    if (set->table)
+    {
+        set->allocator->free(set->allocator->ctx, set->table, set->size * sizeof(HashSet_Entry));
+        HT_FREE_INC;
+    }
+
+    set->table = new_table;
+    set->size = new_size;
+    set->mask = new_size - 1;
+    set->deleted = 0;
+    return HT_OK;
+}
+
+//--------------------------------------
+// find the slot for a key with a known
+// hash, growing first if needed
+//--------------------------------------
+static HashSet_Entry *ht_set_slot(HashSet *set, ht_hash_t hash, ht_key_t key, int *found)
+{
+    // tombstones count towards the load so misses always reach an unused slot
+    if (!set->table || HT_INV_LOAD_FACTOR * (set->entries + set->deleted + 1) >= set->size)
+    {
+        size_t new_size = set->size ? set->size : HT_DEFAULT_TABLE_SIZE;
+        while (HT_INV_LOAD_FACTOR * (set->entries + 1) >= new_size)
+        {
+            new_size <<= 1;
+        }
+
+        if (!ht_set_resize(set, new_size))
+            return NULL;
+    }
+
+    return ht_set_probe(set, hash, key, found);
+}
+
+//--------------------------------------
+// add a key with a known hash, returns
+// HT_OK if added or already present
+//--------------------------------------
+static int ht_set_add_hash(HashSet *set, ht_hash_t hash, ht_key_t key, int *added)
+{
+    int found;
+    HashSet_Entry *hse = ht_set_slot(set, hash, key, &found);
+
+    *added = 0;
+    if (!hse)
+        return HT_FAIL;
+
+    if (!found)
+    {
+        if (hse->key == SET_TOMBSTONE)
+            set->deleted--;
+
+        hse->hash = hash;
+        hse->key = key;
+        set->entries++;
+        *added = 1;
+    }
+
+    return HT_OK;
+}
+
+//--------------------------------------
+// add a key, fails if already present
+//--------------------------------------
+int ht_set_add(HashSet *set, ht_key_t key)
+{
+    CHECK_THAT(set);
+    CHECK_THAT(key);
+
+    int added;
+    return ht_set_add_hash(set, set->hash_fn(key), key, &added) && added;
+}
+
+//--------------------------------------
+// find a key's slot given its hash
+//--------------------------------------
+static HashSet_Entry *ht_set_lookup(HashSet *set, ht_hash_t hash, ht_key_t key)
+{
+    if (set->entries == 0)
+        return NULL;
+
+    int found;
+    HashSet_Entry *hse = ht_set_probe(set, hash, key, &found);
+    return found ? hse : NULL;
+}
+
+//--------------------------------------
+// test if a key is in the set
+//--------------------------------------
+int ht_set_contains(HashSet *set, ht_key_t key)
+{
+    CHECK_THAT(set);
+    CHECK_THAT(key);
+
+    return ht_set_lookup(set, set->hash_fn(key), key) != NULL;
+}
+
+//--------------------------------------
+// leave a tombstone in a set slot
+//--------------------------------------
+static void ht_set_remove_entry(HashSet *set, HashSet_Entry *hse)
+{
+    hse->hash = 0;
+    hse->key = SET_TOMBSTONE;
+    set->entries--;
+    set->deleted++;
+}
+
+//--------------------------------------
+// remove a key from the set
+//--------------------------------------
+int ht_set_remove(HashSet *set, ht_key_t key)
+{
+    CHECK_THAT(set);
+    CHECK_THAT(key);
+
+    HashSet_Entry *hse = ht_set_lookup(set, set->hash_fn(key), key);
+    if (!hse)
+        return HT_FAIL;
+
+    ht_set_remove_entry(set, hse);
+    return HT_OK;
+}
+
+//--------------------------------------
+// iterate over set keys
+//--------------------------------------
+int ht_set_next(HashSet *set, size_t *ipos, ht_key_t *pkey)
+{
+    CHECK_THAT(set && ipos);
+
+    size_t index = *ipos;
+    while (index < set->size && SET_EMPTY(&set->table[index]))
+    {
+        index++;
+    }
+
+    if (index >= set->size)
+        return HT_FAIL;
+
+    if (pkey)
+        *pkey = set->table[index].key;
+
+    *ipos = index + 1;
+    return HT_OK;
+}
+
+//--------------------------------------
+// number of keys in the set
+//--------------------------------------
+size_t ht_set_size(HashSet *set)
+{
+    CHECK_THAT(set);
+    return set->entries;
+}
+
+//--------------------------------------
+// stream over the occupied slots of src
+// a batch at a time, prefetching each
+// key's home slot in other before the
+// batch is looked up there
+//--------------------------------------
+static size_t ht_set_gather(HashSet *src, size_t *ipos, HashSet *other, HashSet_Entry **batch)
+{
+    size_t n = 0;
+
+    for (size_t i = *ipos; i < src->size && n < HT_FIND_BATCH; i++)
+    {
+        if (SET_EMPTY(&src->table[i]))
+            continue;
+
+        batch[n++] = &src->table[i];
+        *ipos = i + 1;
+
+        if (other->table)
+            HT_PREFETCH(&other->table[(size_t)src->table[i].hash & other->mask]);
+    }
+
+    if (n < HT_FIND_BATCH)
+        *ipos = src->size;
+
+    return n;
+}
+
+//--------------------------------------
+// add every key of src to dst
+//--------------------------------------
+int ht_set_union(HashSet *dst, HashSet *src)
+{
+    CHECK_THAT(dst && src && dst != src);
+
+    // stored hashes are only shared between sets hashing alike
+    CHECK_THAT(dst->hash_fn == src->hash_fn);
+
+    // size once up front rather than growing mid-stream
+    size_t new_size = dst->size ? dst->size : HT_DEFAULT_TABLE_SIZE;
+    while (HT_INV_LOAD_FACTOR * (dst->entries + src->entries + 1) >= new_size)
+    {
+        new_size <<= 1;
+    }
+
+    if (new_size != dst->size && !ht_set_resize(dst, new_size))
+        return HT_FAIL;
+
+    HashSet_Entry *batch[HT_FIND_BATCH];
+    size_t pos = 0, n;
+    int added;
+
+    while ((n = ht_set_gather(src, &pos, dst, batch)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!ht_set_add_hash(dst, batch[i]->hash, batch[i]->key, &added))
+                return HT_FAIL;
+        }
+    }
+
+    return HT_OK;
+}
+
+//--------------------------------------
+// remove keys of dst that src does or
+// doesn't contain
+//--------------------------------------
+static int ht_set_filter(HashSet *dst, HashSet *src, int keep_common)
+{
+    CHECK_THAT(dst && src && dst != src);
+    CHECK_THAT(dst->hash_fn == src->hash_fn);
+
+    HashSet_Entry *batch[HT_FIND_BATCH];
+    size_t pos = 0, n;
+
+    while ((n = ht_set_gather(dst, &pos, src, batch)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            int common = ht_set_lookup(src, batch[i]->hash, batch[i]->key) != NULL;
+            if (common != keep_common)
+                ht_set_remove_entry(dst, batch[i]);
+        }
+    }
+
+    return HT_OK;
+}
+
+//--------------------------------------
+// keep only keys of dst also in src
+//--------------------------------------
+int ht_set_intersect(HashSet *dst, HashSet *src)
+{
+    return ht_set_filter(dst, src, 1);
+}
+
+//--------------------------------------
+// remove keys of src from dst
+//--------------------------------------
+int ht_set_difference(HashSet *dst, HashSet *src)
+{
+    return ht_set_filter(dst, src, 0);
+}
+
+//--------------------------------------
+// counter maps add to inline 64-bit
+// counts from many threads. Keys are
+// added under a spin lock and never
+// move, so adds to existing keys are a
+// lock-free probe and fetch_add.
+//--------------------------------------
+
+// deltas a thread has yet to add to its map
+struct ht_counter_buffer
+{
+    HashCounter *map;
+    size_t entries;
+    size_t adds;            // since the last flush
+    HashCounter_Entry table[HT_COUNTER_BUFFER];
+};
+
+//--------------------------------------
+// create a counter map
+//--------------------------------------
+HashCounter *ht_counter_create(ht_hash_func hash_fn, ht_compare_func compare_fn)
+{
+    HashCounter *map = HT_ALLOC(sizeof(HashCounter));
+    if (!map)
+        return NULL;
+
+    HT_ALLOC_INC;
+
+    memset(map, 0, sizeof(HashCounter));
+    map->hash_fn = ht_resolve_hash(hash_fn);
+    map->compare_fn = compare_fn ? compare_fn : default_compare_fn;
+
+    // segments are allocated on first add
+    return map;
+}
+
+//--------------------------------------
+// free a counter map, once no thread is
+// using it or a buffer of it
+//
+// NB: keys are not free'd
+//--------------------------------------
+int ht_counter_free(HashCounter *map)
+{
+    CHECK_THAT(map);
+
+    for (long i = 0; i < map->segment_count; i++)
+    {
+        HT_FREE(map->segments[i]);
+        HT_FREE_INC;
+    }
+
+    HT_FREE(map);
+    HT_FREE_INC;
+    return HT_OK;
+}
+
+//--------------------------------------
+// probe one segment for a key, returning
+// its slot or NULL and the slot it would
+// be added in
+//--------------------------------------
+static HashCounter_Entry *ht_counter_probe(HashCounter *map, HashCounter_Entry *table, size_t mask, ht_hash_t hash, ht_key_t key, HashCounter_Entry **pfree)
+{
 #if HT_PERTURB == 1
     size_t perturb = hash;
 #else
-    size_t perturb = 0;
+    size_t perturb = 0;
+#endif
+
+    size_t start_bin = (size_t)hash & mask;
+    size_t bin = start_bin;
+
+    do
+    {
+        HashCounter_Entry *hce = &table[bin];
+
+        // the key is published last, so a key means a whole slot
+        ht_key_t slot_key = HT_LOAD_PTR(&hce->key);
+        if (!slot_key)
+        {
+            if (pfree)
+                *pfree = hce;
+            return NULL;
+        }
+
+        if (hce->hash == hash && map->compare_fn(slot_key, key))
+            return hce;
+
+        perturb >>= HT_PERTURB_VALUE;
+
+#if HT_LINEAR == 1
+        bin = (bin + perturb + 1) & mask;
+#else
+        bin = (5 * bin + perturb + 1) & mask;
+#endif
+    } while (bin != start_bin);
+
+    if (pfree)
+        *pfree = NULL;
+    return NULL;
+}
+
+//--------------------------------------
+// find a key's slot, newest segment
+// first as it holds the most keys
+//--------------------------------------
+static HashCounter_Entry *ht_counter_lookup(HashCounter *map, ht_hash_t hash, ht_key_t key)
+{
+    for (long i = HT_REFS_LOAD(&map->segment_count) - 1; i >= 0; i--)
+    {
+        HashCounter_Segment *seg = HT_LOAD_PTR(&map->segments[i]);
+        HashCounter_Entry *hce = ht_counter_probe(map, seg->table, seg->mask, hash, key, NULL);
+        if (hce)
+            return hce;
+    }
+
+    return NULL;
+}
+
+//--------------------------------------
+// add a key with a zero count, unless
+// another thread just did, returning
+// its slot
+//--------------------------------------
+static HashCounter_Entry *ht_counter_insert(HashCounter *map, ht_hash_t hash, ht_key_t key)
+{
+    while (!HT_TRY_LOCK(&map->lock))
+    {
+        // the holder may be descheduled, so stop spinning after a while
+        for (int spins = 0; HT_REFS_LOAD(&map->lock); spins++)
+        {
+            if (spins < HT_LOCK_SPINS)
+                HT_PAUSE();
+            else
+                HT_YIELD();
+        }
+    }
+
+    HashCounter_Entry *hce = ht_counter_lookup(map, hash, key);
+    long count = map->segment_count;
+    HashCounter_Segment *seg = count ? map->segments[count - 1] : NULL;
+
+    // the newest segment is full, add one four times the size
+    if (!hce && (!seg || HT_INV_LOAD_FACTOR * (seg->entries + 1) > seg->size) && count < HT_COUNTER_SEGMENTS)
+    {
+        size_t size = seg ? seg->size << 2 : HT_COUNTER_SIZE;
+        HashCounter_Segment *grown = HT_ALLOC(sizeof(HashCounter_Segment) + size * sizeof(HashCounter_Entry));
+
+        if (grown)
+        {
+            HT_ALLOC_INC;
+
+            grown->size = size;
+            grown->mask = size - 1;
+            grown->entries = 0;
+            grown->table = (HashCounter_Entry*)(grown + 1);
+            memset(grown->table, 0, size * sizeof(HashCounter_Entry));
+
+            // readers see the segment before the count that includes it
+            HT_STORE_PTR(&map->segments[count], grown);
+            HT_REFS_STORE(&map->segment_count, count + 1);
+            seg = grown;
+        }
+    }
+
+    if (!hce && seg && HT_INV_LOAD_FACTOR * (seg->entries + 1) <= seg->size)
+    {
+        ht_counter_probe(map, seg->table, seg->mask, hash, key, &hce);
+
+        hce->value = 0;
+        hce->hash = hash;
+        HT_STORE_PTR(&hce->key, key);
+        seg->entries++;
+        HT_ADD64(&map->entries, 1);
+    }
+
+    HT_UNLOCK(&map->lock);
+    return hce;
+}
+
+//--------------------------------------
+// add to a key's count given its hash
+//--------------------------------------
+static int ht_counter_add_hash(HashCounter *map, ht_hash_t hash, ht_key_t key, int64_t delta)
+{
+    HashCounter_Entry *hce = ht_counter_lookup(map, hash, key);
+    if (!hce)
+        hce = ht_counter_insert(map, hash, key);
+
+    if (!hce)
+        return HT_FAIL;
+
+    HT_ADD64(&hce->value, delta);
+    return HT_OK;
+}
+
+//--------------------------------------
+// add delta to a key's count, adding the
+// key if needed. Safe from any thread.
+//--------------------------------------
+int ht_counter_add(HashCounter *map, ht_key_t key, int64_t delta)
+{
+    CHECK_THAT(map && key);
+    return ht_counter_add_hash(map, map->hash_fn(key), key, delta);
+}
+
+//--------------------------------------
+// read a key's count
+//--------------------------------------
+int ht_counter_get(HashCounter *map, ht_key_t key, int64_t *pvalue)
+{
+    CHECK_THAT(map && key);
+
+    HashCounter_Entry *hce = ht_counter_lookup(map, map->hash_fn(key), key);
+    if (!hce)
+        return HT_FAIL;
+
+    if (pvalue)
+        *pvalue = HT_LOAD64(&hce->value);
+    return HT_OK;
+}
+
+//--------------------------------------
+// number of keys in the map
+//--------------------------------------
+size_t ht_counter_size(HashCounter *map)
+{
+    CHECK_THAT(map);
+    return (size_t)HT_LOAD64(&map->entries);
+}
+
+//--------------------------------------
+// copy up to n keys and counts from
+// *ipos on, zeroing the counts if asked.
+// Positions run through the segments
+// oldest first, so keys added while
+// iterating land after the cursor.
+//--------------------------------------
+static size_t ht_counter_next_batch(HashCounter *map, size_t *ipos, ht_key_t *keys, int64_t *values, size_t n, int drain)
+{
+    CHECK_THAT(map && ipos && keys && values);
+
+    size_t found = 0, base = 0;
+    long count = HT_REFS_LOAD(&map->segment_count);
+
+    for (long i = 0; i < count && found < n; i++)
+    {
+        HashCounter_Segment *seg = HT_LOAD_PTR(&map->segments[i]);
+
+        for (; *ipos < base + seg->size && found < n; (*ipos)++)
+        {
+            if (*ipos < base)
+                *ipos = base;
+
+            HashCounter_Entry *hce = &seg->table[*ipos - base];
+            ht_key_t key = HT_LOAD_PTR(&hce->key);
+            if (!key)
+                continue;
+
+            int64_t value = HT_LOAD64(&hce->value);
+            if (drain && value)
+                value = HT_XCHG64(&hce->value, 0);
+
+            // drains only report counts that changed
+            if (drain && !value)
+                continue;
+
+            keys[found] = key;
+            values[found] = value;
+            found++;
+        }
+
+        base += seg->size;
+    }
+
+    return found;
+}
+
+//--------------------------------------
+// copy up to n keys and their counts,
+// returning how many were copied (0 at
+// the end)
+//
+// Each count is read atomically, but
+// adds may land between reads.
+//--------------------------------------
+size_t ht_counter_snapshot(HashCounter *map, size_t *ipos, ht_key_t *keys, int64_t *values, size_t n)
+{
+    return ht_counter_next_batch(map, ipos, keys, values, n, 0);
+}
+
+//--------------------------------------
+// as ht_counter_snapshot, but swaps each
+// count with zero and skips zero counts,
+// so concurrent adds are never lost
+//--------------------------------------
+size_t ht_counter_drain(HashCounter *map, size_t *ipos, ht_key_t *keys, int64_t *values, size_t n)
+{
+    return ht_counter_next_batch(map, ipos, keys, values, n, 1);
+}
+
+//--------------------------------------
+// create a buffer for one thread to
+// collect deltas in before adding them
+// to the shared map
+//--------------------------------------
+ht_counter_buffer *ht_counter_buffer_create(HashCounter *map)
+{
+    CHECK_THAT(map);
+
+    ht_counter_buffer *buffer = HT_ALLOC(sizeof(ht_counter_buffer));
+    if (!buffer)
+        return NULL;
+
+    HT_ALLOC_INC;
+
+    memset(buffer, 0, sizeof(ht_counter_buffer));
+    buffer->map = map;
+    return buffer;
+}
+
+//--------------------------------------
+// add a buffer's deltas to its map and
+// empty it. Deltas the map can't take
+// stay buffered for the next flush.
+//--------------------------------------
+int ht_counter_flush(ht_counter_buffer *buffer)
+{
+    CHECK_THAT(buffer);
+
+    int result = HT_OK;
+    size_t pending = buffer->entries;
+    for (size_t i = 0; i < HT_COUNTER_BUFFER && pending; i++)
+    {
+        HashCounter_Entry *hce = &buffer->table[i];
+        if (!hce->key)
+            continue;
+
+        pending--;
+        if (hce->value && !ht_counter_add_hash(buffer->map, hce->hash, hce->key, hce->value))
+        {
+            result = HT_FAIL;
+            continue;
+        }
+
+        hce->key = NULL;
+        buffer->entries--;
+    }
+
+    buffer->adds = 0;
+    return result;
+}
+
+//--------------------------------------
+// add delta to a key in the buffer. The
+// buffer flushes itself when full and
+// after HT_COUNTER_FLUSH adds, so counts
+// lag by a bounded amount.
+//
+// NB: buffers are not thread safe, each
+// thread needs its own
+//--------------------------------------
+int ht_counter_buffer_add(ht_counter_buffer *buffer, ht_key_t key, int64_t delta)
+{
+    CHECK_THAT(buffer && key);
+
+    HashCounter *map = buffer->map;
+    ht_hash_t hash = map->hash_fn(key);
+    HashCounter_Entry *free_slot;
+    HashCounter_Entry *hce = ht_counter_probe(map, buffer->table, HT_COUNTER_BUFFER - 1, hash, key, &free_slot);
+    int result = HT_OK;
+
+    if (!hce)
+    {
+        if (HT_INV_LOAD_FACTOR * (buffer->entries + 1) > HT_COUNTER_BUFFER)
+        {
+            result = ht_counter_flush(buffer);
+            ht_counter_probe(map, buffer->table, HT_COUNTER_BUFFER - 1, hash, key, &free_slot);
+        }
+
+        // every slot holds a delta the map refused, try this one there too
+        if (!free_slot)
+            return ht_counter_add_hash(map, hash, key, delta) ? result : HT_FAIL;
+
+        hce = free_slot;
+        hce->value = 0;
+        hce->hash = hash;
+        hce->key = key;
+        buffer->entries++;
+    }
+
+    hce->value += delta;
+
+    if (++buffer->adds >= HT_COUNTER_FLUSH && !ht_counter_flush(buffer))
+        result = HT_FAIL;
+
+    return result;
+}
+
+//--------------------------------------
+// flush and free a buffer, HT_FAIL if
+// any delta couldn't be added and was
+// lost
+//--------------------------------------
+int ht_counter_buffer_free(ht_counter_buffer *buffer)
+{
+    CHECK_THAT(buffer);
+
+    int result = ht_counter_flush(buffer);
+
+    HT_FREE(buffer);
+    HT_FREE_INC;
+    return result;
+}
+
+//--------------------------------------
+// shared memory tables
+//--------------------------------------
+// A region holds a header, a slot array and a heap of key/value blocks,
+// all addressed by offset from the region start so each process can map
+// it anywhere. The heap is the source of truth: slots only index it, and
+// ht_shm_rebuild recreates them and the free lists from block headers.
+// Writers hold a process-shared lock and keep the sequence count odd while
+// they change anything. Readers copy out without locking and retry if the
+// count moved.
+
+#if HT_USE_SHM == 1
+
+#define SHM_MAGIC               "HTSHM001"
+#define SHM_ALIGN               64
+#define SHM_MIN_BLOCK           64      // blocks are SHM_MIN_BLOCK << class bytes
+#define SHM_CLASSES             40
+
+// slot offsets below the heap
+#define SHM_UNUSED              0
+#define SHM_TOMBSTONE           1
+
+#define SHM_BLOCK_FREE          0x46524545
+#define SHM_BLOCK_USED          0x55534544
+
+typedef struct ht_shm_header
+{
+    char magic[8];              // set last, once the region is ready
+    uint64_t bytes;             // region length
+    uint64_t seed[2];
+    uint64_t slots;             // power of 2
+    uint64_t mask;
+    uint64_t table;             // slot array offset
+    uint64_t heap;              // first block offset
+    uint64_t heap_top;          // end of the blocks carved so far
+    uint64_t heap_end;
+    uint64_t entries;
+    uint64_t deleted;           // tombstones
+    uint64_t version;           // of the newest block, the newest copy of a key wins on rebuild
+    uint64_t free_lists[SHM_CLASSES];
+    uint64_t seq;               // odd while a writer is changing the region
+    pthread_mutex_t lock;
+} ht_shm_header;
+
+typedef struct ht_shm_slot
+{
+    uint64_t hash;
+    uint64_t offset;            // block offset, or SHM_UNUSED/SHM_TOMBSTONE
+} ht_shm_slot;
+
+// key then value bytes follow the header
+typedef struct ht_shm_block
+{
+    uint32_t state;             // SHM_BLOCK_xxx
+    uint32_t klass;
+    uint32_t key_len;
+    uint32_t value_len;
+    uint64_t version;
+    uint64_t next_free;
+} ht_shm_block;
+
+struct HashShm
+{
+    char *base;                 // where this process mapped the region
+    ht_shm_header *header;
+    size_t bytes;
+    int fd;
+};
+
+#define SHM_ROUND(n)            (((uint64_t)(n) + SHM_ALIGN - 1) & ~(uint64_t)(SHM_ALIGN - 1))
+#define SHM_SLOTS(shm)          ((ht_shm_slot*)((shm)->base + (shm)->header->table))
+#define SHM_BLOCK(shm, offset)  ((ht_shm_block*)((shm)->base + (offset)))
+#define SHM_BLOCK_BYTES(klass)  ((uint64_t)SHM_MIN_BLOCK << (klass))
+#define SHM_KEY(block)          ((char*)(block) + sizeof(ht_shm_block))
+
+// fields other processes may be writing
+#define SHM_READ(field)         __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define SHM_WRITE(field, v)     __atomic_store_n(&(field), v, __ATOMIC_RELAXED)
+#define SHM_SEQ_LOAD(p)         __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define SHM_SEQ_STORE(p, seq)   __atomic_store_n(p, seq, __ATOMIC_RELEASE)
+
+static void ht_shm_rebuild(HashShm *shm);
+
+//--------------------------------------
+// hash a key with the region's seed
+//--------------------------------------
+static uint64_t ht_shm_hash(HashShm *shm, const void *key, size_t key_len)
+{
+    return ht_siphash13(key, key_len, shm->header->seed);
+}
+
+//--------------------------------------
+// follow a block offset, which readers
+// may have read mid-write, returning
+// NULL unless it and its lengths lie
+// inside the heap
+//--------------------------------------
+static ht_shm_block *ht_shm_block_at(HashShm *shm, uint64_t offset, uint64_t heap_top, uint32_t *key_len, uint32_t *value_len)
+{
+    ht_shm_header *hdr = shm->header;
+
+    if (offset < hdr->heap || offset >= heap_top || heap_top > hdr->heap_end || (offset - hdr->heap) % SHM_MIN_BLOCK)
+        return NULL;
+
+    ht_shm_block *block = SHM_BLOCK(shm, offset);
+    uint32_t klass = SHM_READ(block->klass);
+    *key_len = SHM_READ(block->key_len);
+    *value_len = SHM_READ(block->value_len);
+
+    if (klass >= SHM_CLASSES || SHM_BLOCK_BYTES(klass) > heap_top - offset)
+        return NULL;
+
+    if ((uint64_t)*key_len + *value_len > SHM_BLOCK_BYTES(klass) - sizeof(ht_shm_block))
+        return NULL;
+
+    return block;
+}
+
+//--------------------------------------
+// probe for a key, returning its slot or
+// NULL. *pfree is set to the first slot
+// an insert could use.
+//--------------------------------------
+static ht_shm_slot *ht_shm_probe(HashShm *shm, uint64_t hash, const void *key, size_t key_len, uint64_t heap_top, ht_shm_slot **pfree)
+{
+    ht_shm_slot *slots = SHM_SLOTS(shm);
+    size_t mask = (size_t)shm->header->mask;
+    size_t start_bin = (size_t)hash & mask;
+    size_t bin = start_bin;
+
+    if (pfree)
+        *pfree = NULL;
+
+    do
+    {
+        ht_shm_slot *slot = &slots[bin];
+        uint64_t offset = SHM_READ(slot->offset);
+
+        if (offset == SHM_UNUSED || offset == SHM_TOMBSTONE)
+        {
+            if (pfree && !*pfree)
+                *pfree = slot;
+
+            if (offset == SHM_UNUSED)
+                return NULL;
+        }
+        else if (SHM_READ(slot->hash) == hash)
+        {
+            uint32_t klen, vlen;
+            ht_shm_block *block = ht_shm_block_at(shm, offset, heap_top, &klen, &vlen);
+
+            if (block && klen == key_len && !memcmp(SHM_KEY(block), key, key_len))
+                return slot;
+        }
+
+        // a fixed probe, so processes built with other HT_LINEAR or
+        // HT_PERTURB settings agree
+        bin = (5 * bin + 1) & mask;
+    } while (bin != start_bin);
+
+    return NULL;
+}
+
+//--------------------------------------
+// copy up to *pcap bytes out, setting
+// *pcap to the full length
+//--------------------------------------
+static void ht_shm_copy(void *dst, size_t *pcap, const char *src, uint32_t len)
+{
+    if (!pcap)
+        return;
+
+    if (dst)
+        memcpy(dst, src, *pcap < len ? *pcap : len);
+
+    *pcap = len;
+}
+
+//--------------------------------------
+// lock the region for writing, first
+// repairing it if the last writer died
+// part way through a change
+//--------------------------------------
+static int ht_shm_lock(HashShm *shm)
+{
+    ht_shm_header *hdr = shm->header;
+    int rc = pthread_mutex_lock(&hdr->lock);
+
+#if HT_SHM_ROBUST == 1
+    if (rc == EOWNERDEAD)
+        rc = pthread_mutex_consistent(&hdr->lock);
 #endif
 
-    int done = 0;
+    if (rc)
+        return HT_FAIL;
+
+    if (hdr->seq & 1)
+    {
+        ht_shm_rebuild(shm);
+        SHM_SEQ_STORE(&hdr->seq, hdr->seq + 1);
+    }
+
+    return HT_OK;
+}
+
+static void ht_shm_unlock(HashShm *shm)
+{
+    pthread_mutex_unlock(&shm->header->lock);
+}
+
+//--------------------------------------
+// bracket changes readers must not see
+// half done
+//--------------------------------------
+static void ht_shm_write_begin(ht_shm_header *hdr)
+{
+    SHM_SEQ_STORE(&hdr->seq, hdr->seq + 1);
+    HT_FENCE();
+}
+
+static void ht_shm_write_end(ht_shm_header *hdr)
+{
+    SHM_SEQ_STORE(&hdr->seq, hdr->seq + 1);
+}
+
+//--------------------------------------
+// return a block to its free list
+//--------------------------------------
+static void ht_shm_free_block(HashShm *shm, uint64_t offset)
+{
+    ht_shm_header *hdr = shm->header;
+    ht_shm_block *block = SHM_BLOCK(shm, offset);
+
+    block->state = SHM_BLOCK_FREE;
+    block->next_free = hdr->free_lists[block->klass];
+    hdr->free_lists[block->klass] = offset;
+}
+
+//--------------------------------------
+// allocate a block of at least bytes,
+// from its class's free list, the heap
+// top, or a larger class's free list
+//--------------------------------------
+static uint64_t ht_shm_alloc(HashShm *shm, size_t bytes)
+{
+    ht_shm_header *hdr = shm->header;
+    uint32_t klass = 0;
 
-    // look at entry based on hash
-    size_t start_bin = (size_t)hash & ht->mask;
-    size_t bin = start_bin;
-    HashTable_Entry* hte = &ht->table[start_bin];
+    while (SHM_BLOCK_BYTES(klass) < bytes)
+    {
+        if (++klass == SHM_CLASSES)
+            return 0;
+    }
 
-    do
+    for (uint32_t k = klass; k < SHM_CLASSES; k++)
     {
-        if (HASH_MATCH(hte, hash, key))
+        uint64_t offset = hdr->free_lists[k];
+        if (offset)
         {
-            return hte->value;
+            hdr->free_lists[k] = SHM_BLOCK(shm, offset)->next_free;
+            return offset;
         }
 
-        HT_SEARCH_COLLIDE(ht);
+        // carve a new block before trying larger ones
+        if (k == klass && SHM_BLOCK_BYTES(klass) <= hdr->heap_end - hdr->heap_top)
+        {
+            offset = hdr->heap_top;
 
-        perturb >>= HT_PERTURB_VALUE;
+            // the header is written before the top moves past it
+            ht_shm_block *block = SHM_BLOCK(shm, offset);
+            block->state = SHM_BLOCK_FREE;
+            block->klass = klass;
+            hdr->heap_top += SHM_BLOCK_BYTES(klass);
+            return offset;
+        }
+    }
 
-#if HT_LINEAR == 1
-        bin = (bin + perturb + 1) & ht->mask;
+    return 0;
+}
+
+//--------------------------------------
+// index a block during a rebuild
+//--------------------------------------
+static void ht_shm_rebuild_block(HashShm *shm, uint64_t offset)
+{
+    ht_shm_header *hdr = shm->header;
+    ht_shm_block *block = SHM_BLOCK(shm, offset);
+    uint32_t key_len, value_len;
+
+    if (block->state != SHM_BLOCK_USED || !ht_shm_block_at(shm, offset, hdr->heap_top, &key_len, &value_len))
+    {
+        ht_shm_free_block(shm, offset);
+        return;
+    }
+
+    uint64_t hash = ht_shm_hash(shm, SHM_KEY(block), key_len);
+    ht_shm_slot *free_slot;
+    ht_shm_slot *slot = ht_shm_probe(shm, hash, SHM_KEY(block), key_len, hdr->heap_top, &free_slot);
+
+    if (slot)
+    {
+        // a writer died between storing a new value and freeing the old
+        uint64_t older = slot->offset;
+        if (SHM_BLOCK(shm, older)->version < block->version)
+        {
+            slot->offset = offset;
+            offset = older;
+        }
+
+        ht_shm_free_block(shm, offset);
+    }
+    else if (free_slot)
+    {
+        free_slot->hash = hash;
+        free_slot->offset = offset;
+        hdr->entries++;
+    }
+    else
+    {
+        ht_shm_free_block(shm, offset);
+    }
+}
+
+//--------------------------------------
+// recreate the slots and free lists from
+// the heap, dropping tombstones. Must be
+// called between write begin and end.
+//--------------------------------------
+static void ht_shm_rebuild(HashShm *shm)
+{
+    ht_shm_header *hdr = shm->header;
+
+    memset(SHM_SLOTS(shm), 0, (size_t)hdr->slots * sizeof(ht_shm_slot));
+    memset(hdr->free_lists, 0, sizeof(hdr->free_lists));
+    hdr->entries = 0;
+    hdr->deleted = 0;
+
+    uint64_t offset = hdr->heap;
+    while (offset < hdr->heap_top)
+    {
+        ht_shm_block *block = SHM_BLOCK(shm, offset);
+
+        // nothing past a bad header can be trusted
+        if (block->klass >= SHM_CLASSES || SHM_BLOCK_BYTES(block->klass) > hdr->heap_top - offset)
+        {
+            hdr->heap_top = offset;
+            break;
+        }
+
+        uint64_t next = offset + SHM_BLOCK_BYTES(block->klass);
+        ht_shm_rebuild_block(shm, offset);
+        offset = next;
+    }
+}
+
+//--------------------------------------
+// open an anonymous region, shared with
+// children after fork or passed by fd
+//--------------------------------------
+static int ht_shm_anonymous()
+{
+#ifdef SYS_memfd_create
+    int fd = (int)syscall(SYS_memfd_create, "ht_shm", 1u);     // MFD_CLOEXEC
+    if (fd >= 0)
+        return fd;
+#endif
+
+    // no memfd, use a named object and unlink it at once
+    char name[64];
+    for (int tries = 0; tries < 16; tries++)
+    {
+        snprintf(name, sizeof(name), "/ht_shm_%ld_%llx", (long)getpid(), (unsigned long long)(ht_now_ns() + tries));
+
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0)
+        {
+            shm_unlink(name);
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+//--------------------------------------
+// map a region, taking ownership of fd
+//--------------------------------------
+static HashShm *ht_shm_map(int fd, size_t bytes)
+{
+    HashShm *shm = HT_ALLOC(sizeof(HashShm));
+    void *base = shm ? mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+    if (base == MAP_FAILED)
+    {
+        HT_FREE(shm);
+        close(fd);
+        return NULL;
+    }
+
+    HT_ALLOC_INC;
+
+    shm->base = base;
+    shm->header = base;
+    shm->bytes = bytes;
+    shm->fd = fd;
+    return shm;
+}
+
+//--------------------------------------
+// map an existing region, checking it
+// was made by ht_shm_create. errno is
+// EAGAIN if its creator hasn't finished
+// setting it up, or died before it did,
+// and EINVAL if it isn't a table.
+//--------------------------------------
+static HashShm *ht_shm_attach(int fd)
+{
+    static const char unset[sizeof(SHM_MAGIC) - 1];
+    struct stat st;
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // not sized yet
+    if ((uint64_t)st.st_size < sizeof(ht_shm_header))
+    {
+        close(fd);
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    HashShm *shm = ht_shm_map(fd, (size_t)st.st_size);
+    if (!shm)
+        return NULL;
+
+    ht_shm_header *hdr = shm->header;
+    HT_FENCE_ACQUIRE();
+
+    if (memcmp(hdr->magic, SHM_MAGIC, sizeof(hdr->magic)) || hdr->bytes != (uint64_t)st.st_size)
+    {
+        // the magic goes in last, so a region without one was never finished
+        int err = memcmp(hdr->magic, unset, sizeof(hdr->magic)) ? EINVAL : EAGAIN;
+        ht_shm_close(shm);
+        errno = err;
+        return NULL;
+    }
+
+    return shm;
+}
+
+#endif
+
+//--------------------------------------
+// create a table in shared memory with
+// room for capacity entries and
+// heap_bytes of keys and values
+//
+// A named region (e.g. "/my_table") can
+// be opened by other processes with
+// ht_shm_open. With no name the region
+// is anonymous, children inherit it
+// across fork and others may be passed
+// ht_shm_fd over a Unix socket.
+//
+// NB: without robust mutexes (anywhere
+// but Linux) a process that dies while
+// writing leaves the region locked, so
+// later callers that lock block for
+// good. Unlink and recreate it.
+//--------------------------------------
+HashShm *ht_shm_create(const char *name, size_t capacity, size_t heap_bytes)
+{
+#if HT_USE_SHM == 1
+    CHECK_THAT(capacity && heap_bytes);
+
+    size_t slots = HT_DEFAULT_TABLE_SIZE;
+    while (slots < HT_INV_LOAD_FACTOR * capacity)
+    {
+        slots <<= 1;
+    }
+
+    uint64_t table = SHM_ROUND(sizeof(ht_shm_header));
+    uint64_t heap = SHM_ROUND(table + slots * sizeof(ht_shm_slot));
+    uint64_t bytes = heap + SHM_ROUND(heap_bytes);
+
+    int fd = name ? shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600) : ht_shm_anonymous();
+    if (fd < 0)
+        return NULL;
+
+    // new regions read as zero
+    if (ftruncate(fd, (off_t)bytes))
+    {
+        close(fd);
+        if (name)
+            shm_unlink(name);
+        return NULL;
+    }
+
+    HashShm *shm = ht_shm_map(fd, (size_t)bytes);
+    if (!shm)
+    {
+        if (name)
+            shm_unlink(name);
+        return NULL;
+    }
+
+    ht_shm_header *hdr = shm->header;
+    hdr->bytes = bytes;
+    hdr->slots = slots;
+    hdr->mask = slots - 1;
+    hdr->table = table;
+    hdr->heap = heap;
+    hdr->heap_top = heap;
+    hdr->heap_end = bytes;
+    ht_new_seed(hdr->seed);
+
+    pthread_mutexattr_t attr;
+    int rc = pthread_mutexattr_init(&attr);
+    if (!rc)
+    {
+        rc = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#if HT_SHM_ROBUST == 1
+        if (!rc)
+            rc = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+        if (!rc)
+            rc = pthread_mutex_init(&hdr->lock, &attr);
+
+        pthread_mutexattr_destroy(&attr);
+    }
+
+    if (rc)
+    {
+        ht_shm_close(shm);
+        if (name)
+            shm_unlink(name);
+        return NULL;
+    }
+
+    // openers check the magic, so it goes in last
+    HT_FENCE();
+    memcpy(hdr->magic, SHM_MAGIC, sizeof(hdr->magic));
+
+    return shm;
 #else
-        bin = (5 * bin + perturb + 1) & ht->mask;
+    return NULL;
 #endif
-        hte = &ht->table[bin];
+}
 
-//#if HT_PERTURB != 1
-        done = bin == start_bin;
-//#endif
-    } while (!done);
+//--------------------------------------
+// open a named shared memory table
+//--------------------------------------
+HashShm *ht_shm_open(const char *name)
+{
+#if HT_USE_SHM == 1
+    CHECK_THAT(name);
+    return ht_shm_attach(shm_open(name, O_RDWR, 0));
+#else
+    return NULL;
+#endif
+}
 
-    // if not found, fail
+//--------------------------------------
+// open a shared memory table from a file
+// descriptor, which the caller keeps
+//--------------------------------------
+HashShm *ht_shm_open_fd(int fd)
+{
+#if HT_USE_SHM == 1
+    return ht_shm_attach(fd >= 0 ? dup(fd) : -1);
+#else
     return NULL;
+#endif
 }
 
 //--------------------------------------
-// internal insert
+// the region's file descriptor
 //--------------------------------------
-static int ht_insert_nocheck(HashTable *ht, HashTable_Entry* table, ht_hash_t hash, ht_key_t key, ht_value_t value, size_t size, int replace)
+int ht_shm_fd(HashShm *shm)
 {
-    CHECK_THAT(ht && table);
-    CHECK_THAT(key);
+#if HT_USE_SHM == 1
+    return shm ? shm->fd : -1;
+#else
+    return -1;
+#endif
+}
 
-    // check that size is power of 2
-    CHECK_THAT(size && !(size & (size - 1)));
+//--------------------------------------
+// unmap this process's view
+//
+// NB: the region lives on while other
+// processes have it open, and a named
+// region until ht_shm_unlink
+//--------------------------------------
+int ht_shm_close(HashShm *shm)
+{
+#if HT_USE_SHM == 1
+    CHECK_THAT(shm);
 
-#if HT_PERTURB == 1
-    size_t perturb = hash;
+    munmap(shm->base, shm->bytes);
+    close(shm->fd);
+
+    HT_FREE(shm);
+    HT_FREE_INC;
+    return HT_OK;
 #else
-    size_t perturb = 0;
+    return HT_FAIL;
 #endif
+}
 
-    size_t mask = size - 1;
-    int done = 0;
+//--------------------------------------
+// remove a named region's name
+//--------------------------------------
+int ht_shm_unlink(const char *name)
+{
+#if HT_USE_SHM == 1
+    CHECK_THAT(name);
+    return shm_unlink(name) == 0 ? HT_OK : HT_FAIL;
+#else
+    return HT_FAIL;
+#endif
+}
 
-    // check for free entry based on hash
-    size_t start_bin = (size_t)hash & mask;
-    size_t bin = start_bin;
-    HashTable_Entry* hte = &table[start_bin];
+//--------------------------------------
+// store a key's value in a new block,
+// replacing any old value if asked
+//--------------------------------------
+#if HT_USE_SHM == 1
+static int ht_shm_put(HashShm *shm, const void *key, size_t key_len, const void *value, size_t value_len, int replace)
+{
+    CHECK_THAT(shm && (key || !key_len) && (value || !value_len));
 
-    do
-    {
-        // if entry unused, fill it and return success
-        if (HASH_EMPTY(hte))
-        {
-            hte->hash = hash;
-            hte->key = key;
-            hte->value = value;
-			hte->tombstone = 0;
+    if (key_len > UINT32_MAX || value_len > UINT32_MAX)
+        return HT_FAIL;
 
-            // if we are not re-hashing increment entries
-            if(ht->table == table)
-                ht->entries++;
+    uint64_t hash = ht_shm_hash(shm, key, key_len);
+    if (!ht_shm_lock(shm))
+        return HT_FAIL;
 
-            return HT_OK;
+    ht_shm_header *hdr = shm->header;
+    ht_shm_slot *free_slot;
+    ht_shm_slot *slot = ht_shm_probe(shm, hash, key, key_len, hdr->heap_top, &free_slot);
+    int result = HT_FAIL;
+
+    // the slot array is fixed, so a full table fails
+    if (slot ? replace : HT_INV_LOAD_FACTOR * (hdr->entries + 1) <= hdr->slots)
+    {
+        ht_shm_write_begin(hdr);
+
+        // too many tombstones, rebuild the slots without them
+        if (!slot && HT_INV_LOAD_FACTOR * (hdr->entries + hdr->deleted + 1) > hdr->slots)
+        {
+            ht_shm_rebuild(shm);
+            ht_shm_probe(shm, hash, key, key_len, hdr->heap_top, &free_slot);
         }
 
-        // if entry is a match, update the value
-        if (HASH_MATCH(hte, hash, key))
+        uint64_t offset = ht_shm_alloc(shm, sizeof(ht_shm_block) + key_len + value_len);
+        if (offset)
         {
-			// if replace is not set, then fail
-            if (!replace)
+            ht_shm_block *block = SHM_BLOCK(shm, offset);
+            block->key_len = (uint32_t)key_len;
+            block->value_len = (uint32_t)value_len;
+            block->version = ++hdr->version;
+            memcpy(SHM_KEY(block), key, key_len);
+            memcpy(SHM_KEY(block) + key_len, value, value_len);
+            block->state = SHM_BLOCK_USED;
+
+            if (slot)
             {
-                // puts("ht_insert_nocheck: key already exists");
-                return HT_FAIL;
+                uint64_t old = slot->offset;
+                SHM_WRITE(slot->offset, offset);
+                ht_shm_free_block(shm, old);
             }
+            else
+            {
+                if (free_slot->offset == SHM_TOMBSTONE)
+                    hdr->deleted--;
 
-            hte->value = value;
-            return HT_OK;
+                SHM_WRITE(free_slot->hash, hash);
+                SHM_WRITE(free_slot->offset, offset);
+                hdr->entries++;
+            }
+
+            result = HT_OK;
         }
 
-        // mark collisions
-        HT_INSERT_COLLIDE(ht);
-        HT_RECENT_INSERT_COLLIDE(ht);
+        ht_shm_write_end(hdr);
+    }
 
-        perturb >>= HT_PERTURB_VALUE;
+    ht_shm_unlock(shm);
+    return result;
+}
 
-#if HT_LINEAR == 1
-        bin = (bin + perturb + 1) & mask;
-#else
-        bin = (5 * bin + perturb + 1) & mask;
+//--------------------------------------
+// copy a key's value out, see ht_shm_find
+//--------------------------------------
+static int ht_shm_read_value(HashShm *shm, uint64_t hash, const void *key, size_t key_len, void *value, size_t *value_len)
+{
+    uint64_t heap_top = SHM_READ(shm->header->heap_top);
+    ht_shm_slot *slot = ht_shm_probe(shm, hash, key, key_len, heap_top, NULL);
+    if (!slot)
+        return HT_FAIL;
+
+    uint32_t klen, vlen;
+    ht_shm_block *block = ht_shm_block_at(shm, SHM_READ(slot->offset), heap_top, &klen, &vlen);
+    if (!block)
+        return HT_FAIL;
+
+    ht_shm_copy(value, value_len, SHM_KEY(block) + klen, vlen);
+    return HT_OK;
+}
 #endif
 
-        hte = &table[bin];
-//#if HT_PERTURB != 1
-        done = bin == start_bin;
-//#endif
-    } while (!done);
+//--------------------------------------
+// insert a key, fails if it exists
+//--------------------------------------
+int ht_shm_insert(HashShm *shm, const void *key, size_t key_len, const void *value, size_t value_len)
+{
+#if HT_USE_SHM == 1
+    return ht_shm_put(shm, key, key_len, value, value_len, HT_ADD_ONLY);
+#else
+    return HT_FAIL;
+#endif
+}
 
-    // if no free slot found, then fail
-    puts("ht_insert_nocheck: no free slot found");
+//--------------------------------------
+// insert or replace a key's value
+//--------------------------------------
+int ht_shm_add(HashShm *shm, const void *key, size_t key_len, const void *value, size_t value_len)
+{
+#if HT_USE_SHM == 1
+    return ht_shm_put(shm, key, key_len, value, value_len, HT_REPLACE);
+#else
     return HT_FAIL;
+#endif
 }
 
 //--------------------------------------
-// attempt to add or update an entry
+// find a key, copying at most *value_len
+// bytes of its value to value and then
+// setting *value_len to the value's full
+// length. Either may be NULL to only
+// test for the key.
+//
+// Lock-free unless writers keep the
+// region busy for HT_SHM_SPINS tries.
 //--------------------------------------
-static int ht_add_or_update(HashTable* ht, ht_key_t key, ht_value_t value, int replace)
+int ht_shm_find(HashShm *shm, const void *key, size_t key_len, void *value, size_t *value_len)
 {
-    CHECK_THAT(ht && ht->table);
-    CHECK_THAT(key);
+#if HT_USE_SHM == 1
+    CHECK_THAT(shm && (key || !key_len));
 
-    // check for load factor and grow table if necessary
-#if HT_AUTO_GROW
-    // load factor of 0.5 to 0.67 is good time to grow
-    if (HT_INV_LOAD_FACTOR * ht->entries >= ht->size)
+    ht_shm_header *hdr = shm->header;
+    uint64_t hash = ht_shm_hash(shm, key, key_len);
+    size_t cap = value_len ? *value_len : 0;
+
+    for (int tries = 0; tries < HT_SHM_SPINS; tries++)
     {
-        if (!ht_grow(ht))
+        uint64_t seq = SHM_SEQ_LOAD(&hdr->seq);
+        if (seq & 1)
         {
-            return HT_FAIL;
+            HT_YIELD();
+            continue;
         }
-    }
-#endif
 
-    ht_hash_t hash = ht->hash_fn(key);
+        if (value_len)
+            *value_len = cap;
 
-    int result = ht_insert_nocheck(ht, ht->table, hash, key, value, ht->size, replace);
-    return result;
-}
+        int found = ht_shm_read_value(shm, hash, key, key_len, value, value_len);
 
-//----------------------------------------
-// insert an entry, fail if already exists
-//----------------------------------------
-int ht_insert(HashTable *ht, ht_key_t key, ht_value_t value)
-{
-	return ht_add_or_update(ht, key, value, HT_ADD_ONLY);
-}
+        HT_FENCE_ACQUIRE();
+        if (SHM_READ(hdr->seq) == seq)
+            return found;
+    }
 
-//--------------------------------------------------
-// attempt to add an entry, update if already exists
-//--------------------------------------------------
-int ht_add(HashTable* ht, ht_key_t key, ht_value_t value)
-{
-	return ht_add_or_update(ht, key, value, HT_REPLACE);
+    // a busy region, or its last writer died mid-change
+    if (!ht_shm_lock(shm))
+        return HT_FAIL;
+
+    if (value_len)
+        *value_len = cap;
+
+    int found = ht_shm_read_value(shm, hash, key, key_len, value, value_len);
+    ht_shm_unlock(shm);
+    return found;
+#else
+    return HT_FAIL;
+#endif
 }
 
 //--------------------------------------
-// attempt to remove entry from table
+// remove a key
 //--------------------------------------
-int ht_remove(HashTable* ht, ht_key_t key)
+int ht_shm_remove(HashShm *shm, const void *key, size_t key_len)
 {
-    CHECK_THAT(ht && ht->table);
+#if HT_USE_SHM == 1
+    CHECK_THAT(shm && (key || !key_len));
 
-    // check for empty table
-    if (ht->entries == 0)
+    uint64_t hash = ht_shm_hash(shm, key, key_len);
+    if (!ht_shm_lock(shm))
         return HT_FAIL;
 
-#if 1
-    ht_hash_t hash = ht->hash_fn(key);
+    ht_shm_header *hdr = shm->header;
+    ht_shm_slot *slot = ht_shm_probe(shm, hash, key, key_len, hdr->heap_top, NULL);
 
-#if HT_PERTURB == 1
-    size_t perturb = hash;
+    if (slot)
+    {
+        ht_shm_write_begin(hdr);
+
+        // free the block first, so a rebuild can't bring the key back
+        ht_shm_free_block(shm, slot->offset);
+        SHM_WRITE(slot->offset, SHM_TOMBSTONE);
+        hdr->entries--;
+        hdr->deleted++;
+
+        ht_shm_write_end(hdr);
+    }
+
+    ht_shm_unlock(shm);
+    return slot ? HT_OK : HT_FAIL;
 #else
-    size_t perturb = 0;
+    return HT_FAIL;
 #endif
+}
 
-    int done = 0;
+//--------------------------------------
+// iterate over entries, copying keys and
+// values out as ht_shm_find does
+//
+// NB: holds the lock for each step
+//--------------------------------------
+int ht_shm_next(HashShm *shm, size_t *ipos, void *key, size_t *key_len, void *value, size_t *value_len)
+{
+#if HT_USE_SHM == 1
+    CHECK_THAT(shm && ipos);
 
-    size_t start_bin = (size_t)hash & ht->mask;
-    size_t bin = start_bin;
-    HashTable_Entry* hte = &ht->table[start_bin];
+    if (!ht_shm_lock(shm))
+        return HT_FAIL;
 
-    do
+    ht_shm_header *hdr = shm->header;
+    ht_shm_slot *slots = SHM_SLOTS(shm);
+    int result = HT_FAIL;
+
+    for (; *ipos < hdr->slots; (*ipos)++)
     {
-        if (HASH_MATCH(hte, hash, key))
+        if (slots[*ipos].offset > SHM_TOMBSTONE)
         {
-            hte->hash = 0;
-            hte->tombstone = 1;
-            hte->key = 0;
-            hte->value = 0;
-            ht->entries--;
-            return HT_OK;
-        }
-        HT_SEARCH_COLLIDE(ht);
+            ht_shm_block *block = SHM_BLOCK(shm, slots[*ipos].offset);
+            ht_shm_copy(key, key_len, SHM_KEY(block), block->key_len);
+            ht_shm_copy(value, value_len, SHM_KEY(block) + block->key_len, block->value_len);
 
-        perturb >>= HT_PERTURB_VALUE;
+            (*ipos)++;
+            result = HT_OK;
+            break;
+        }
+    }
 
-#if HT_LINEAR == 1
-        bin = (bin + perturb + 1) & ht->mask;
+    ht_shm_unlock(shm);
+    return result;
 #else
-        bin = (5 * bin + perturb + 1) & ht->mask;
+    return HT_FAIL;
 #endif
-        hte = &ht->table[bin];
+}
 
-//#if HT_PERTURB != 1
-        done = bin == start_bin;
-//#endif
+//--------------------------------------
+// number of entries in the region
+//--------------------------------------
+size_t ht_shm_size(HashShm *shm)
+{
+#if HT_USE_SHM == 1
+    CHECK_THAT(shm);
+    return (size_t)SHM_READ(shm->header->entries);
+#else
+    return 0;
+#endif
+}
 
-    } while (!done);
+//--------------------------------------
+// rebuild the slots and free lists from
+// the heap
+//
+// Writers that die mid-change are
+// repaired by the next locker where
+// robust locks are supported (Linux).
+// This is for a supervisor to run after
+// a crash anyway, and also drops
+// tombstones.
+//--------------------------------------
+int ht_shm_recover(HashShm *shm)
+{
+#if HT_USE_SHM == 1
+    CHECK_THAT(shm);
 
-#else
-    // look for key in table and if found, remove
-    HashTable_Entry *hte = ht->table;
-    for (size_t i = 0; i < ht->size; i++)
-    {
-        // if found, mark entry as empty
-        if (hte->key && ht->compare_fn(hte->key, key))
-        {
-			assert(hte->tombstone == 0);
+    if (!ht_shm_lock(shm))
+        return HT_FAIL;
 
-            hte->hash = 0;
-			hte->tombstone = 1;
-            hte->key = 0;
-            hte->value = 0;
-            ht->entries--;
-            return HT_OK;
-        }
-        hte++;
-    }
-#endif
+    ht_shm_header *hdr = shm->header;
+    ht_shm_write_begin(hdr);
+    ht_shm_rebuild(shm);
+    ht_shm_write_end(hdr);
 
-    // if not found, return failure
+    ht_shm_unlock(shm);
+    return HT_OK;
+#else
     return HT_FAIL;
+#endif
 }
 
 //--------------------------------------
-// return current size
+// hash function quality analysis
 //--------------------------------------
-size_t ht_size(HashTable *ht)
+
+//--------------------------------------
+// sort hashes to count full collisions
+//--------------------------------------
+static int ht_compare_hashes(const void *a, const void *b)
 {
-    CHECK_THAT(ht && ht->table);
-    return (ht && ht->table) ? ht->entries : 0;
+    ht_hash_t x = *(const ht_hash_t*)a, y = *(const ht_hash_t*)b;
+    return x < y ? -1 : x > y;
 }
 
 //--------------------------------------
-// return table capacity
+// x^n by squaring, keeps libm out of
+// the library
 //--------------------------------------
-size_t ht_capacity(HashTable *ht)
+static double ht_pow(double x, size_t n)
 {
-    CHECK_THAT(ht && ht->table);
-    return (ht && ht->table) ? ht->size : 0;
+    double result = 1.0;
+
+    for (; n; n >>= 1, x *= x)
+    {
+        if (n & 1)
+            result *= x;
+    }
+
+    return result;
 }
 
 //--------------------------------------
-// attempt to resize the table
+// -ln(1 - x) as a series for 0 <= x < 1
 //--------------------------------------
-static HashTable* ht_resize(HashTable* ht, size_t new_size)
+static double ht_neg_log1m(double x)
 {
-    CHECK_THAT(ht && ht->table);
+    double term = x, sum = 0;
 
-    // alloc new table
-    size_t new_table_size = sizeof(HashTable_Entry) * new_size;
-    HashTable_Entry* new_table = HT_ALLOC(new_table_size);
-    if (!new_table)
+    for (int k = 1; k < 1000 && term > 1e-12; k++, term *= x)
     {
-        return NULL;
+        sum += term / k;
     }
 
-    HT_ALLOC_INC;
-    memset(new_table, 0, new_table_size);
+    return sum;
+}
 
-    // re-insert existing items into new table
-    HashTable_Entry* hte;
-    for (size_t i = 0; i < ht->size; i++)
+//--------------------------------------
+// place hashes in a table of the given
+// size the way inserts would, measuring
+// home slot spread and probe lengths
+//--------------------------------------
+static int ht_analyze_load(const ht_hash_t *hashes, size_t count, size_t size, ht_hash_load *load)
+{
+    uint32_t *homes = HT_ALLOC(size * sizeof(uint32_t));
+    unsigned char *used = HT_ALLOC(size);
+    if (!homes || !used)
     {
-        hte = &ht->table[i];
+        HT_FREE(homes);
+        HT_FREE(used);
+        return HT_FAIL;
+    }
 
-        // if entry is not empty, re-hash into new table
-        if (!HASH_EMPTY(hte))
+    memset(homes, 0, size * sizeof(uint32_t));
+    memset(used, 0, size);
+
+    size_t mask = size - 1, total_probes = 0;
+
+    memset(load, 0, sizeof(ht_hash_load));
+    load->table_size = size;
+    load->load = (double)count / size;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t bin = (size_t)hashes[i] & mask;
+        homes[bin]++;
+
+#if HT_PERTURB == 1
+        size_t perturb = hashes[i];
+#else
+        size_t perturb = 0;
+#endif
+
+        // same probe sequence as ht_probe, a find later retraces it
+        size_t probes = 1;
+        while (used[bin])
         {
-            if (HT_FAIL == ht_insert_nocheck(ht, new_table, hte->hash, hte->key, hte->value, new_size, HT_ADD_ONLY))
-            {
-                HT_FREE(new_table);
-                HT_FREE_INC;
-                return NULL;
-            }
+            perturb >>= HT_PERTURB_VALUE;
+#if HT_LINEAR == 1
+            bin = (bin + perturb + 1) & mask;
+#else
+            bin = (5 * bin + perturb + 1) & mask;
+#endif
+            probes++;
         }
+
+        used[bin] = 1;
+        total_probes += probes;
+        if (probes > load->max_probes)
+            load->max_probes = probes;
     }
 
-    // free old table
-    if (ht->table != ht->small_table)
+    // occupancy of home slots against a uniform hash
+    double expected = (double)count / size, chi_square = 0;
+    for (size_t i = 0; i < size; i++)
     {
-        HT_FREE(ht->table);
-        HT_FREE_INC;
-    }
+        if (homes[i])
+            load->used_slots++;
 
-    // update hash table state
-    ht->table = new_table;
-    ht->size = new_size;
-    ht->mask = new_size - 1;
+        if (homes[i] > load->max_home)
+            load->max_home = homes[i];
 
-    // clear recent collisions
-#if HT_TRACK_STATS == 1
-    ht->recent_insert_collisions = 0;
-#endif
+        chi_square += (homes[i] - expected) * (homes[i] - expected) / expected;
+    }
 
-    return ht;
+    load->ideal_used_slots = size * (1.0 - ht_pow(1.0 - 1.0 / size, count));
+    load->chi_square = chi_square / size;
+    load->avg_probes = (double)total_probes / count;
+    load->ideal_probes = ht_neg_log1m(load->load) / load->load;
+
+    HT_FREE(homes);
+    HT_FREE(used);
+    return HT_OK;
 }
 
 //--------------------------------------
-// attempt to grow the table
+// hash a string key's bytes, or the key
+// pointer they hold
 //--------------------------------------
-HashTable *ht_grow(HashTable *ht)
+static ht_hash_t ht_hash_key_bytes(ht_hash_func hash_fn, const unsigned char *bytes, int is_string)
 {
-    CHECK_THAT(ht && ht->table);
+    ht_key_t key = bytes;
+    if (!is_string)
+        memcpy(&key, bytes, sizeof(ht_key_t));
 
-    // increase (double) table size
-    size_t new_size = ht->size << 1;
-
-    return ht_resize(ht, new_size);
+    return hash_fn(key);
 }
 
 //--------------------------------------
-// try to shrink the table
+// add how often each hash bit flips with
+// one key bit, returning the trials
 //--------------------------------------
-HashTable* ht_shrink(HashTable* ht)
+static size_t ht_avalanche_key(ht_hash_func hash_fn, unsigned char *bytes, size_t len, int is_string, size_t *flips)
 {
-    CHECK_THAT(ht && ht->table);
+    ht_hash_t hash = ht_hash_key_bytes(hash_fn, bytes, is_string);
+    size_t trials = 0;
 
-	// decrease (half) table size
-	size_t new_size = ht->size >> 1;
+    for (size_t i = 0; i < len; i++)
+    {
+        for (int bit = 0; bit < 8; bit++)
+        {
+            bytes[i] ^= (unsigned char)(1 << bit);
 
-    // make sure smaller size is large enough
-    if ((ht->entries << 1) > new_size)
-        return NULL;
+            // a NUL would shorten a string key
+            if (bytes[i] || !is_string)
+            {
+                ht_hash_t diff = ht_hash_key_bytes(hash_fn, bytes, is_string) ^ hash;
+                for (int b = 0; b < (int)(sizeof(ht_hash_t) * 8); b++)
+                {
+                    flips[b] += (diff >> b) & 1;
+                }
+                trials++;
+            }
 
-    return ht_resize(ht, new_size);
+            bytes[i] ^= (unsigned char)(1 << bit);
+        }
+    }
+
+    return trials;
 }
 
 //--------------------------------------
-// print some useful debug stats
+// flip each bit of sampled keys and find
+// the low hash bit whose flip rate is
+// furthest from a coin toss
 //--------------------------------------
-void ht_debug_stats()
+static int ht_analyze_avalanche(ht_hash_func hash_fn, const ht_key_t *keys, size_t count, int key_kind, ht_hash_report *report)
 {
-#if HT_DEBUG_STATS == 1
-    printf("All tables -> allocs: %zu, frees: %zu, resuse: %zu, freelist: %d\n", allocs, frees, resuse, ht_free_count);
-#endif
+    size_t flips[sizeof(ht_hash_t) * 8] = { 0 };
+    size_t step = count > HT_ANALYZE_AVALANCHE_KEYS ? count / HT_ANALYZE_AVALANCHE_KEYS : 1;
+    size_t longest = sizeof(ht_key_t);
+
+    // string keys are flipped in a copy
+    for (size_t k = 0; key_kind == HT_ANALYZE_STRINGS && k < count; k += step)
+    {
+        size_t len = strlen(keys[k]) + 1;
+        if (len > longest)
+            longest = len;
+    }
+
+    unsigned char *bytes = HT_ALLOC(longest);
+    if (!bytes)
+        return HT_FAIL;
+
+    for (size_t k = 0; k < count; k += step)
+    {
+        if (key_kind == HT_ANALYZE_STRINGS)
+        {
+            size_t len = strlen(keys[k]);
+            memcpy(bytes, keys[k], len + 1);
+            report->avalanche_trials += ht_avalanche_key(hash_fn, bytes, len, 1, flips);
+        }
+        else
+        {
+            memcpy(bytes, &keys[k], sizeof(ht_key_t));
+            report->avalanche_trials += ht_avalanche_key(hash_fn, bytes, sizeof(ht_key_t), 0, flips);
+        }
+    }
+
+    for (int b = 0; b < report->mask_bits && report->avalanche_trials; b++)
+    {
+        double bias = (double)flips[b] / report->avalanche_trials - 0.5;
+        if (bias < 0)
+            bias = -bias;
+
+        if (bias > report->worst_avalanche_bias)
+            report->worst_avalanche_bias = bias;
+    }
+
+    HT_FREE(bytes);
+    return HT_OK;
 }
 
 //--------------------------------------
-// print some useful table stats
+// analyze a hash function over sample
+// keys at the size the table would grow
+// to for them and at larger sizes
 //--------------------------------------
-void ht_stats(HashTable* ht)
+int ht_hash_analyze(ht_hash_func hash_fn, const ht_key_t *keys, size_t count, int key_kind, ht_hash_report *report)
 {
-    if (!ht || !ht->table)
-        return;
+    CHECK_THAT(keys && count && report);
+    CHECK_THAT(key_kind == HT_ANALYZE_POINTERS || key_kind == HT_ANALYZE_STRINGS);
 
-#if HT_TRACK_STATS == 1
-    printf("This table -> entries: %zu, size: %zu, insert collides: %zu, recent insert collides: %zu, search collides: %zu\n", ht->entries, ht->size, ht->insert_collisions, ht->recent_insert_collisions, ht->search_collisions);
-#endif
+    hash_fn = ht_resolve_hash(hash_fn);
+    memset(report, 0, sizeof(ht_hash_report));
+    report->keys = count;
+
+    ht_hash_t *hashes = HT_ALLOC(count * sizeof(ht_hash_t));
+    if (!hashes)
+        return HT_FAIL;
+
+    // time a few passes, keeping the results of the last
+    uint64_t start = ht_now_ns();
+    for (int pass = 0; pass < HT_ANALYZE_PASSES; pass++)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            hashes[i] = hash_fn(keys[i]);
+        }
+    }
+    report->ns_per_hash = (double)(ht_now_ns() - start) / ((double)count * HT_ANALYZE_PASSES);
+
+    // bias of each hash bit away from a coin flip
+    size_t bits[sizeof(ht_hash_t) * 8] = { 0 };
+    for (size_t i = 0; i < count; i++)
+    {
+        for (int b = 0; b < (int)(sizeof(ht_hash_t) * 8); b++)
+        {
+            bits[b] += (hashes[i] >> b) & 1;
+        }
+    }
+
+    // the smallest table ht_insert would use, then larger ones
+    size_t size = HT_DEFAULT_TABLE_SIZE;
+    while (HT_INV_LOAD_FACTOR * count >= size)
+    {
+        size <<= 1;
+    }
+
+    // bits the largest analyzed table masks with
+    report->mask_bits = 0;
+    while (((size_t)1 << report->mask_bits) < (size << (HT_ANALYZE_SIZES - 1)))
+    {
+        report->mask_bits++;
+    }
+
+    for (int b = 0; b < (int)(sizeof(ht_hash_t) * 8); b++)
+    {
+        double bias = (double)bits[b] / count - 0.5;
+        if (bias < 0)
+            bias = -bias;
+
+        if (bias > report->worst_bit_bias)
+        {
+            report->worst_bit_bias = bias;
+            report->worst_bit = b;
+        }
+
+        if (b < report->mask_bits && bias > report->worst_mask_bit_bias)
+        {
+            report->worst_mask_bit_bias = bias;
+        }
+    }
+
+    int result = ht_analyze_avalanche(hash_fn, keys, count, key_kind, report);
+    for (int i = 0; i < HT_ANALYZE_SIZES && result; i++, size <<= 1)
+    {
+        result = ht_analyze_load(hashes, count, size, &report->loads[i]);
+    }
+
+    qsort(hashes, count, sizeof(ht_hash_t), ht_compare_hashes);
+    for (size_t i = 1; i < count; i++)
+    {
+        report->duplicate_hashes += hashes[i] == hashes[i - 1];
+    }
+
+    HT_FREE(hashes);
+    return result;
 }
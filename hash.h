@@ -7,16 +7,84 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #define HT_FAIL 0
 #define HT_OK   1
 
 #define HT_HASH_NULL    (ht_hash_func)0
 #define HT_HASH_STRING  (ht_hash_func)1
+#define HT_HASH_SIPHASH (ht_hash_func)2     // SipHash-1-3 of a C string, for keys from untrusted input
+
+// NUMA placement policies for large backing tables
+#define HT_NUMA_DEFAULT     0   // inherit the process policy
+#define HT_NUMA_LOCAL       1   // place pages on the faulting thread's node
+#define HT_NUMA_INTERLEAVE  2   // interleave pages across all allowed nodes
+
+// operations recorded in traces
+#define HT_OP_INSERT    1
+#define HT_OP_ADD       2
+#define HT_OP_FIND      3
+#define HT_OP_REMOVE    4
+#define HT_OP_NEXT      5
+#define HT_OP_UPSERT    6
+
+// table layouts, see ht_set_mode
+#define HT_MODE_PROBE   0   // open addressing
+#define HT_MODE_CUCKOO  1   // bucketized cuckoo, lookups touch at most two buckets
+
+// ht_merge policies for keys in both tables
+#define HT_MERGE_KEEP       0   // keep the destination's value
+#define HT_MERGE_REPLACE    1   // take the source's value
+
+// key kinds for ht_hash_analyze's avalanche test
+#define HT_ANALYZE_POINTERS 0   // flip bits of the key pointer, the hasher must not dereference it
+#define HT_ANALYZE_STRINGS  1   // flip bits of NUL-terminated key bytes
+
+// table events passed to ht_event_func
+#define HT_EVENT_RESIZE_START   1   // old_size -> new_size
+#define HT_EVENT_RESIZE_END     2   // old_size -> new_size, duration_ns
+#define HT_EVENT_LONG_PROBE     3   // probes
+#define HT_EVENT_ALLOC_FAIL     4   // new_size is the failed request in bytes
+#define HT_EVENT_SHRINK         5   // old_size -> new_size
+#define HT_EVENT_TABLE_FULL     6   // insert found no free slot
+#define HT_EVENT_RESEED         7   // probes, a long insert probe changed the seed
 
 // configuration
 #define HT_TRACK_STATS 1
 
+// compile in support for recording operation traces
+#ifndef HT_TRACE
+    #define HT_TRACE 1
+#endif
+
+// compile in event hooks
+#ifndef HT_EVENTS
+    #define HT_EVENTS 1
+#endif
+
+// also fire USDT tracepoints for events (needs <sys/sdt.h>)
+#ifndef HT_USDT
+    #define HT_USDT 0
+#endif
+
+// seed built-in hashers per table from a random process secret, 0 for
+// reproducible layouts
+#ifndef HT_HASH_SEED
+    #define HT_HASH_SEED 1
+#endif
+
+// insert probe length that reseeds and rehashes a table using a built-in
+// hasher, 0 to never reseed
+#ifndef HT_RESEED_PROBES
+    #define HT_RESEED_PROBES 64
+#endif
+
+// default probe length reported as HT_EVENT_LONG_PROBE
+#ifndef HT_LONG_PROBE
+    #define HT_LONG_PROBE 64
+#endif
+
 #ifndef HT_ALLOC
     #define HT_ALLOC malloc
 #endif
@@ -25,10 +93,24 @@
     #define HT_FREE free
 #endif
 
+#ifndef HT_REALLOC
+    #define HT_REALLOC realloc
+#endif
+
+#ifndef HT_ARENA_BLOCK_SIZE
+    #define HT_ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+
 #ifndef HT_DEFAULT_TABLE_SIZE
     #define HT_DEFAULT_TABLE_SIZE 8
 #endif
 
+// tables stay in the packed tiny layout up to this many entries
+// NB: must be a power of 2, at least 2 and less than 32
+#ifndef HT_TINY_SIZE
+    #define HT_TINY_SIZE HT_DEFAULT_TABLE_SIZE
+#endif
+
 #ifndef HT_PERTURB_VALUE
     #define HT_PERTURB_VALUE 5
 #endif
@@ -37,6 +119,106 @@
     #define HT_INV_LOAD_FACTOR 2
 #endif
 
+// slots per cuckoo bucket, two 32-byte entries fill one cache line
+// NB: must be a power of 2
+#ifndef HT_CUCKOO_SLOTS
+    #define HT_CUCKOO_SLOTS 2
+#endif
+
+// cuckoo slots kept for keys no displacement path could place
+// NB: must be a multiple of HT_CUCKOO_SLOTS
+#ifndef HT_CUCKOO_STASH
+    #define HT_CUCKOO_STASH 4
+#endif
+
+// cuckoo tables grow at this load, in percent
+// two-slot buckets fill to about 89% at best
+#ifndef HT_CUCKOO_LOAD
+    #if HT_CUCKOO_SLOTS >= 4
+        #define HT_CUCKOO_LOAD 95
+    #else
+        #define HT_CUCKOO_LOAD 85
+    #endif
+#endif
+
+// buckets searched for a displacement path before a cuckoo table grows
+#ifndef HT_CUCKOO_SEARCH
+    #define HT_CUCKOO_SEARCH 256
+#endif
+
+// bloom filter bits per table slot, see ht_set_bloom
+#ifndef HT_BLOOM_BITS
+    #define HT_BLOOM_BITS 8
+#endif
+
+// keys hashed and prefetched together by ht_find_many
+#ifndef HT_FIND_BATCH
+    #define HT_FIND_BATCH 16
+#endif
+
+// slots per copy-on-write page shared with snapshots, see ht_snapshot
+#ifndef HT_SNAPSHOT_PAGE
+    #define HT_SNAPSHOT_PAGE 128
+#endif
+
+// tables in shared memory, see ht_shm_create (where supported)
+#ifndef HT_SHM
+    #define HT_SHM 1
+#endif
+
+// lock-free reads of a shared memory table retried before taking its lock
+#ifndef HT_SHM_SPINS
+    #define HT_SHM_SPINS 64
+#endif
+
+// slots in a counter map's first segment, each later one has four times
+// the slots of the one before
+// NB: must be a power of 2
+#ifndef HT_COUNTER_SIZE
+    #define HT_COUNTER_SIZE 64
+#endif
+
+// most segments a counter map grows to
+#ifndef HT_COUNTER_SEGMENTS
+    #define HT_COUNTER_SEGMENTS 24
+#endif
+
+// slots in a per-thread counter buffer, and the adds it takes before it
+// flushes itself
+// NB: must be a power of 2
+#ifndef HT_COUNTER_BUFFER
+    #define HT_COUNTER_BUFFER 64
+#endif
+
+#ifndef HT_COUNTER_FLUSH
+    #define HT_COUNTER_FLUSH 1024
+#endif
+
+// table sizes reported by ht_hash_analyze
+#ifndef HT_ANALYZE_SIZES
+    #define HT_ANALYZE_SIZES 4
+#endif
+
+// timed hashing passes in ht_hash_analyze
+#ifndef HT_ANALYZE_PASSES
+    #define HT_ANALYZE_PASSES 4
+#endif
+
+// keys sampled for ht_hash_analyze's avalanche test
+#ifndef HT_ANALYZE_AVALANCHE_KEYS
+    #define HT_ANALYZE_AVALANCHE_KEYS 10000
+#endif
+
+// back large tables with huge-page aligned mmap storage (where supported)
+#ifndef HT_LARGE_PAGES
+    #define HT_LARGE_PAGES 1
+#endif
+
+// backing arrays of at least this many bytes use large page storage
+#ifndef HT_LARGE_TABLE_BYTES
+    #define HT_LARGE_TABLE_BYTES (2 * 1024 * 1024)
+#endif
+
 //--------------------------------------
 // define hash, key and value types
 //--------------------------------------
@@ -50,22 +232,147 @@ typedef const void* ht_value_t;
 
 // hash and comparison functions
 typedef ht_hash_t (*ht_hash_func)(ht_key_t key);
+typedef ht_hash_t (*ht_keyed_hash_func)(ht_key_t key, const uint64_t seed[2]);
 typedef int (*ht_compare_func)(ht_key_t a, ht_key_t b);
 
+// computes a key's new value, old is NULL when the key was not present
+typedef ht_value_t (*ht_upsert_func)(ht_key_t key, ht_value_t old, int exists, void *ctx);
+
+// selects entries for ht_remove_if, non-zero to remove
+typedef int (*ht_predicate_func)(ht_key_t key, ht_value_t value, void *ctx);
+
+// called with each entry a cache evicts
+typedef void (*ht_evict_func)(ht_key_t key, ht_value_t value, void *ctx);
+
+//--------------------------------------
+// per-table allocator
+//--------------------------------------
+// Sizes are passed back to realloc/free so simple allocators need no
+// headers. The allocator must outlive every table created with it.
+typedef struct ht_allocator
+{
+    void *(*alloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} ht_allocator;
+
+//--------------------------------------
+// bump allocator, freed all at once
+//--------------------------------------
+typedef struct ht_arena_block ht_arena_block;
+
+typedef struct ht_arena
+{
+    ht_allocator allocator;
+    ht_arena_block *blocks;
+    size_t block_size;
+    size_t used;            // bytes used in the current (first) block
+    void *last;             // most recent allocation, can grow in place
+} ht_arena;
+
+//--------------------------------------
+// operation trace record
+//--------------------------------------
+// Keys are never written to a trace, only their hash, length and id. The key
+// length is strlen() for tables using HT_HASH_STRING, else the pointer size.
+// The id is a 64 bit fingerprint of the key bytes (string tables) or the key
+// pointer (others) under a per-trace secret, so it stays the same across a
+// reseed and tells apart keys whose hashes collide.
+typedef struct ht_trace_record
+{
+    uint64_t hash;
+    uint64_t key_id;
+    uint32_t key_len;
+    uint16_t table_id;
+    uint8_t op;             // HT_OP_xxx
+    uint8_t result;         // HT_OK/HT_FAIL, or 1 if an upsert inserted
+} ht_trace_record;
+
+typedef struct ht_tracer ht_tracer;
+
+//--------------------------------------
+// shared memory table
+//--------------------------------------
+// Keys and values are byte strings copied into a region several processes
+// map, so no pointers are stored. Each process has its own handle.
+typedef struct HashShm HashShm;
+
+//--------------------------------------
+// table event
+//--------------------------------------
+typedef struct ht_event
+{
+    int type;               // HT_EVENT_xxx
+    size_t old_size;
+    size_t new_size;
+    size_t probes;
+    uint64_t duration_ns;
+} ht_event;
+
+struct HashTable;
+typedef void (*ht_event_func)(struct HashTable *ht, const ht_event *event, void *ctx);
+
 //--------------------------------------
 // table entry structure
 //--------------------------------------
 typedef struct HashTable_Entry
 {
     ht_hash_t hash;
-    int tombstone;
+    uint16_t tombstone;
+    uint16_t referenced;    // CLOCK reference bit for caches
+    uint32_t generation;    // live only if equal to the table's, fills padding on 64-bit
     ht_key_t key;
     ht_value_t value;
 } HashTable_Entry;
 
+//--------------------------------------
+// table state only some tables need
+//--------------------------------------
+// Allocated by the first feature that needs it, so plain tables stay small.
+// A table without one hashes with the process secret, like sets do.
+typedef struct HashTable_Ext
+{
+    ht_keyed_hash_func keyed_fn;        // built-in hasher using seed, else NULL
+    uint64_t seed[2];
+    size_t reseed_credit;   // inserts since the last reseed
+    size_t reseeds;
+    size_t table_bytes;     // mapped length if table is large page storage, else 0
+    int numa_policy;
+
+    int use_bloom;
+    uint64_t *bloom;        // cache line aligned blocks, NULL if no filter
+    void *bloom_mem;
+    size_t bloom_mask;      // block count - 1
+
+    size_t cache_capacity;  // 0 unless created by ht_cache_create
+    size_t cache_hand;      // CLOCK position
+    ht_evict_func evict_fn;
+    void *evict_ctx;
+
+    struct ht_snapshot *snapshot;       // set if this is a read-only snapshot view
+    struct ht_snapshot *snapshots;      // views still sharing this table's pages
+    struct ht_shared_table *shared;     // slot array as seen by those views
+    uint64_t *cow_copied;               // pages already copied to every view
+
+#if HT_TRACE == 1
+    ht_tracer *tracer;
+    uint16_t trace_id;
+#endif
+
+#if HT_EVENTS == 1
+    ht_event_func event_fn;
+    void *event_ctx;
+    size_t long_probe;
+#endif
+} HashTable_Ext;
+
 //--------------------------------------
 //
 //--------------------------------------
+// Small tables have no slot array (table is NULL). Their hashes, keys and
+// values live in one packed allocation, made on first insert and searched
+// linearly, until the table outgrows HT_TINY_SIZE entries.
 typedef struct HashTable
 {
     HashTable_Entry *table;
@@ -74,32 +381,191 @@ typedef struct HashTable
     size_t entries;
     ht_hash_func hash_fn;
     ht_compare_func compare_fn;
+    const ht_allocator *allocator;
+    ht_hash_t *tiny;        // packed hashes[cap], keys[cap], values[cap]
+    size_t deleted;         // tombstones
+    HashTable_Ext *ext;     // NULL until a feature needs it
+    uint32_t generation;    // see ht_clear_lazy
+    uint16_t tiny_capacity;
+    uint8_t mode;           // HT_MODE_xxx
+    uint8_t stashed;        // entries in a cuckoo table's stash
 
 #if HT_TRACK_STATS == 1
     size_t insert_collisions;
     size_t search_collisions;
     size_t recent_insert_collisions;
 #endif
-    HashTable_Entry small_table[HT_DEFAULT_TABLE_SIZE];
 } HashTable;
 
+// hash set slots hold no value
+typedef struct HashSet_Entry
+{
+    ht_hash_t hash;
+    ht_key_t key;           // NULL if unused
+} HashSet_Entry;
+
+typedef struct HashSet
+{
+    HashSet_Entry *table;
+    size_t mask;
+    size_t size;
+    size_t entries;
+    size_t deleted;         // tombstones
+    ht_hash_func hash_fn;
+    ht_compare_func compare_fn;
+    const ht_allocator *allocator;
+} HashSet;
+
+// counter map slots hold their count inline, first so it is 8-byte aligned
+typedef struct HashCounter_Entry
+{
+    int64_t value;
+    ht_hash_t hash;
+    ht_key_t key;           // NULL if unused, set last
+} HashCounter_Entry;
+
+typedef struct HashCounter_Segment
+{
+    size_t size;
+    size_t mask;
+    size_t entries;
+    HashCounter_Entry *table;
+} HashCounter_Segment;
+
+// Keys never move once added, so counts can be added without locking while
+// the map grows. Growth adds a segment rather than resizing.
+typedef struct HashCounter
+{
+    HashCounter_Segment *segments[HT_COUNTER_SEGMENTS];
+    long segment_count;
+    long lock;              // held to add keys
+    int64_t entries;
+    ht_hash_func hash_fn;
+    ht_compare_func compare_fn;
+} HashCounter;
+
+// per-thread deltas, see ht_counter_buffer_create
+typedef struct ht_counter_buffer ht_counter_buffer;
+
+// placement of sample keys at one table size
+typedef struct ht_hash_load
+{
+    size_t table_size;
+    double load;
+    size_t used_slots;          // distinct home slots
+    double ideal_used_slots;    // expected for a uniform hash
+    size_t max_home;            // most keys sharing one home slot
+    double chi_square;          // home slot counts against uniform, ~1.0 ideal
+    double avg_probes;          // slots read per successful find
+    double ideal_probes;        // the same for uniform random probing
+    size_t max_probes;
+} ht_hash_load;
+
+// hash function quality, see ht_hash_analyze
+typedef struct ht_hash_report
+{
+    size_t keys;
+    size_t duplicate_hashes;    // keys whose full hash repeats another's
+    double worst_bit_bias;      // largest |P(bit set) - 0.5|
+    int worst_bit;
+    int mask_bits;              // low bits used by the largest table analyzed
+    double worst_mask_bit_bias; // largest bias among those
+    double worst_avalanche_bias;    // largest |P(bit flips) - 0.5| among those per flipped key bit
+    size_t avalanche_trials;        // key bit flips tried
+    double ns_per_hash;
+    ht_hash_load loads[HT_ANALYZE_SIZES];
+} ht_hash_report;
+
 //--------------------------------------
 //
 //--------------------------------------
 HashTable *ht_create();
+HashTable *ht_create_with_allocator(const ht_allocator *allocator);
 int ht_free(HashTable *ht);
 ht_value_t ht_find(HashTable *ht, ht_key_t key);
+size_t ht_find_many(HashTable *ht, const ht_key_t *keys, ht_value_t *values, size_t count);
 int ht_insert(HashTable *ht, ht_key_t key, ht_value_t value);
 int ht_add(HashTable* ht, ht_key_t key, ht_value_t value);
+ht_value_t *ht_find_or_insert(HashTable* ht, ht_key_t key, int *inserted);
+int ht_upsert(HashTable* ht, ht_key_t key, ht_upsert_func upsert_fn, void *ctx);
 size_t ht_size(HashTable *ht);
 size_t ht_capacity(HashTable *ht);
 HashTable *ht_grow(HashTable *ht);
 HashTable *ht_shrink(HashTable *ht);
+int ht_clear(HashTable *ht);
+int ht_clear_lazy(HashTable *ht);
+HashTable *ht_cache_create(size_t capacity, ht_evict_func evict_fn, void *ctx);
+ht_value_t ht_cache_get(HashTable *ht, ht_key_t key);
+int ht_cache_put(HashTable *ht, ht_key_t key, ht_value_t value);
+HashTable *ht_clone(HashTable *ht);
+int ht_merge(HashTable *dst, HashTable *src, int policy);
+HashTable *ht_snapshot(HashTable *ht);
+int ht_snapshot_free(HashTable *snapshot);
 int ht_next(HashTable* ht, size_t *ipos, ht_key_t*pkey, ht_value_t *pvalue);
+size_t ht_next_batch(HashTable* ht, size_t *ipos, ht_key_t *keys, ht_value_t *values, size_t n);
 void ht_finished();
 int ht_remove(HashTable* ht, ht_key_t key);
+int ht_remove_at(HashTable* ht, size_t *ipos);
+size_t ht_remove_if(HashTable* ht, ht_predicate_func pred_fn, void *ctx);
 int ht_set_hash_func(HashTable* ht, ht_hash_func hash_fn);
+int ht_set_seed(HashTable* ht, uint64_t seed0, uint64_t seed1);
+ht_hash_t ht_hash(HashTable *ht, ht_key_t key);
 int ht_set_compare_func(HashTable* ht, ht_compare_func compare_fn);
+int ht_set_numa_policy(HashTable* ht, int policy);
+int ht_set_mode(HashTable* ht, int mode);
+int ht_set_bloom(HashTable* ht, int enable);
+int ht_set_event_func(HashTable* ht, ht_event_func event_fn, void *ctx, size_t long_probe);
+
+void ht_arena_init(ht_arena *arena, size_t block_size);
+const ht_allocator *ht_arena_allocator(ht_arena *arena);
+void ht_arena_reset(ht_arena *arena);
+void ht_arena_destroy(ht_arena *arena);
+
+ht_tracer *ht_trace_open(FILE *fp);
+int ht_trace_attach(HashTable *ht, ht_tracer *tracer);
+int ht_trace_close(ht_tracer *tracer);
+int ht_trace_read_header(FILE *fp);
+int ht_trace_read(FILE *fp, ht_trace_record *record);
+
+HashSet *ht_set_create(ht_hash_func hash_fn, ht_compare_func compare_fn);
+HashSet *ht_set_create_with_allocator(ht_hash_func hash_fn, ht_compare_func compare_fn, const ht_allocator *allocator);
+int ht_set_free(HashSet *set);
+int ht_set_add(HashSet *set, ht_key_t key);
+int ht_set_contains(HashSet *set, ht_key_t key);
+int ht_set_remove(HashSet *set, ht_key_t key);
+int ht_set_next(HashSet *set, size_t *ipos, ht_key_t *pkey);
+size_t ht_set_size(HashSet *set);
+int ht_set_union(HashSet *dst, HashSet *src);
+int ht_set_intersect(HashSet *dst, HashSet *src);
+int ht_set_difference(HashSet *dst, HashSet *src);
+
+HashCounter *ht_counter_create(ht_hash_func hash_fn, ht_compare_func compare_fn);
+int ht_counter_free(HashCounter *map);
+int ht_counter_add(HashCounter *map, ht_key_t key, int64_t delta);
+int ht_counter_get(HashCounter *map, ht_key_t key, int64_t *pvalue);
+size_t ht_counter_size(HashCounter *map);
+size_t ht_counter_snapshot(HashCounter *map, size_t *ipos, ht_key_t *keys, int64_t *values, size_t n);
+size_t ht_counter_drain(HashCounter *map, size_t *ipos, ht_key_t *keys, int64_t *values, size_t n);
+ht_counter_buffer *ht_counter_buffer_create(HashCounter *map);
+int ht_counter_buffer_add(ht_counter_buffer *buffer, ht_key_t key, int64_t delta);
+int ht_counter_flush(ht_counter_buffer *buffer);
+int ht_counter_buffer_free(ht_counter_buffer *buffer);
+
+HashShm *ht_shm_create(const char *name, size_t capacity, size_t heap_bytes);
+HashShm *ht_shm_open(const char *name);
+HashShm *ht_shm_open_fd(int fd);
+int ht_shm_fd(HashShm *shm);
+int ht_shm_close(HashShm *shm);
+int ht_shm_unlink(const char *name);
+int ht_shm_insert(HashShm *shm, const void *key, size_t key_len, const void *value, size_t value_len);
+int ht_shm_add(HashShm *shm, const void *key, size_t key_len, const void *value, size_t value_len);
+int ht_shm_find(HashShm *shm, const void *key, size_t key_len, void *value, size_t *value_len);
+int ht_shm_remove(HashShm *shm, const void *key, size_t key_len);
+int ht_shm_next(HashShm *shm, size_t *ipos, void *key, size_t *key_len, void *value, size_t *value_len);
+size_t ht_shm_size(HashShm *shm);
+int ht_shm_recover(HashShm *shm);
+
+int ht_hash_analyze(ht_hash_func hash_fn, const ht_key_t *keys, size_t count, int key_kind, ht_hash_report *report);
 
 void ht_stats(HashTable* ht);
 void ht_debug_stats();
@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+
+//--------------------------------------
+// check hash function quality over a
+// file of sample keys, one per line
+//
+// usage: ht_hashcheck [keys.txt] [hash]
+//
+// To check your own hasher add it to the
+// hashers table below.
+//--------------------------------------
+
+// flag a hasher outside these limits
+#define MAX_CHI_SQUARE      1.5     // home slot spread, ~1.0 is uniform
+#define MAX_PROBE_RATIO     1.5     // average probes over the uniform ideal
+#define MAX_BIT_BIAS        0.05    // |P(bit set) - 0.5|
+#define MAX_AVALANCHE_BIAS  0.05    // |P(output bit flips) - 0.5| per input bit flip
+
+//--------------------------------------
+// reference hashers
+//--------------------------------------
+static ht_hash_t fnv1a_hash(ht_key_t key)
+{
+    const unsigned char *s = key;
+    uint64_t h = 0xcbf29ce484222325ull;
+
+    for (; *s; ++s)
+    {
+        h ^= *s;
+        h *= 0x100000001b3ull;
+    }
+    return (ht_hash_t)h;
+}
+
+// deliberately weak, to show what a bad hasher reports
+static ht_hash_t sum_hash(ht_key_t key)
+{
+    const unsigned char *s = key;
+    ht_hash_t h = 0;
+
+    for (; *s; ++s)
+    {
+        h += *s;
+    }
+    return h;
+}
+
+static const struct
+{
+    const char *name;
+    ht_hash_func hash_fn;
+} hashers[] =
+{
+    { "string", HT_HASH_STRING },
+    { "siphash", HT_HASH_SIPHASH },
+    { "fnv1a", fnv1a_hash },
+    { "sum", sum_hash },
+};
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
+
+//--------------------------------------
+// release loaded keys
+//--------------------------------------
+static void free_keys(char **keys, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+//--------------------------------------
+// load one key per line
+//--------------------------------------
+static char **load_keys(const char *path, size_t *pcount)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+
+    size_t count = 0, capacity = 1024;
+    char **keys = malloc(capacity * sizeof(char*));
+    char line[1024];
+    int failed = !keys;
+
+    while (!failed && fgets(line, sizeof(line), fp))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if (!line[0])
+            continue;
+
+        if (count == capacity)
+        {
+            char **grown = realloc(keys, 2 * capacity * sizeof(char*));
+            if (!grown)
+            {
+                failed = 1;
+                break;
+            }
+
+            keys = grown;
+            capacity <<= 1;
+        }
+
+        keys[count] = strdup(line);
+        if (!keys[count])
+        {
+            failed = 1;
+            break;
+        }
+
+        count++;
+    }
+
+    fclose(fp);
+
+    if (failed)
+    {
+        fprintf(stderr, "%s: out of memory\n", path);
+        free_keys(keys, count);
+        return NULL;
+    }
+
+    *pcount = count;
+    return keys;
+}
+
+//--------------------------------------
+// print a report, returning the number
+// of limits exceeded
+//--------------------------------------
+static int check_hasher(const char *name, ht_hash_func hash_fn, char **keys, size_t count)
+{
+    ht_hash_report report;
+    if (!ht_hash_analyze(hash_fn, (const ht_key_t*)keys, count, HT_ANALYZE_STRINGS, &report))
+    {
+        fprintf(stderr, "%s: analysis failed\n", name);
+        return 1;
+    }
+
+    // only the bits table masks use decide the verdict
+    double avalanche = report.worst_avalanche_bias;
+    int problems = 0;
+
+    printf("%s: %zu keys, %zu duplicate hashes, %.2f ns/hash\n", name, report.keys, report.duplicate_hashes, report.ns_per_hash);
+    printf("  bit bias: worst %.4f (bit %d), %.4f in the low %d bits%s\n", report.worst_bit_bias, report.worst_bit,
+        report.worst_mask_bit_bias, report.mask_bits, report.worst_mask_bit_bias > MAX_BIT_BIAS ? "  <-- biased" : "");
+    printf("  avalanche bias: worst %.4f in the low %d bits%s\n", avalanche, report.mask_bits, avalanche > MAX_AVALANCHE_BIAS ? "  <-- weak mixing" : "");
+    problems += report.worst_mask_bit_bias > MAX_BIT_BIAS;
+    problems += avalanche > MAX_AVALANCHE_BIAS;
+
+    printf("  %10s %6s %12s %12s %8s %8s %10s %10s %8s\n", "size", "load", "used slots", "ideal", "max home", "chi^2", "probes", "ideal", "max");
+    for (int i = 0; i < HT_ANALYZE_SIZES; i++)
+    {
+        const ht_hash_load *load = &report.loads[i];
+        int bad = load->chi_square > MAX_CHI_SQUARE || load->avg_probes > MAX_PROBE_RATIO * load->ideal_probes;
+
+        printf("  %10zu %6.3f %12zu %12.0f %8zu %8.3f %10.3f %10.3f %8zu%s\n",
+            load->table_size, load->load, load->used_slots, load->ideal_used_slots, load->max_home,
+            load->chi_square, load->avg_probes, load->ideal_probes, load->max_probes, bad ? "  <--" : "");
+        problems += bad;
+    }
+
+    printf("  %s\n\n", problems ? "FAIL" : "ok");
+    return problems;
+}
+
+//--------------------------------------
+//
+//--------------------------------------
+int main(int argc, char *argv[])
+{
+    const char *path = argc > 1 ? argv[1] : "words_alpha.txt";
+    const char *only = argc > 2 ? argv[2] : NULL;
+
+    size_t count = 0;
+    char **keys = load_keys(path, &count);
+    if (!keys || count == 0)
+    {
+        fprintf(stderr, "usage: %s [keys.txt] [hash]\n%s: no keys\n", argv[0], path);
+        return 1;
+    }
+
+    int failed = 0, checked = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(hashers); i++)
+    {
+        if (only && strcmp(only, hashers[i].name))
+            continue;
+
+        failed += check_hasher(hashers[i].name, hashers[i].hash_fn, keys, count) != 0;
+        checked++;
+    }
+
+    if (!checked)
+        fprintf(stderr, "%s: unknown hash\n", only);
+
+    free_keys(keys, count);
+    ht_finished();
+
+    return failed || !checked;
+}
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hash.h"
+
+//--------------------------------------
+// replay a recorded operation trace
+//
+// usage: ht_replay trace.bin
+//
+// Keys are rebuilt from their recorded id, hash and length, so each replay
+// table probes exactly like the recorded one did. Keys are interned by id,
+// so key compares are pointer compares here. A key keeps the hash it was
+// first recorded with, as a replay table never reseeds where the recorded
+// one did.
+//--------------------------------------
+
+#define NS_PER_SEC 1000000000ull
+
+typedef struct replay_key
+{
+    uint64_t key_id;
+    uint64_t hash;
+    uint32_t key_len;
+} replay_key;
+
+typedef struct replay_op
+{
+    replay_key *key;
+    uint16_t table_id;
+    uint8_t op;
+    uint8_t result;
+} replay_op;
+
+typedef struct replay_memory
+{
+    size_t bytes;
+    size_t peak;
+} replay_memory;
+
+//--------------------------------------
+// wall clock in nanoseconds
+//--------------------------------------
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+//--------------------------------------
+// replayed keys hash to their recorded hash
+//--------------------------------------
+static ht_hash_t replay_hash(ht_key_t key)
+{
+    return (ht_hash_t)((const replay_key*)key)->hash;
+}
+
+//--------------------------------------
+// interning table hash and compare
+//--------------------------------------
+static ht_hash_t intern_hash(ht_key_t key)
+{
+    const replay_key *rk = key;
+    return (ht_hash_t)(rk->key_id ^ ((uint64_t)rk->key_len * 0x9e3779b97f4a7c15ull));
+}
+
+static int intern_compare(ht_key_t a, ht_key_t b)
+{
+    const replay_key *ka = a, *kb = b;
+    return ka->key_id == kb->key_id && ka->key_len == kb->key_len;
+}
+
+//--------------------------------------
+// replay tables allocate through these
+// to track their peak memory
+//--------------------------------------
+static void count_bytes(replay_memory *mem, size_t old_size, size_t new_size)
+{
+    mem->bytes += new_size - old_size;
+    if (mem->bytes > mem->peak)
+        mem->peak = mem->bytes;
+}
+
+static void *count_alloc(void *ctx, size_t size)
+{
+    void *ptr = malloc(size);
+    if (ptr)
+        count_bytes(ctx, 0, size);
+    return ptr;
+}
+
+static void *count_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    void *grown = realloc(ptr, new_size);
+    if (grown)
+        count_bytes(ctx, old_size, new_size);
+    return grown;
+}
+
+static void count_free(void *ctx, void *ptr, size_t size)
+{
+    if (ptr)
+        count_bytes(ctx, size, 0);
+    free(ptr);
+}
+
+//--------------------------------------
+// sort latencies for percentiles
+//--------------------------------------
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+//--------------------------------------
+// apply one operation to its table
+//--------------------------------------
+static int replay_one(HashTable **tables, size_t *cursors, const replay_op *op)
+{
+    HashTable *ht = tables[op->table_id];
+    ht_value_t *slot;
+    int inserted;
+
+    switch (op->op)
+    {
+    case HT_OP_INSERT:
+        return ht_insert(ht, op->key, op->key);
+
+    case HT_OP_ADD:
+        return ht_add(ht, op->key, op->key);
+
+    case HT_OP_FIND:
+        return ht_find(ht, op->key) != NULL;
+
+    case HT_OP_REMOVE:
+        return ht_remove(ht, op->key);
+
+    case HT_OP_UPSERT:
+        slot = ht_find_or_insert(ht, op->key, &inserted);
+        if (!slot)
+            return HT_FAIL;
+
+        *slot = op->key;
+        return inserted;
+
+    case HT_OP_NEXT:
+        // the recorded cursor is unknown, so restart at the end
+        if (!ht_next(ht, &cursors[op->table_id], NULL, NULL))
+        {
+            cursors[op->table_id] = 0;
+            return HT_FAIL;
+        }
+        return HT_OK;
+    }
+
+    return HT_FAIL;
+}
+
+//--------------------------------------
+// create one table per recorded table id
+//--------------------------------------
+static HashTable **create_tables(size_t count, const ht_allocator *allocator)
+{
+    HashTable **tables = calloc(count, sizeof(HashTable*));
+    if (!tables)
+        return NULL;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        tables[i] = ht_create_with_allocator(allocator);
+        if (!tables[i])
+        {
+            while (i--)
+            {
+                ht_free(tables[i]);
+            }
+            free(tables);
+            return NULL;
+        }
+
+        ht_set_hash_func(tables[i], replay_hash);
+    }
+
+    return tables;
+}
+
+//--------------------------------------
+// release replay tables, totalling stats
+//--------------------------------------
+static void free_tables(HashTable **tables, size_t count, size_t *collisions)
+{
+    *collisions = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+#if HT_TRACK_STATS == 1
+        *collisions += tables[i]->insert_collisions + tables[i]->search_collisions;
+#endif
+        ht_free(tables[i]);
+    }
+
+    free(tables);
+}
+
+//--------------------------------------
+// release interned keys
+//--------------------------------------
+static void free_interned(HashTable *interned)
+{
+    size_t index = 0;
+    ht_value_t key;
+
+    while (ht_next(interned, &index, NULL, &key))
+    {
+        free((void*)key);
+    }
+    ht_free(interned);
+}
+
+//--------------------------------------
+//
+//--------------------------------------
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s trace.bin\n", argv[0]);
+        return 1;
+    }
+
+    FILE *fp = fopen(argv[1], "rb");
+    if (!fp)
+    {
+        perror("fopen");
+        return 1;
+    }
+
+    if (!ht_trace_read_header(fp))
+    {
+        fprintf(stderr, "%s: not a hash table trace\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+
+    // load and intern the whole trace up front so only table ops are timed
+    HashTable *interned = ht_create();
+    if (!interned)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[1]);
+        fclose(fp);
+        return 1;
+    }
+
+    ht_set_hash_func(interned, intern_hash);
+    ht_set_compare_func(interned, intern_compare);
+
+    size_t count = 0, capacity = 1024, table_count = 0, mismatches = 0;
+    int failed = 0;
+    replay_op *ops = malloc(capacity * sizeof(replay_op));
+    replay_key *spare = NULL;
+    ht_trace_record rec;
+
+    while (ops && ht_trace_read(fp, &rec))
+    {
+        if (count == capacity)
+        {
+            replay_op *grown = realloc(ops, 2 * capacity * sizeof(replay_op));
+            if (!grown)
+            {
+                failed = 1;
+                break;
+            }
+
+            ops = grown;
+            capacity <<= 1;
+        }
+
+        replay_key *key = NULL;
+        if (rec.op != HT_OP_NEXT)
+        {
+            // intern on first sight, reusing the spare key until it is kept
+            if (!spare)
+                spare = malloc(sizeof(replay_key));
+            if (!spare)
+            {
+                failed = 1;
+                break;
+            }
+
+            spare->key_id = rec.key_id;
+            spare->hash = rec.hash;
+            spare->key_len = rec.key_len;
+
+            int inserted;
+            ht_value_t *slot = ht_find_or_insert(interned, spare, &inserted);
+            if (!slot)
+            {
+                failed = 1;
+                break;
+            }
+
+            if (inserted)
+            {
+                *slot = spare;
+                spare = NULL;
+            }
+
+            key = (replay_key*)*slot;
+        }
+
+        ops[count].key = key;
+        ops[count].table_id = rec.table_id;
+        ops[count].op = rec.op;
+        ops[count].result = rec.result;
+        count++;
+
+        if ((size_t)rec.table_id + 1 > table_count)
+            table_count = (size_t)rec.table_id + 1;
+    }
+
+    fclose(fp);
+    free(spare);
+
+    if (!ops || failed || count == 0)
+    {
+        fprintf(stderr, !ops || failed ? "%s: out of memory\n" : "%s: no operations\n", argv[1]);
+        free_interned(interned);
+        free(ops);
+        return 1;
+    }
+
+    replay_memory memory = { 0, 0 };
+    ht_allocator allocator = { count_alloc, count_realloc, count_free, &memory };
+    size_t *cursors = calloc(table_count, sizeof(size_t));
+    uint64_t *latency = malloc(count * sizeof(uint64_t));
+    HashTable **tables = cursors && latency ? create_tables(table_count, &allocator) : NULL;
+    size_t collisions;
+
+    if (!tables)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[1]);
+        free_interned(interned);
+        free(latency);
+        free(cursors);
+        free(ops);
+        return 1;
+    }
+
+    // throughput pass
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < count; i++)
+    {
+        mismatches += replay_one(tables, cursors, &ops[i]) != ops[i].result;
+    }
+    uint64_t elapsed = now_ns() - start;
+    free_tables(tables, table_count, &collisions);
+
+    // latency pass on fresh tables
+    memset(cursors, 0, table_count * sizeof(size_t));
+    tables = create_tables(table_count, &allocator);
+    if (!tables)
+    {
+        fprintf(stderr, "%s: out of memory\n", argv[1]);
+        free_interned(interned);
+        free(latency);
+        free(cursors);
+        free(ops);
+        return 1;
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t t0 = now_ns();
+        replay_one(tables, cursors, &ops[i]);
+        latency[i] = now_ns() - t0;
+    }
+
+    size_t unused_collisions;
+    free_tables(tables, table_count, &unused_collisions);
+
+    qsort(latency, count, sizeof(uint64_t), compare_u64);
+
+    printf("operations: %zu on %zu tables, %zu results differ from the recording\n", count, table_count, mismatches);
+    printf("throughput: %.2f Mops/s (%.3f ms)\n", count * 1e3 / (elapsed ? elapsed : 1), elapsed / 1e6);
+    printf("latency ns: p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+        (unsigned long long)latency[count / 2],
+        (unsigned long long)latency[count * 9 / 10],
+        (unsigned long long)latency[count * 99 / 100],
+        (unsigned long long)latency[count * 999 / 1000],
+        (unsigned long long)latency[count - 1]);
+    printf("memory: %zu bytes at peak in tables\n", memory.peak);
+#if HT_TRACK_STATS == 1
+    printf("probes: %zu collisions, %.3f per operation\n", collisions, (double)collisions / count);
+#endif
+
+    free_interned(interned);
+    ht_finished();
+
+    free(latency);
+    free(cursors);
+    free(ops);
+    return 0;
+}
@@ -4,6 +4,26 @@
 #include "hash.h"
 #include "testy/test.h"
 
+#if HT_SHM == 1 && (defined(__unix__) || defined(__APPLE__))
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <signal.h>
+    #include <sys/mman.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+    #define SHM_FORK 1
+#else
+    #define SHM_FORK 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <pthread.h>
+    #include <stdatomic.h>
+    #define TEST_THREADS 1
+#else
+    #define TEST_THREADS 0
+#endif
+
 #ifdef _WIN32
     #define DIR_PREFIX "..\\"
 #else
@@ -77,14 +97,14 @@ static void test_tombstone_reuse(void)
 static ht_hash_t hash(const void *key)
 {
     const unsigned char *s = (const unsigned char*)key;
-    ht_hash_t h = 3323198485ul;
+    uintptr_t h = 3323198485ul;
     for (; *s; ++s)
     {
         h ^= *s;
         h *= 0x5bd1e995;
         h ^= h >> 15;
     }
-    return h;
+    return (ht_hash_t)h;
 }
 
 //--------------------------------------
@@ -106,7 +126,8 @@ void test_create()
 
     ht = ht_create();
     TEST(ht != NULL);
-    TEST(ht->table != NULL);
+    TEST(ht->table == NULL);    // storage is deferred until first insert
+    TEST(ht->tiny == NULL);
     TEST(ht->entries == 0);
     TEST(ht->size == HT_DEFAULT_TABLE_SIZE);
     TEST(ht->compare_fn != NULL);
@@ -117,6 +138,10 @@ void test_create()
     TEST(ht->search_collisions == 0);
     TEST(ht->recent_insert_collisions == 0);
 #endif
+
+    // ten words plus generation, tiny capacity and mode; optional state lives in ht->ext
+    TEST(ht->ext == NULL);
+    TEST(sizeof(HashTable) == 10 * sizeof(void*) + 8 + 3 * sizeof(size_t) * HT_TRACK_STATS);
 }
 
 //--------------------------------------
@@ -249,6 +274,1862 @@ void test_destroy()
     ht = NULL; // Ensure ht is reset
 }
 
+//--------------------------------------
+// upsert callback that counts occurrences
+//--------------------------------------
+static ht_value_t count_upsert(ht_key_t key, ht_value_t old, int exists, void *ctx)
+{
+    (void)key;
+    (void)exists;
+    (*(int*)ctx)++;
+    return (ht_value_t)((intptr_t)old + 1);
+}
+
+//--------------------------------------
+// test single probe find-or-insert
+//--------------------------------------
+void test_find_or_insert()
+{
+    SUITE("Find Or Insert");
+
+    char *words[] = {"a", "b", "a", "c", "b", "a", "d", "e", "f", "g", "h", "i", "a"};
+    HashTable *ht = ht_create();
+    ht_set_hash_func(ht, HT_HASH_STRING);
+    ht_set_compare_func(ht, compare);
+
+    // count words, across promotion out of the tiny layout
+    int added = 0;
+    for (int i = 0; i < ARRAY_SIZE(words); i++)
+    {
+        int inserted;
+        ht_value_t *slot = ht_find_or_insert(ht, words[i], &inserted);
+        TEST(slot != NULL);
+
+        added += inserted;
+        *slot = (ht_value_t)((intptr_t)*slot + 1);
+    }
+
+    TEST(added == 9);
+    TEST(ht_size(ht) == 9);
+    TEST((intptr_t)ht_find(ht, "a") == 4);
+    TEST((intptr_t)ht_find(ht, "b") == 2);
+    TEST((intptr_t)ht_find(ht, "i") == 1);
+
+    // same again with a callback
+    int calls = 0;
+    for (int i = 0; i < ARRAY_SIZE(words); i++)
+    {
+        TEST(HT_OK == ht_upsert(ht, words[i], count_upsert, &calls));
+    }
+
+    TEST(calls == ARRAY_SIZE(words));
+    TEST((intptr_t)ht_find(ht, "a") == 8);
+    TEST((intptr_t)ht_find(ht, "d") == 2);
+    TEST(HT_FAIL == ht_upsert(ht, "a", NULL, NULL));
+
+    ht_free(ht);
+
+    // a key past a tombstone must not be added a second time
+    ht = ht_create();
+    ht_set_hash_func(ht, colliding_hash);
+
+    for (int i = 0; i < ARRAY_SIZE(keys); i++)
+    {
+        ht_insert(ht, keys[i], keys[i]);
+    }
+
+    TEST(HT_OK == ht_remove(ht, keys[1]));
+    TEST(HT_FAIL == ht_insert(ht, keys[2], keys[2]));
+    TEST(ht_size(ht) == ARRAY_SIZE(keys) - 1);
+
+    ht_free(ht);
+}
+
+//--------------------------------------
+// predicate selecting odd values
+//--------------------------------------
+static int is_odd(ht_key_t key, ht_value_t value, void *ctx)
+{
+    (void)key;
+    (void)ctx;
+    return *(const int*)value & 1;
+}
+
+//--------------------------------------
+// test batched iteration and removal
+//--------------------------------------
+void test_batch_iterate()
+{
+    SUITE("Batch Iterate");
+
+    static int values[100];
+    ht_key_t batch_keys[16];
+    ht_value_t batch_values[16];
+
+    // tiny, then hashed layout
+    int sizes[] = { 5, ARRAY_SIZE(values) };
+    for (int s = 0; s < ARRAY_SIZE(sizes); s++)
+    {
+        HashTable *ht = ht_create();
+        for (int i = 0; i < sizes[s]; i++)
+        {
+            values[i] = i;
+            ht_insert(ht, &values[i], &values[i]);
+        }
+
+        size_t total = 0, index = 0, n;
+        int matched = 1;
+        while ((n = ht_next_batch(ht, &index, batch_keys, batch_values, ARRAY_SIZE(batch_keys))) > 0)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                matched &= batch_keys[i] == batch_values[i];
+            }
+            total += n;
+        }
+        TEST(matched);
+        TEST(total == ht_size(ht));
+
+        // drop odd values in a single pass
+        TEST(ht_remove_if(ht, is_odd, NULL) == (size_t)sizes[s] / 2);
+        TEST(ht_size(ht) == (size_t)(sizes[s] + 1) / 2);
+
+        int found = 0;
+        for (int i = 0; i < sizes[s]; i++)
+        {
+            found += (ht_find(ht, &values[i]) != NULL) == !(i & 1);
+        }
+        TEST(found == sizes[s]);
+
+        // remove the rest while iterating
+        ht_key_t key;
+        size_t visited = 0;
+        index = 0;
+        while (ht_next(ht, &index, &key, NULL))
+        {
+            TEST(HT_OK == ht_remove_at(ht, &index));
+            visited++;
+        }
+        TEST(visited == (size_t)(sizes[s] + 1) / 2);
+        TEST(ht_size(ht) == 0);
+
+        ht_free(ht);
+    }
+}
+
+//--------------------------------------
+// test operation trace recording
+//--------------------------------------
+void test_trace()
+{
+    SUITE("Trace");
+
+#if HT_TRACE == 1
+    FILE *fp = tmpfile();
+    TEST(fp != NULL);
+    if (!fp)
+        return;
+
+    ht_tracer *tracer = ht_trace_open(fp);
+    TEST(tracer != NULL);
+
+    HashTable *ht = ht_create();
+    ht_set_hash_func(ht, HT_HASH_STRING);
+    ht_set_compare_func(ht, compare);
+    TEST(HT_OK == ht_trace_attach(ht, tracer));
+
+    ht_insert(ht, akey, avalue);
+    ht_insert(ht, akey, avalue);
+    ht_find(ht, akey);
+    ht_remove(ht, akey);
+    ht_find(ht, akey);
+    ht_find(ht, avalue);
+
+    TEST(HT_OK == ht_trace_attach(ht, NULL));
+    ht_find(ht, akey);
+    TEST(HT_OK == ht_trace_close(tracer));
+    ht_free(ht);
+
+    // read it back
+    uint8_t expected[][2] = {
+        { HT_OP_INSERT, HT_OK }, { HT_OP_INSERT, HT_FAIL }, { HT_OP_FIND, 1 }, { HT_OP_REMOVE, HT_OK }, { HT_OP_FIND, 0 }
+    };
+    uint64_t akey_id = 0;
+
+    rewind(fp);
+    TEST(HT_OK == ht_trace_read_header(fp));
+
+    ht_trace_record rec;
+    int count = 0, matched = 0;
+    while (ht_trace_read(fp, &rec))
+    {
+        if (count == 0)
+            akey_id = rec.key_id;
+
+        if (count < ARRAY_SIZE(expected))
+        {
+            matched += rec.op == expected[count][0] && rec.result == expected[count][1] && rec.key_len == strlen(akey) && rec.key_id == akey_id;
+        }
+        else
+        {
+            // another key gets another id
+            TEST(rec.key_id != akey_id);
+        }
+        count++;
+    }
+
+    TEST(count == ARRAY_SIZE(expected) + 1);
+    TEST(matched == ARRAY_SIZE(expected));
+
+    fclose(fp);
+#else
+    TEST(ht_trace_open(stdout) == NULL);
+#endif
+}
+
+//--------------------------------------
+// count events by type
+//--------------------------------------
+static void count_event(HashTable *ht, const ht_event *event, void *ctx)
+{
+    (void)ht;
+    size_t *counts = ctx;
+    counts[event->type]++;
+
+    if (event->type == HT_EVENT_RESIZE_END)
+        counts[0] += event->new_size > event->old_size;
+}
+
+#if HT_EVENTS == 1
+//--------------------------------------
+// allocator refusing blocks over *ctx bytes
+//--------------------------------------
+static void *limited_alloc(void *ctx, size_t size)
+{
+    return size > *(size_t*)ctx ? NULL : malloc(size);
+}
+
+static void *limited_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    (void)old_size;
+    return new_size > *(size_t*)ctx ? NULL : realloc(ptr, new_size);
+}
+
+static void limited_free(void *ctx, void *ptr, size_t size)
+{
+    (void)ctx;
+    (void)size;
+    free(ptr);
+}
+
+//--------------------------------------
+// resizes inserting count keys makes:
+// promotion out of the tiny layout, then
+// doubling at the load factor. *larger
+// counts those past the previous size,
+// which is nominally the default size
+// while tiny.
+//--------------------------------------
+static size_t expected_grows(size_t count, size_t *larger)
+{
+    size_t grows = 0, size = 0, last = HT_DEFAULT_TABLE_SIZE;
+    *larger = 0;
+
+    for (size_t entries = HT_TINY_SIZE; entries < count; entries++)
+    {
+        if (!size)
+        {
+            size = HT_TINY_SIZE;
+            while (HT_INV_LOAD_FACTOR * (entries + 1) >= size)
+                size <<= 1;
+        }
+        else if (HT_INV_LOAD_FACTOR * entries >= size)
+        {
+            size <<= 1;
+        }
+        else
+        {
+            continue;
+        }
+
+        grows++;
+        *larger += size > last;
+        last = size;
+    }
+
+    return grows;
+}
+#endif
+
+//--------------------------------------
+// test event hooks
+//--------------------------------------
+void test_events()
+{
+    SUITE("Events");
+
+    size_t counts[HT_EVENT_RESEED + 1] = { 0 };
+    HashTable *ht = ht_create();
+
+#if HT_EVENTS == 1
+    // enough keys to leave the tiny layout whatever its size
+    static int values[2 * HT_TINY_SIZE + 1];
+    size_t larger;
+    size_t grows = expected_grows(ARRAY_SIZE(values), &larger);
+
+    TEST(HT_OK == ht_set_event_func(ht, count_event, counts, 4));
+
+    // collisions make every probe chain long
+    ht_set_hash_func(ht, colliding_hash);
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        ht_insert(ht, &values[i], &values[i]);
+    }
+
+    TEST(grows >= 1);
+    TEST(counts[HT_EVENT_RESIZE_START] == grows);
+    TEST(counts[HT_EVENT_RESIZE_END] == grows);
+    TEST(counts[0] == larger);
+
+    ht_find(ht, &values[ARRAY_SIZE(values) - 1]);
+    TEST(counts[HT_EVENT_LONG_PROBE] >= 1);
+
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        ht_remove(ht, &values[i]);
+    }
+
+    TEST(ht_shrink(ht) != NULL);
+    TEST(counts[HT_EVENT_SHRINK] == 1);
+    TEST(counts[HT_EVENT_RESIZE_END] == grows + 1);
+    TEST(counts[HT_EVENT_ALLOC_FAIL] == 0);
+    ht_free(ht);
+
+    // a resize only starts once its array is allocated
+    size_t limit = sizeof(HashTable_Ext);
+    ht_allocator limited = { limited_alloc, limited_realloc, limited_free, &limit };
+    memset(counts, 0, sizeof(counts));
+
+    ht = ht_create_with_allocator(&limited);
+    TEST(HT_OK == ht_set_event_func(ht, count_event, counts, 0));
+
+    int result = HT_OK;
+    for (int i = 0; i < ARRAY_SIZE(values) && result == HT_OK; i++)
+    {
+        result = ht_insert(ht, &values[i], &values[i]);
+    }
+
+    TEST(result == HT_FAIL);
+    TEST(counts[HT_EVENT_ALLOC_FAIL] == 1);
+    TEST(counts[HT_EVENT_RESIZE_START] == 0);
+    TEST(counts[HT_EVENT_RESIZE_END] == 0);
+#else
+    TEST(HT_FAIL == ht_set_event_func(ht, count_event, counts, 4));
+#endif
+
+    ht_free(ht);
+}
+
+//--------------------------------------
+// test packed layout of small tables
+//--------------------------------------
+void test_tiny()
+{
+    SUITE("Tiny");
+
+    static int values[HT_TINY_SIZE + 1];
+    HashTable *ht = ht_create();
+    TEST(ht != NULL);
+
+    TEST(ht_find(ht, &values[0]) == NULL);
+    TEST(HT_FAIL == ht_remove(ht, &values[0]));
+
+    for (int i = 0; i < HT_TINY_SIZE; i++)
+    {
+        TEST(HT_OK == ht_insert(ht, &values[i], &values[i]));
+    }
+
+    // still packed, no slot array
+    TEST(ht->table == NULL);
+    TEST(ht->tiny_capacity == HT_TINY_SIZE);
+    TEST(HT_FAIL == ht_insert(ht, &values[0], &values[0]));
+    TEST(HT_OK == ht_add(ht, &values[0], &values[1]));
+    TEST(ht_find(ht, &values[0]) == &values[1]);
+
+    // removal keeps the rest findable
+    TEST(HT_OK == ht_remove(ht, &values[1]));
+    TEST(ht_find(ht, &values[1]) == NULL);
+
+    int found = 0;
+    for (int i = 2; i < HT_TINY_SIZE; i++)
+    {
+        found += ht_find(ht, &values[i]) == &values[i];
+    }
+    TEST(found == HT_TINY_SIZE - 2);
+
+    size_t count = 0, index = 0;
+    while (ht_next(ht, &index, NULL, NULL))
+    {
+        count++;
+    }
+    TEST(count == ht_size(ht));
+
+    // filling past the tiny size promotes to the hashed layout
+    TEST(HT_OK == ht_insert(ht, &values[1], &values[1]));
+    TEST(HT_OK == ht_insert(ht, &values[HT_TINY_SIZE], &values[HT_TINY_SIZE]));
+    TEST(ht->table != NULL);
+    TEST(ht->tiny == NULL);
+    TEST(ht_size(ht) == HT_TINY_SIZE + 1);
+
+    found = 0;
+    for (int i = 1; i <= HT_TINY_SIZE; i++)
+    {
+        found += ht_find(ht, &values[i]) == &values[i];
+    }
+    TEST(found == HT_TINY_SIZE);
+    TEST(ht_find(ht, &values[0]) == &values[1]);
+
+    ht_free(ht);
+}
+
+//--------------------------------------
+// test bucketized cuckoo layout
+//--------------------------------------
+void test_cuckoo()
+{
+    SUITE("Cuckoo");
+
+    static int values[20000];
+    HashTable *ht = ht_create();
+
+    TEST(HT_FAIL == ht_set_mode(ht, 7));
+    TEST(HT_OK == ht_set_mode(ht, HT_MODE_CUCKOO));
+
+    size_t max_load = 0, inserted = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        inserted += HT_OK == ht_insert(ht, &values[i], &values[i]);
+        if (ht->table && 100 * ht_size(ht) / ht_capacity(ht) > max_load)
+            max_load = 100 * ht_size(ht) / ht_capacity(ht);
+    }
+
+    // layout can't change once there are entries
+    TEST(HT_FAIL == ht_set_mode(ht, HT_MODE_PROBE));
+    TEST(inserted == ARRAY_SIZE(values));
+    TEST(ht_size(ht) == ARRAY_SIZE(values));
+    TEST(max_load + 5 >= HT_CUCKOO_LOAD);
+    TEST(HT_FAIL == ht_insert(ht, &values[0], &values[0]));
+
+    int found = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        found += ht_find(ht, &values[i]) == &values[i];
+    }
+    TEST(found == ARRAY_SIZE(values));
+
+    // remove the even half
+    size_t removed = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i += 2)
+    {
+        removed += HT_OK == ht_remove(ht, &values[i]);
+    }
+    TEST(removed == ARRAY_SIZE(values) / 2);
+    TEST(HT_FAIL == ht_remove(ht, &values[0]));
+
+    found = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        found += ht_find(ht, &values[i]) == ((i & 1) ? &values[i] : NULL);
+    }
+    TEST(found == ARRAY_SIZE(values));
+
+    size_t count = 0, index = 0;
+    while (ht_next(ht, &index, NULL, NULL))
+    {
+        count++;
+    }
+    TEST(count == ht_size(ht));
+
+    // freed slots are reused
+    TEST(HT_OK == ht_add(ht, &values[0], &values[1]));
+    TEST(ht_find(ht, &values[0]) == &values[1]);
+
+    ht_free(ht);
+}
+
+//--------------------------------------
+// keys in cuckoo_pile all hash alike
+//--------------------------------------
+static int cuckoo_pile[2 * HT_CUCKOO_SLOTS + HT_CUCKOO_STASH];
+
+static ht_hash_t pile_hash(const void *key)
+{
+    const int *k = key;
+    return k >= cuckoo_pile && k < cuckoo_pile + ARRAY_SIZE(cuckoo_pile) ? 1 : (ht_hash_t)(uintptr_t)key;
+}
+
+//--------------------------------------
+// test the cuckoo stash
+//--------------------------------------
+void test_cuckoo_stash()
+{
+    SUITE("Cuckoo stash");
+
+    HashTable *ht = ht_create();
+    ht_set_hash_func(ht, pile_hash);
+    TEST(HT_OK == ht_set_mode(ht, HT_MODE_CUCKOO));
+
+    while (ht_capacity(ht) < 4 * ARRAY_SIZE(cuckoo_pile))
+    {
+        TEST(ht_grow(ht) != NULL);
+    }
+
+    // each bucket starts a cache line
+    TEST(((uintptr_t)ht->table & 63) == 0);
+
+    // two buckets take the first of a pile of keys, the stash the rest
+    size_t capacity = ht_capacity(ht);
+    for (int i = 0; i < ARRAY_SIZE(cuckoo_pile); i++)
+    {
+        TEST(HT_OK == ht_insert(ht, &cuckoo_pile[i], &cuckoo_pile[i]));
+    }
+    TEST(ht->stashed == HT_CUCKOO_STASH);
+    TEST(ht_capacity(ht) == capacity);
+
+    int found = 0;
+    for (int i = 0; i < ARRAY_SIZE(cuckoo_pile); i++)
+    {
+        found += ht_find(ht, &cuckoo_pile[i]) == &cuckoo_pile[i];
+    }
+    TEST(found == ARRAY_SIZE(cuckoo_pile));
+
+    // views search the stash too
+    HashTable *snap = ht_snapshot(ht);
+    TEST(snap != NULL);
+    TEST(HT_OK == ht_remove(ht, &cuckoo_pile[0]));
+
+    found = 0;
+    for (int i = 0; i < ARRAY_SIZE(cuckoo_pile); i++)
+    {
+        found += ht_find(snap, &cuckoo_pile[i]) == &cuckoo_pile[i];
+    }
+    TEST(found == ARRAY_SIZE(cuckoo_pile));
+    TEST(HT_OK == ht_snapshot_free(snap));
+
+    // removing the pile empties the stash
+    for (int i = 1; i < ARRAY_SIZE(cuckoo_pile); i++)
+    {
+        TEST(HT_OK == ht_remove(ht, &cuckoo_pile[i]));
+    }
+    TEST(ht->stashed == 0);
+    TEST(ht_size(ht) == 0);
+
+    TEST(HT_OK == ht_insert(ht, &cuckoo_pile[0], &cuckoo_pile[0]));
+    TEST(ht_find(ht, &cuckoo_pile[0]) == &cuckoo_pile[0]);
+
+    ht_free(ht);
+}
+
+//--------------------------------------
+// test bloom filtered and batched finds
+//--------------------------------------
+void test_bloom()
+{
+    SUITE("Bloom");
+
+    static int values[4000];
+    ht_key_t batch[ARRAY_SIZE(values)];
+    ht_value_t found_values[ARRAY_SIZE(values)];
+    HashTable *ht = ht_create();
+
+    // enabling on a tiny table takes effect on promotion
+    TEST(HT_OK == ht_set_bloom(ht, 1));
+    TEST(ht->ext == NULL || ht->ext->bloom == NULL);
+
+    // insert the first half, look up all
+    for (int i = 0; i < ARRAY_SIZE(values) / 2; i++)
+    {
+        ht_insert(ht, &values[i], &values[i]);
+        batch[i] = &values[i];
+        batch[i + ARRAY_SIZE(values) / 2] = &values[i + ARRAY_SIZE(values) / 2];
+    }
+    TEST(ht->ext->bloom != NULL);
+
+    TEST(ht_find_many(ht, batch, found_values, ARRAY_SIZE(values)) == ARRAY_SIZE(values) / 2);
+
+    int correct = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        correct += found_values[i] == (i < ARRAY_SIZE(values) / 2 ? &values[i] : NULL);
+    }
+    TEST(correct == ARRAY_SIZE(values));
+
+    // removed keys stay findable as misses, and the filter survives a shrink
+    for (int i = 0; i < ARRAY_SIZE(values) / 2; i += 2)
+    {
+        ht_remove(ht, &values[i]);
+    }
+    while (ht_shrink(ht))
+        ;
+    TEST(ht->ext->bloom != NULL);
+
+    correct = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        correct += ht_find(ht, &values[i]) == ((i < ARRAY_SIZE(values) / 2 && (i & 1)) ? &values[i] : NULL);
+    }
+    TEST(correct == ARRAY_SIZE(values));
+
+    TEST(HT_OK == ht_set_bloom(ht, 0));
+    TEST(ht->ext == NULL || ht->ext->bloom == NULL);
+    TEST(ht_find(ht, &values[1]) == &values[1]);
+
+    // cuckoo tables filter too
+    HashTable *cuckoo = ht_create();
+    ht_set_mode(cuckoo, HT_MODE_CUCKOO);
+    ht_set_bloom(cuckoo, 1);
+    for (int i = 0; i < ARRAY_SIZE(values) / 2; i++)
+    {
+        ht_insert(cuckoo, &values[i], &values[i]);
+    }
+    TEST(ht_find_many(cuckoo, batch, found_values, ARRAY_SIZE(values)) == ARRAY_SIZE(values) / 2);
+    TEST(HT_FAIL == ht_remove(cuckoo, &values[ARRAY_SIZE(values) - 1]));
+    TEST(HT_OK == ht_remove(cuckoo, &values[0]));
+
+    ht_free(cuckoo);
+    ht_free(ht);
+}
+
+//--------------------------------------
+// test value-less hash sets
+//--------------------------------------
+void test_hash_set()
+{
+    SUITE("Hash set");
+
+    static int values[1000];
+    HashSet *a = ht_set_create(HT_HASH_NULL, NULL);
+    HashSet *b = ht_set_create(HT_HASH_NULL, NULL);
+    TEST(a != NULL && b != NULL);
+
+    TEST(sizeof(HashSet_Entry) * 2 == sizeof(HashTable_Entry));
+    TEST(!ht_set_contains(a, &values[0]));
+    TEST(HT_FAIL == ht_set_remove(a, &values[0]));
+
+    // a holds [0, 600), b holds [400, 1000)
+    for (int i = 0; i < 600; i++)
+    {
+        ht_set_add(a, &values[i]);
+        ht_set_add(b, &values[ARRAY_SIZE(values) - 1 - i]);
+    }
+    TEST(ht_set_size(a) == 600);
+    TEST(HT_FAIL == ht_set_add(a, &values[0]));
+    TEST(ht_set_contains(a, &values[599]));
+    TEST(!ht_set_contains(a, &values[600]));
+
+    size_t count = 0, index = 0;
+    ht_key_t key;
+    while (ht_set_next(a, &index, &key))
+    {
+        count += ht_set_contains(a, key);
+    }
+    TEST(count == 600);
+
+    // removed keys leave tombstones that are reused
+    TEST(HT_OK == ht_set_remove(a, &values[10]));
+    TEST(!ht_set_contains(a, &values[10]));
+    TEST(HT_OK == ht_set_add(a, &values[10]));
+
+    HashSet *c = ht_set_create(HT_HASH_NULL, NULL);
+    TEST(HT_OK == ht_set_union(c, a));
+    TEST(HT_OK == ht_set_union(c, b));
+    TEST(ht_set_size(c) == ARRAY_SIZE(values));
+
+    TEST(HT_OK == ht_set_intersect(c, a));
+    TEST(HT_OK == ht_set_intersect(c, b));
+    TEST(ht_set_size(c) == 200);
+    TEST(ht_set_contains(c, &values[400]) && !ht_set_contains(c, &values[399]));
+
+    TEST(HT_OK == ht_set_difference(a, b));
+    TEST(ht_set_size(a) == 400);
+    TEST(ht_set_contains(a, &values[399]) && !ht_set_contains(a, &values[400]));
+
+    // sets hashing differently can't be combined
+    HashSet *s = ht_set_create(HT_HASH_STRING, compare);
+    TEST(HT_FAIL == ht_set_union(s, a));
+    TEST(HT_FAIL == ht_set_union(a, a));
+
+    for (int i = 0; i < ARRAY_SIZE(keys); i++)
+    {
+        ht_set_add(s, keys[i]);
+    }
+    TEST(ht_set_contains(s, "lazy"));
+    TEST(!ht_set_contains(s, "cat"));
+
+    ht_set_free(s);
+    ht_set_free(c);
+    ht_set_free(b);
+    ht_set_free(a);
+}
+
+//--------------------------------------
+// test hash function analysis
+//--------------------------------------
+void test_hash_analyze()
+{
+    SUITE("Hash analyze");
+
+    ht_hash_report good, bad;
+
+    TEST(HT_FAIL == ht_hash_analyze(HT_HASH_STRING, (const ht_key_t*)keys, 0, HT_ANALYZE_STRINGS, &good));
+    TEST(HT_FAIL == ht_hash_analyze(HT_HASH_STRING, (const ht_key_t*)keys, ARRAY_SIZE(keys), 7, &good));
+    TEST(HT_OK == ht_hash_analyze(HT_HASH_STRING, (const ht_key_t*)keys, ARRAY_SIZE(keys), HT_ANALYZE_STRINGS, &good));
+    TEST(HT_OK == ht_hash_analyze(colliding_hash, (const ht_key_t*)keys, ARRAY_SIZE(keys), HT_ANALYZE_STRINGS, &bad));
+
+    TEST(good.keys == ARRAY_SIZE(keys));
+    TEST(good.duplicate_hashes == 0);
+    TEST(bad.duplicate_hashes == ARRAY_SIZE(keys) - 1);
+
+    // tables are sized as ht_insert would, then doubled
+    TEST(HT_INV_LOAD_FACTOR * ARRAY_SIZE(keys) < good.loads[0].table_size);
+    TEST(good.loads[1].table_size == 2 * good.loads[0].table_size);
+    TEST((1u << good.mask_bits) == good.loads[HT_ANALYZE_SIZES - 1].table_size);
+
+    // every key shares one home slot and walks the whole chain
+    TEST(bad.loads[0].used_slots == 1);
+    TEST(bad.loads[0].max_home == ARRAY_SIZE(keys));
+    TEST(bad.loads[0].max_probes == ARRAY_SIZE(keys));
+    TEST(bad.loads[0].avg_probes > good.loads[0].avg_probes);
+    TEST(bad.loads[0].chi_square > good.loads[0].chi_square);
+    TEST(bad.worst_bit_bias == 0.5);
+    TEST(good.loads[0].ideal_probes >= 1.0);
+
+    // a constant hash never flips, a keyed one flips about half its bits
+    TEST(good.avalanche_trials > 0);
+    TEST(bad.avalanche_trials == good.avalanche_trials);
+    TEST(bad.worst_avalanche_bias == 0.5);
+    TEST(good.worst_avalanche_bias < 0.25);
+
+    // pointer keys flip bits of the pointer itself
+    ht_hash_report pointers;
+    TEST(HT_OK == ht_hash_analyze(HT_HASH_NULL, (const ht_key_t*)keys, ARRAY_SIZE(keys), HT_ANALYZE_POINTERS, &pointers));
+    TEST(pointers.avalanche_trials == ARRAY_SIZE(keys) * sizeof(ht_key_t) * 8);
+}
+
+//--------------------------------------
+// test table clone and merge
+//--------------------------------------
+void test_clone_merge()
+{
+    SUITE("Clone and merge");
+
+    static int values[500];
+    HashTable *a = ht_create();
+    HashTable *b = ht_create();
+
+    // tiny tables clone their packed storage
+    ht_insert(a, &values[0], &values[0]);
+    HashTable *clone = ht_clone(a);
+    TEST(clone != NULL && clone->table == NULL);
+    TEST(ht_find(clone, &values[0]) == &values[0]);
+    ht_free(clone);
+
+    // a holds [0, 300) and b holds [200, 500) with different values
+    for (int i = 1; i < 300; i++)
+    {
+        ht_insert(a, &values[i], &values[i]);
+    }
+    for (int i = 200; i < ARRAY_SIZE(values); i++)
+    {
+        ht_insert(b, &values[i], &values[0]);
+    }
+    ht_remove(a, &values[1]);
+
+    clone = ht_clone(a);
+    TEST(clone != NULL);
+    TEST(ht_size(clone) == ht_size(a));
+    TEST(ht_capacity(clone) == ht_capacity(a));
+    TEST(memcmp(clone->table, a->table, a->size * sizeof(HashTable_Entry)) == 0);
+
+    // the clone is independent of the original
+    TEST(HT_OK == ht_remove(clone, &values[2]));
+    TEST(ht_find(a, &values[2]) == &values[2]);
+
+    TEST(HT_OK == ht_merge(clone, b, HT_MERGE_KEEP));
+    TEST(ht_size(clone) == ARRAY_SIZE(values) - 2);
+    TEST(ht_find(clone, &values[250]) == &values[250]);
+    TEST(ht_find(clone, &values[450]) == &values[0]);
+
+    TEST(HT_OK == ht_merge(a, b, HT_MERGE_REPLACE));
+    TEST(ht_size(a) == ARRAY_SIZE(values) - 1);
+    TEST(ht_find(a, &values[250]) == &values[0]);
+    TEST(ht_find(a, &values[100]) == &values[100]);
+
+    // merging needs matching hashers
+    HashTable *s = ht_create();
+    ht_set_hash_func(s, HT_HASH_STRING);
+    TEST(HT_FAIL == ht_merge(s, a, HT_MERGE_KEEP));
+    TEST(HT_FAIL == ht_merge(a, a, HT_MERGE_KEEP));
+    TEST(HT_FAIL == ht_merge(clone, b, 5));
+
+    // cuckoo tables merge into tiny tables too
+    HashTable *cuckoo = ht_create();
+    ht_set_mode(cuckoo, HT_MODE_CUCKOO);
+    TEST(HT_OK == ht_merge(cuckoo, a, HT_MERGE_KEEP));
+    TEST(ht_size(cuckoo) == ht_size(a));
+    TEST(ht_find(cuckoo, &values[499]) == &values[0]);
+
+    ht_free(cuckoo);
+    ht_free(s);
+    ht_free(clone);
+    ht_free(b);
+    ht_free(a);
+}
+
+//--------------------------------------
+// test clearing tables for reuse
+//--------------------------------------
+void test_clear()
+{
+    SUITE("Clear");
+
+    static int values[200];
+    HashTable *ht = ht_create();
+
+    // tiny tables just drop their entries
+    ht_insert(ht, &values[0], &values[0]);
+    TEST(HT_OK == ht_clear_lazy(ht));
+    TEST(ht_size(ht) == 0);
+    TEST(ht_find(ht, &values[0]) == NULL);
+
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        ht_insert(ht, &values[i], &values[i]);
+    }
+    ht_remove(ht, &values[0]);
+    size_t capacity = ht_capacity(ht);
+
+    TEST(HT_OK == ht_clear(ht));
+    TEST(ht_size(ht) == 0);
+    TEST(ht_capacity(ht) == capacity);
+    TEST(ht_find(ht, &values[1]) == NULL);
+
+    // lazily cleared slots read as unused, tombstones included
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < ARRAY_SIZE(values); i += round + 1)
+        {
+            ht_insert(ht, &values[i], &values[round]);
+        }
+        ht_remove(ht, &values[0]);
+
+        TEST(HT_OK == ht_clear_lazy(ht));
+        TEST(ht_size(ht) == 0);
+        TEST(ht_capacity(ht) == capacity);
+        TEST(ht->generation == (uint32_t)round + 1);
+
+        int found = 0;
+        for (int i = 0; i < ARRAY_SIZE(values); i++)
+        {
+            found += ht_find(ht, &values[i]) != NULL;
+        }
+        TEST(found == 0);
+
+        size_t index = 0;
+        TEST(!ht_next(ht, &index, NULL, NULL));
+    }
+
+    // stale slots are overwritten, and survive a resize and a clone
+    TEST(HT_OK == ht_insert(ht, &values[5], &values[5]));
+    TEST(HT_FAIL == ht_insert(ht, &values[5], &values[5]));
+    TEST(ht_find(ht, &values[5]) == &values[5]);
+
+    HashTable *clone = ht_clone(ht);
+    TEST(ht_find(clone, &values[5]) == &values[5]);
+    TEST(ht_find(clone, &values[6]) == NULL);
+    ht_free(clone);
+
+    TEST(ht_grow(ht) != NULL);
+    TEST(ht_size(ht) == 1);
+    TEST(ht_find(ht, &values[5]) == &values[5]);
+
+    // a wrapping generation clears slots for real
+    ht->generation = UINT32_MAX;
+    TEST(HT_OK == ht_clear_lazy(ht));
+    TEST(ht->generation == 0);
+    TEST(ht_find(ht, &values[5]) == NULL);
+    TEST(ht->table[(size_t)ht_hash(ht, &values[5]) & ht->mask].key == NULL);
+
+    ht_free(ht);
+}
+
+//--------------------------------------
+// count snapshot entries, checking each
+// maps to itself
+//--------------------------------------
+static size_t snapshot_count(HashTable *snap)
+{
+    size_t index = 0, count = 0;
+    ht_key_t key;
+    ht_value_t value;
+
+    while (ht_next(snap, &index, &key, &value))
+    {
+        count += key == value;
+    }
+
+    return count;
+}
+
+//--------------------------------------
+//
+//--------------------------------------
+void test_snapshot()
+{
+    SUITE("Snapshot");
+
+    static int values[1000], extra[1000];
+
+    // tiny tables are copied outright
+    HashTable *ht = ht_create();
+    ht_insert(ht, &values[0], &values[0]);
+    ht_insert(ht, &values[1], &values[1]);
+
+    HashTable *snap = ht_snapshot(ht);
+    TEST(snap != NULL);
+    ht_remove(ht, &values[0]);
+    ht_insert(ht, &values[2], &values[2]);
+
+    TEST(ht_size(snap) == 2);
+    TEST(ht_find(snap, &values[0]) == &values[0]);
+    TEST(ht_find(snap, &values[2]) == NULL);
+    TEST(snapshot_count(snap) == 2);
+    TEST(HT_OK == ht_snapshot_free(snap));
+    ht_free(ht);
+
+    ht = ht_create();
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        ht_insert(ht, &values[i], &values[i]);
+    }
+
+    snap = ht_snapshot(ht);
+    TEST(snap != NULL);
+    TEST(ht_snapshot(snap) == NULL);
+
+    // views are read-only
+    TEST(HT_FAIL == ht_insert(snap, &extra[0], &extra[0]));
+    TEST(HT_FAIL == ht_remove(snap, &values[0]));
+    TEST(HT_FAIL == ht_clear(snap));
+    TEST(ht_grow(snap) == NULL);
+
+    // remove evens, repoint odds and add more without the view noticing
+    int *one = &values[1], inserted;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        if (i & 1)
+            *ht_find_or_insert(ht, &values[i], &inserted) = one;
+        else
+            ht_remove(ht, &values[i]);
+
+        ht_insert(ht, &extra[i], &extra[i]);
+    }
+
+    HashTable *later = ht_snapshot(ht);
+    TEST(later != NULL);
+
+    int seen = 0, missing = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        seen += ht_find(snap, &values[i]) == &values[i];
+        missing += ht_find(snap, &extra[i]) == NULL;
+    }
+    TEST(seen == ARRAY_SIZE(values));
+    TEST(missing == ARRAY_SIZE(extra));
+    TEST(ht_size(snap) == ARRAY_SIZE(values));
+    TEST(snapshot_count(snap) == ARRAY_SIZE(values));
+
+    // the live table and the later view agree
+    seen = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        seen += ht_find(later, &values[i]) == ((i & 1) ? one : NULL);
+        seen += ht_find(later, &extra[i]) == &extra[i];
+    }
+    TEST(seen == 2 * ARRAY_SIZE(values));
+    TEST(ht_size(later) == ht_size(ht));
+
+    ht_key_t keys[3] = { &values[2], &values[3], &extra[4] };
+    ht_value_t found[3];
+    TEST(ht_find_many(snap, keys, found, 3) == 2);
+    TEST(found[0] == &values[2] && found[1] == &values[3] && found[2] == NULL);
+
+    // views outlive a resize, a clear and the table itself
+    TEST(ht_grow(ht) != NULL);
+    TEST(ht_find(later, &extra[7]) == &extra[7]);
+    TEST(ht_find(snap, &values[8]) == &values[8]);
+
+    HashTable *cleared = ht_snapshot(ht);
+    TEST(HT_OK == ht_clear(ht));
+    TEST(ht_size(ht) == 0);
+    TEST(ht_find(cleared, &extra[9]) == &extra[9]);
+
+    ht_free(ht);
+    TEST(snapshot_count(snap) == ARRAY_SIZE(values));
+    TEST(ht_find(later, &values[1]) == one);
+    TEST(HT_OK == ht_snapshot_free(snap));
+    TEST(HT_OK == ht_snapshot_free(later));
+    TEST(HT_OK == ht_free(cleared));
+
+    // released views are dropped once the table next copies a page or clears
+    ht = ht_create();
+    ht_set_mode(ht, HT_MODE_CUCKOO);
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        ht_insert(ht, &values[i], &values[i]);
+    }
+
+    snap = ht_snapshot(ht);
+    later = ht_snapshot(ht);
+    TEST(HT_OK == ht_snapshot_free(later));
+
+    for (int i = 0; i < ARRAY_SIZE(values); i += 2)
+    {
+        ht_remove(ht, &values[i]);
+    }
+    TEST(ht->ext->snapshots != NULL);
+
+    seen = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        seen += ht_find(snap, &values[i]) == &values[i];
+    }
+    TEST(seen == ARRAY_SIZE(values));
+    TEST(ht_size(ht) == ARRAY_SIZE(values) / 2);
+
+    TEST(HT_OK == ht_snapshot_free(snap));
+    TEST(HT_OK == ht_clear(ht));
+    TEST(ht->ext->snapshots == NULL && ht->ext->shared == NULL);
+
+    ht_free(ht);
+}
+
+#if HT_RESEED_PROBES > 0
+//--------------------------------------
+// find up to count strings whose hash
+// in ht lands on slot 0
+//--------------------------------------
+#define SEED_KEYS (3 * HT_RESEED_PROBES + 10)
+static char seed_keys[SEED_KEYS + 1][16];
+
+static void colliding_strings(HashTable *ht, int first, int count, int *next)
+{
+    for (int n = first; n < first + count; (*next)++)
+    {
+        sprintf(seed_keys[n], "k%d", *next);
+        if ((ht_hash(ht, seed_keys[n]) & ht->mask) == 0)
+            n++;
+    }
+}
+#endif
+
+//--------------------------------------
+//
+//--------------------------------------
+void test_seed()
+{
+    SUITE("Seeded hashing");
+
+    static int values[100];
+
+    // built-in hashers share the process secret until a table is seeded
+    HashTable *a = ht_create();
+    HashTable *b = ht_create();
+    TEST(ht_hash(a, &values[0]) == ht_hash(b, &values[0]));
+    TEST(a->ext == NULL);
+
+    TEST(HT_OK == ht_set_seed(a, 1, 2));
+    TEST(ht_hash(a, &values[0]) != ht_hash(b, &values[0]));
+    TEST(HT_OK == ht_set_seed(b, 1, 2));
+    TEST(ht_hash(a, &values[0]) == ht_hash(b, &values[0]));
+
+    // reseeding keeps entries reachable, tiny or hashed
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        ht_insert(a, &values[i], &values[i]);
+        if (i < 3)
+            ht_insert(b, &values[i], &values[i]);
+    }
+
+    TEST(HT_OK == ht_set_seed(a, 3, 4));
+    TEST(HT_OK == ht_set_seed(b, 3, 4));
+
+    int found = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        found += ht_find(a, &values[i]) == &values[i];
+    }
+    TEST(found == ARRAY_SIZE(values));
+    TEST(ht_find(b, &values[2]) == &values[2]);
+
+    // tables seeded apart still merge
+    TEST(HT_OK == ht_set_seed(b, 5, 6));
+    TEST(HT_OK == ht_merge(b, a, HT_MERGE_KEEP));
+    TEST(ht_size(b) == ARRAY_SIZE(values));
+    TEST(ht_find(b, &values[50]) == &values[50]);
+    ht_free(a);
+    ht_free(b);
+
+    HashTable *ht = ht_create();
+    TEST(HT_OK == ht_set_hash_func(ht, HT_HASH_SIPHASH));
+    ht_set_compare_func(ht, compare);
+    TEST(HT_OK == ht_insert(ht, "alpha", "1"));
+    TEST(HT_OK == ht_insert(ht, "beta", "2"));
+    TEST(!strcmp(ht_find(ht, "beta"), "2"));
+    TEST(ht_find(ht, "gamma") == NULL);
+
+#if INTPTR_MAX == INT64_MAX
+    // SipHash-1-3 reference value, as used by CPython's str hash
+    ht_set_seed(ht, 0, 0);
+    TEST(ht_hash(ht, "hello") == -2096571579003691106ll);
+#endif
+    ht_free(ht);
+
+#if HT_RESEED_PROBES > 0
+    // keys piled onto one slot force a reseed
+    ht = ht_create();
+    ht_set_hash_func(ht, HT_HASH_STRING);
+    ht_set_compare_func(ht, compare);
+    ht_set_seed(ht, 1, 2);
+    while (ht_capacity(ht) < 4 * SEED_KEYS)
+    {
+        ht_grow(ht);
+    }
+
+    int next = 0;
+    colliding_strings(ht, 0, SEED_KEYS, &next);
+
+    for (int i = 0; i < SEED_KEYS; i++)
+    {
+        ht_insert(ht, seed_keys[i], seed_keys[i]);
+    }
+    TEST(ht->ext->reseeds == 1);
+    TEST(ht_size(ht) == SEED_KEYS);
+    TEST(ht->ext->seed[0] != 1 || ht->ext->seed[1] != 2);
+
+    // the same attack again moves the table to SipHash
+    HashTable *sip = ht_create();
+    ht_set_hash_func(sip, HT_HASH_SIPHASH);
+
+    ht_set_seed(ht, 1, 2);
+    colliding_strings(ht, SEED_KEYS, 1, &next);
+    TEST(HT_OK == ht_insert(ht, seed_keys[SEED_KEYS], seed_keys[SEED_KEYS]));
+    TEST(ht->ext->reseeds == 2);
+    TEST(ht->hash_fn == sip->hash_fn);
+
+    found = 0;
+    for (int i = 0; i <= SEED_KEYS; i++)
+    {
+        found += ht_find(ht, seed_keys[i]) == seed_keys[i];
+    }
+    TEST(found == SEED_KEYS + 1);
+
+    ht_free(sip);
+    ht_free(ht);
+#endif
+}
+
+//--------------------------------------
+// count evictions
+//--------------------------------------
+static void count_evict(ht_key_t key, ht_value_t value, void *ctx)
+{
+    (void)key;
+    (void)value;
+    (*(size_t*)ctx)++;
+}
+
+//--------------------------------------
+// test bounded CLOCK caches
+//--------------------------------------
+void test_cache()
+{
+    SUITE("Cache");
+
+    static int values[1000];
+    size_t evicted = 0;
+
+    TEST(ht_cache_create(0, NULL, NULL) == NULL);
+
+    HashTable *ht = ht_cache_create(100, count_evict, &evicted);
+    TEST(ht != NULL);
+    size_t capacity = ht_capacity(ht);
+    const HashTable_Entry *table = ht->table;
+
+    // a plain table can't be used as a cache
+    HashTable *plain = ht_create();
+    TEST(HT_FAIL == ht_cache_put(plain, &values[0], &values[0]));
+    ht_free(plain);
+
+    size_t added = 0;
+    for (int i = 0; i < 100; i++)
+    {
+        added += HT_OK == ht_cache_put(ht, &values[i], &values[i]);
+    }
+    TEST(added == 100);
+    TEST(evicted == 0);
+    TEST(ht_cache_get(ht, &values[99]) == &values[99]);
+
+    // keep the first ten hot while streaming many more keys through
+    for (int i = 100; i < ARRAY_SIZE(values); i++)
+    {
+        for (int hot = 0; hot < 10; hot++)
+        {
+            ht_cache_get(ht, &values[hot]);
+        }
+
+        ht_cache_put(ht, &values[i], &values[i]);
+    }
+
+    TEST(ht_size(ht) == 100);
+    TEST(evicted == ARRAY_SIZE(values) - 100);
+    TEST(ht_capacity(ht) == capacity);
+    TEST(ht->deleted * 4 <= ht_capacity(ht));
+
+    // tombstones are purged in place, never through a second array
+    TEST(ht->table == table);
+
+    int hot = 0;
+    for (int i = 0; i < 10; i++)
+    {
+        hot += ht_cache_get(ht, &values[i]) == &values[i];
+    }
+    TEST(hot == 10);
+    TEST(ht_cache_get(ht, &values[ARRAY_SIZE(values) - 1]) == &values[ARRAY_SIZE(values) - 1]);
+
+    // updates don't evict, and caches don't resize
+    TEST(HT_OK == ht_cache_put(ht, &values[0], &values[1]));
+    TEST(ht_find(ht, &values[0]) == &values[1]);
+    TEST(evicted == ARRAY_SIZE(values) - 100);
+    TEST(ht_grow(ht) == NULL);
+    TEST(ht_shrink(ht) == NULL);
+    TEST(HT_FAIL == ht_set_mode(ht, HT_MODE_CUCKOO));
+
+    ht_free(ht);
+}
+
+#if TEST_THREADS
+#define COUNTER_KEYS    1000
+#define COUNTER_THREADS 4
+#define COUNTER_ROUNDS  50
+
+static int counter_keys[COUNTER_KEYS];
+static atomic_int counter_done;
+
+//--------------------------------------
+// count every key, half the threads
+// through a buffer
+//--------------------------------------
+static void *counter_worker(void *arg)
+{
+    HashCounter *map = *(HashCounter**)arg;
+    int buffered = (int)(((HashCounter**)arg)[1] != NULL);
+    ht_counter_buffer *buffer = buffered ? ht_counter_buffer_create(map) : NULL;
+
+    for (int round = 0; round < COUNTER_ROUNDS; round++)
+    {
+        for (int i = 0; i < COUNTER_KEYS; i++)
+        {
+            if (buffer)
+                ht_counter_buffer_add(buffer, &counter_keys[i], 1);
+            else
+                ht_counter_add(map, &counter_keys[i], 1);
+        }
+    }
+
+    if (buffer)
+        ht_counter_buffer_free(buffer);
+    return NULL;
+}
+
+//--------------------------------------
+// drain counts while the workers add
+//--------------------------------------
+static void *counter_drainer(void *arg)
+{
+    HashCounter *map = arg;
+    ht_key_t keys[64];
+    int64_t values[64];
+    int64_t *total = calloc(1, sizeof(int64_t));
+
+    while (!atomic_load(&counter_done))
+    {
+        size_t ipos = 0, n;
+        while ((n = ht_counter_drain(map, &ipos, keys, values, 64)) > 0)
+        {
+            for (size_t i = 0; i < n; i++)
+            {
+                *total += values[i];
+            }
+        }
+    }
+
+    return total;
+}
+#endif
+
+//--------------------------------------
+// test concurrent counter maps
+//--------------------------------------
+void test_counter()
+{
+    SUITE("Counter map");
+
+    static int values[500];
+    int64_t count;
+
+    HashCounter *map = ht_counter_create(HT_HASH_NULL, NULL);
+    TEST(map != NULL);
+    TEST(ht_counter_size(map) == 0);
+    TEST(HT_FAIL == ht_counter_get(map, &values[0], &count));
+
+    TEST(HT_OK == ht_counter_add(map, &values[0], 5));
+    TEST(HT_OK == ht_counter_add(map, &values[0], -2));
+    TEST(HT_OK == ht_counter_get(map, &values[0], &count) && count == 3);
+    TEST(HT_FAIL == ht_counter_add(map, NULL, 1));
+
+    // grows by adding segments, keys stay put
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        TEST(HT_OK == ht_counter_add(map, &values[i], i));
+    }
+    TEST(ht_counter_size(map) == ARRAY_SIZE(values));
+    TEST(map->segment_count > 1);
+
+    int counts_ok = 1;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        counts_ok &= ht_counter_get(map, &values[i], &count) && count == i + (i == 0 ? 3 : 0);
+    }
+    TEST(counts_ok);
+
+    // snapshots copy, drains zero and skip zero counts
+    ht_key_t keys[64];
+    int64_t counts[64];
+    size_t ipos = 0, n, seen = 0;
+    int64_t total = 0;
+    while ((n = ht_counter_snapshot(map, &ipos, keys, counts, 64)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            total += counts[i];
+        }
+        seen += n;
+    }
+    TEST(seen == ARRAY_SIZE(values));
+    TEST(total == 3 + ARRAY_SIZE(values) * (ARRAY_SIZE(values) - 1) / 2);
+
+    TEST(HT_OK == ht_counter_add(map, &values[1], -1));
+    ipos = 0;
+    seen = 0;
+    while ((n = ht_counter_drain(map, &ipos, keys, counts, 64)) > 0)
+    {
+        seen += n;
+    }
+    TEST(seen == ARRAY_SIZE(values) - 1);
+    TEST(HT_OK == ht_counter_get(map, &values[7], &count) && count == 0);
+    ipos = 0;
+    TEST(0 == ht_counter_drain(map, &ipos, keys, counts, 64));
+    TEST(ht_counter_size(map) == ARRAY_SIZE(values));
+
+    // buffered deltas reach the map on flush
+    ht_counter_buffer *buffer = ht_counter_buffer_create(map);
+    TEST(buffer != NULL);
+    TEST(HT_OK == ht_counter_buffer_add(buffer, &values[1], 10));
+    TEST(HT_OK == ht_counter_buffer_add(buffer, &values[1], 10));
+    TEST(HT_OK == ht_counter_get(map, &values[1], &count) && count == 0);
+    TEST(HT_OK == ht_counter_flush(buffer));
+    TEST(HT_OK == ht_counter_get(map, &values[1], &count) && count == 20);
+
+    // a full buffer flushes itself
+    for (int i = 0; i < HT_COUNTER_BUFFER; i++)
+    {
+        TEST(HT_OK == ht_counter_buffer_add(buffer, &values[i], 1));
+    }
+    TEST(HT_OK == ht_counter_get(map, &values[1], &count) && count == 21);
+    TEST(HT_OK == ht_counter_buffer_free(buffer));
+    TEST(HT_OK == ht_counter_get(map, &values[HT_COUNTER_BUFFER - 1], &count) && count == 1);
+    TEST(HT_OK == ht_counter_free(map));
+
+    // string keys compare by value
+    map = ht_counter_create(HT_HASH_STRING, compare);
+    char word[8] = "the";
+    TEST(HT_OK == ht_counter_add(map, "the", 1));
+    TEST(HT_OK == ht_counter_add(map, word, 1));
+    TEST(ht_counter_size(map) == 1);
+    TEST(HT_OK == ht_counter_get(map, "the", &count) && count == 2);
+    TEST(HT_OK == ht_counter_free(map));
+
+#if TEST_THREADS
+    // threads add and a drainer drains at once, no count is lost
+    map = ht_counter_create(HT_HASH_NULL, NULL);
+    HashCounter *args[COUNTER_THREADS][2];
+    pthread_t threads[COUNTER_THREADS], drainer;
+
+    atomic_store(&counter_done, 0);
+    TEST(0 == pthread_create(&drainer, NULL, counter_drainer, map));
+    for (int i = 0; i < COUNTER_THREADS; i++)
+    {
+        args[i][0] = map;
+        args[i][1] = i & 1 ? map : NULL;
+        TEST(0 == pthread_create(&threads[i], NULL, counter_worker, args[i]));
+    }
+
+    for (int i = 0; i < COUNTER_THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    atomic_store(&counter_done, 1);
+    int64_t *drained;
+    pthread_join(drainer, (void**)&drained);
+
+    total = *drained;
+    free(drained);
+
+    ipos = 0;
+    while ((n = ht_counter_snapshot(map, &ipos, keys, counts, 64)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            total += counts[i];
+        }
+    }
+    TEST(ht_counter_size(map) == COUNTER_KEYS);
+    TEST(total == (int64_t)COUNTER_THREADS * COUNTER_ROUNDS * COUNTER_KEYS);
+    TEST(HT_OK == ht_counter_free(map));
+#endif
+}
+
+#if SHM_FORK
+//--------------------------------------
+// shared memory value for a key, the key
+// repeated 1 to 5 times
+//--------------------------------------
+static size_t shm_value(char *value, const char *key, unsigned round)
+{
+    size_t len = strlen(key), count = round % 5 + 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        memcpy(value + i * len, key, len);
+    }
+    return count * len;
+}
+
+static int shm_value_ok(const char *value, size_t value_len, const char *key)
+{
+    size_t len = strlen(key);
+    if (value_len == 0 || value_len % len)
+        return 0;
+
+    for (size_t i = 0; i < value_len; i += len)
+    {
+        if (memcmp(value + i, key, len))
+            return 0;
+    }
+    return 1;
+}
+
+//--------------------------------------
+// rewrite keys until killed
+//--------------------------------------
+static void shm_writer(HashShm *shm, int keys)
+{
+    char key[16], value[80];
+
+    for (unsigned round = 0; ; round++)
+    {
+        snprintf(key, sizeof(key), "key%u", round % keys);
+        if (round % 7 == 3)
+            ht_shm_remove(shm, key, strlen(key));
+        else
+            ht_shm_add(shm, key, strlen(key), value, shm_value(value, key, round));
+    }
+}
+#endif
+
+//--------------------------------------
+// test tables in shared memory
+//--------------------------------------
+void test_shm()
+{
+    SUITE("Shared memory");
+
+    HashShm *shm = ht_shm_create(NULL, 64, 16 * 1024);
+
+#if HT_SHM == 1 && (defined(__unix__) || defined(__APPLE__))
+    TEST(shm != NULL);
+#endif
+    if (!shm)
+        return;
+
+    char value[64];
+    size_t value_len = sizeof(value);
+
+    TEST(HT_OK == ht_shm_insert(shm, "alpha", 5, "one", 3));
+    TEST(HT_FAIL == ht_shm_insert(shm, "alpha", 5, "uno", 3));
+    TEST(HT_OK == ht_shm_find(shm, "alpha", 5, value, &value_len));
+    TEST(value_len == 3 && !memcmp(value, "one", 3));
+
+    // add replaces, a short buffer gets the full length
+    TEST(HT_OK == ht_shm_add(shm, "alpha", 5, "a longer value", 14));
+    value_len = 4;
+    TEST(HT_OK == ht_shm_find(shm, "alpha", 5, value, &value_len));
+    TEST(value_len == 14 && !memcmp(value, "a lo", 4));
+    TEST(HT_OK == ht_shm_find(shm, "alpha", 5, NULL, NULL));
+    TEST(HT_FAIL == ht_shm_find(shm, "alph", 4, NULL, NULL));
+
+    // empty keys and values are allowed
+    TEST(HT_OK == ht_shm_insert(shm, "", 0, "", 0));
+    value_len = sizeof(value);
+    TEST(HT_OK == ht_shm_find(shm, "", 0, value, &value_len));
+    TEST(value_len == 0);
+    TEST(ht_shm_size(shm) == 2);
+
+    TEST(HT_OK == ht_shm_remove(shm, "", 0));
+    TEST(HT_FAIL == ht_shm_remove(shm, "", 0));
+    TEST(ht_shm_size(shm) == 1);
+
+    // the slot array is fixed, inserts past capacity fail
+    char key[16];
+    int i;
+    for (i = 0; i < 1000; i++)
+    {
+        snprintf(key, sizeof(key), "k%d", i);
+        if (!ht_shm_insert(shm, key, strlen(key), &i, sizeof(i)))
+            break;
+    }
+    TEST(i == 63);
+    TEST(ht_shm_size(shm) == 64);
+
+    size_t ipos = 0, count = 0, key_len;
+    key_len = sizeof(key);
+    while (ht_shm_next(shm, &ipos, key, &key_len, NULL, NULL))
+    {
+        count++;
+        key_len = sizeof(key);
+    }
+    TEST(count == 64);
+
+    // removes and inserts many times the slot count, dropping tombstones
+    int churn_ok = 1;
+    for (i = 0; i < 2000; i++)
+    {
+        snprintf(key, sizeof(key), "k%d", i % 63);
+        churn_ok &= ht_shm_remove(shm, key, strlen(key));
+        churn_ok &= ht_shm_insert(shm, key, strlen(key), &i, sizeof(i));
+    }
+    TEST(churn_ok);
+    TEST(ht_shm_size(shm) == 64);
+    TEST(HT_OK == ht_shm_recover(shm));
+    TEST(ht_shm_size(shm) == 64);
+
+    // values past the heap fail
+    static char big[32 * 1024];
+    TEST(HT_FAIL == ht_shm_add(shm, "alpha", 5, big, sizeof(big)));
+    value_len = sizeof(value);
+    TEST(HT_OK == ht_shm_find(shm, "alpha", 5, value, &value_len) && value_len == 14);
+
+    // a second mapping of the same region sees the same table
+    HashShm *other = ht_shm_open_fd(ht_shm_fd(shm));
+    TEST(other != NULL);
+    TEST(HT_OK == ht_shm_add(other, "alpha", 5, "two", 3));
+    value_len = sizeof(value);
+    TEST(HT_OK == ht_shm_find(shm, "alpha", 5, value, &value_len) && value_len == 3);
+    TEST(HT_OK == ht_shm_close(other));
+    TEST(HT_OK == ht_shm_close(shm));
+
+#if SHM_FORK
+    char name[64];
+    snprintf(name, sizeof(name), "/ht_test_%ld", (long)getpid());
+
+    shm = ht_shm_create(name, 256, 64 * 1024);
+    TEST(shm != NULL);
+    TEST(NULL == ht_shm_create(name, 256, 64 * 1024));
+
+    // a child process writes, the parent reads
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        HashShm *child = ht_shm_open(name);
+        for (unsigned k = 0; child && k < 200; k++)
+        {
+            snprintf(key, sizeof(key), "key%u", k);
+            ht_shm_insert(child, key, strlen(key), value, shm_value(value, key, k));
+        }
+        _exit(child && ht_shm_size(child) == 200 ? 0 : 1);
+    }
+
+    int status;
+    TEST(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    TEST(ht_shm_size(shm) == 200);
+
+    int values_ok = 1;
+    for (unsigned k = 0; k < 200; k++)
+    {
+        snprintf(key, sizeof(key), "key%u", k);
+        value_len = sizeof(value);
+        values_ok &= ht_shm_find(shm, key, strlen(key), value, &value_len) && shm_value_ok(value, value_len, key);
+    }
+    TEST(values_ok);
+    TEST(HT_OK == ht_shm_unlink(name));
+    TEST(HT_FAIL == ht_shm_unlink(name));
+    TEST(HT_OK == ht_shm_close(shm));
+
+    // a creator that died before finishing leaves a region that can't be opened
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    TEST(fd >= 0);
+    errno = 0;
+    TEST(NULL == ht_shm_open(name) && errno == EAGAIN);
+    TEST(fd >= 0 && 0 == ftruncate(fd, 64 * 1024));
+    errno = 0;
+    TEST(NULL == ht_shm_open(name) && errno == EAGAIN);
+    TEST(NULL == ht_shm_create(name, 256, 64 * 1024) && errno == EEXIST);
+
+    // nor can one that isn't a table
+    char *junk = fd >= 0 ? mmap(NULL, 64 * 1024, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    TEST(junk != MAP_FAILED);
+    if (junk != MAP_FAILED)
+    {
+        memset(junk, 'x', 64);
+        munmap(junk, 64 * 1024);
+    }
+    errno = 0;
+    TEST(NULL == ht_shm_open(name) && errno == EINVAL);
+    if (fd >= 0)
+        close(fd);
+
+    // so the caller unlinks it and starts again
+    TEST(HT_OK == ht_shm_unlink(name));
+    shm = ht_shm_create(name, 256, 64 * 1024);
+    TEST(shm != NULL);
+    TEST(HT_OK == ht_shm_unlink(name));
+    TEST(HT_OK == ht_shm_close(shm));
+
+    // read while a child writes, then kill it, perhaps mid-write
+    shm = ht_shm_create(NULL, 128, 64 * 1024);
+    TEST(shm != NULL);
+
+    for (int crash = 0; crash < 5; crash++)
+    {
+        pid = fork();
+        if (pid == 0)
+            shm_writer(shm, 100);
+
+        int reads_ok = 1;
+        for (unsigned k = 0; k < 20000; k++)
+        {
+            snprintf(key, sizeof(key), "key%u", k % 100);
+            value_len = sizeof(value);
+            if (ht_shm_find(shm, key, strlen(key), value, &value_len))
+                reads_ok &= shm_value_ok(value, value_len, key);
+        }
+        TEST(reads_ok);
+
+        kill(pid, SIGKILL);
+        TEST(waitpid(pid, &status, 0) == pid);
+
+        // the next locker repairs the region, each key is whole or absent
+        size_t found = 0;
+        values_ok = 1;
+        for (unsigned k = 0; k < 100; k++)
+        {
+            snprintf(key, sizeof(key), "key%u", k);
+            value_len = sizeof(value);
+            if (ht_shm_find(shm, key, strlen(key), value, &value_len))
+            {
+                values_ok &= shm_value_ok(value, value_len, key);
+                found++;
+            }
+        }
+        TEST(values_ok);
+        TEST(HT_OK == ht_shm_add(shm, "after", 5, "crash", 5));
+        TEST(HT_OK == ht_shm_remove(shm, "after", 5));
+        TEST(ht_shm_size(shm) == found);
+        TEST(HT_OK == ht_shm_recover(shm));
+        TEST(ht_shm_size(shm) == found);
+    }
+
+    TEST(HT_OK == ht_shm_close(shm));
+#endif
+}
+
+//--------------------------------------
+// test large page backed tables
+//--------------------------------------
+void test_large_table()
+{
+    SUITE("Large Table");
+
+    static int values[1024];
+    HashTable *ht = ht_create();
+    TEST(ht != NULL);
+
+    TEST(HT_FAIL == ht_set_numa_policy(ht, 42));
+    TEST(HT_OK == ht_set_numa_policy(ht, HT_NUMA_INTERLEAVE));
+
+    // grow until the backing array crosses the large table threshold
+    while (ht_capacity(ht) * sizeof(HashTable_Entry) < HT_LARGE_TABLE_BYTES)
+    {
+        TEST(ht_grow(ht) != NULL);
+    }
+
+#if HT_LARGE_PAGES == 1 && defined(__linux__)
+    TEST(ht->ext->table_bytes >= HT_LARGE_TABLE_BYTES);
+#endif
+
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        TEST(HT_OK == ht_insert(ht, &values[i], &values[i]));
+    }
+
+    int found = 0;
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        found += ht_find(ht, &values[i]) == &values[i];
+    }
+    TEST(found == ARRAY_SIZE(values));
+
+    // shrinking back below the threshold releases the mapping
+    while (ht_shrink(ht) != NULL)
+        ;
+    TEST(ht_size(ht) == ARRAY_SIZE(values));
+
+    ht_free(ht);
+}
+
+//--------------------------------------
+// allocator that tracks outstanding bytes
+//--------------------------------------
+static void *counting_alloc(void *ctx, size_t size)
+{
+    *(size_t*)ctx += size;
+    return malloc(size);
+}
+
+static void *counting_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    *(size_t*)ctx += new_size - old_size;
+    return realloc(ptr, new_size);
+}
+
+static void counting_free(void *ctx, void *ptr, size_t size)
+{
+    *(size_t*)ctx -= size;
+    free(ptr);
+}
+
+//--------------------------------------
+// test per-table allocators
+//--------------------------------------
+void test_allocators()
+{
+    SUITE("Allocators");
+
+    static int values[100];
+    size_t outstanding = 0;
+    ht_allocator counting = { counting_alloc, counting_realloc, counting_free, &outstanding };
+
+    HashTable *ht = ht_create_with_allocator(&counting);
+    TEST(ht != NULL);
+    TEST(outstanding > 0);
+
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        ht_insert(ht, &values[i], &values[i]);
+    }
+    TEST(ht_size(ht) == ARRAY_SIZE(values));
+    TEST(ht_find(ht, &values[50]) == &values[50]);
+
+    // views and the pages they copy come from the table's allocator
+    size_t before = outstanding;
+    HashTable *view = ht_snapshot(ht);
+    TEST(view != NULL);
+    TEST(outstanding > before);
+
+    size_t shared = outstanding;
+    TEST(HT_OK == ht_remove(ht, &values[50]));
+    TEST(outstanding > shared);
+    TEST(ht_find(view, &values[50]) == &values[50]);
+
+    // the view outlives its table and returns the array when released
+    TEST(HT_OK == ht_free(ht));
+    TEST(outstanding > 0);
+    TEST(HT_OK == ht_snapshot_free(view));
+    TEST(outstanding == 0);
+
+    // tiny tables copy their entries into the view
+    ht = ht_create_with_allocator(&counting);
+    TEST(HT_OK == ht_insert(ht, &values[0], &values[0]));
+    view = ht_snapshot(ht);
+    TEST(view != NULL);
+    TEST(ht_find(view, &values[0]) == &values[0]);
+    TEST(HT_OK == ht_snapshot_free(view));
+
+    // table struct and backing array are both returned
+    TEST(HT_OK == ht_free(ht));
+    TEST(outstanding == 0);
+
+    // so are a set's
+    HashSet *set = ht_set_create_with_allocator(HT_HASH_NULL, NULL, &counting);
+    TEST(set != NULL);
+
+    for (int i = 0; i < ARRAY_SIZE(values); i++)
+    {
+        ht_set_add(set, &values[i]);
+    }
+    TEST(ht_set_size(set) == ARRAY_SIZE(values));
+    TEST(outstanding >= sizeof(HashSet) + ARRAY_SIZE(values) * sizeof(HashSet_Entry));
+
+    TEST(HT_OK == ht_set_free(set));
+    TEST(outstanding == 0);
+
+    // many scratch tables released by a single reset
+    ht_arena arena;
+    ht_arena_init(&arena, 0);
+
+    for (int round = 0; round < 3; round++)
+    {
+        HashTable *tables[8];
+        for (int t = 0; t < ARRAY_SIZE(tables); t++)
+        {
+            tables[t] = ht_create_with_allocator(ht_arena_allocator(&arena));
+            TEST(tables[t] != NULL);
+
+            for (int i = 0; i < ARRAY_SIZE(values); i++)
+            {
+                ht_insert(tables[t], &values[i], &values[i]);
+            }
+        }
+
+        int found = 0;
+        for (int t = 0; t < ARRAY_SIZE(tables); t++)
+        {
+            for (int i = 0; i < ARRAY_SIZE(values); i++)
+            {
+                found += ht_find(tables[t], &values[i]) == &values[i];
+            }
+        }
+        TEST(found == ARRAY_SIZE(tables) * ARRAY_SIZE(values));
+
+        ht_arena_reset(&arena);
+        TEST(arena.used == 0);
+    }
+
+    ht_arena_destroy(&arena);
+    TEST(arena.blocks == NULL);
+}
+
 //--------------------------------------
 //
 //--------------------------------------
@@ -316,6 +2197,25 @@ void test_main(int argc, char *argv[])
     test_iterate();
     test_remove();
     test_tombstone_reuse();
+    test_tiny();
+    test_find_or_insert();
+    test_batch_iterate();
+    test_trace();
+    test_events();
+    test_cuckoo();
+    test_cuckoo_stash();
+    test_bloom();
+    test_hash_set();
+    test_hash_analyze();
+    test_clone_merge();
+    test_clear();
+    test_cache();
+    test_snapshot();
+    test_seed();
+    test_shm();
+    test_counter();
+    test_large_table();
+    test_allocators();
     ht_stats(ht);
     test_destroy();
 